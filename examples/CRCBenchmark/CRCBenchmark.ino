@@ -0,0 +1,84 @@
+/*
+  CRC benchmark
+
+  Times the CRC-16 kernels of the library on frames of 8 to 256 bytes and
+  prints the cycles spent per byte, to choose MODBUS_CRC16_KERNEL for a board.
+  The kernels are called directly, so all of them are linked in this sketch
+  whatever the selection.
+
+  The carry-less multiplication kernel is only built for hosts with the
+  instructions enabled, see modbus-crc.h.
+*/
+
+#include <ModbusRTUServer.hpp>
+#include <libmodbus/modbus-crc.h>
+
+typedef uint16_t (*Kernel)(uint16_t crc, const uint8_t *buffer, size_t length);
+
+struct
+{
+  const char *name;
+  Kernel kernel;
+} kernels[] = {
+    {"table pair", modbus_crc16_table_pair},
+    {"table16", modbus_crc16_table16},
+    {"slice4", modbus_crc16_slice4},
+    {"slice8", modbus_crc16_slice8},
+#if MODBUS_CRC16_HAVE_CLMUL
+    {"clmul", modbus_crc16_clmul},
+#endif
+};
+
+const size_t frameSizes[] = {8, 16, 32, 64, 128, 256};
+
+uint8_t frame[256];
+
+// Keeps the compiler from dropping the calls
+volatile uint16_t sink;
+
+void setup()
+{
+  Serial.begin(115200);
+  while (!Serial)
+    ;
+
+  for (size_t i = 0; i < sizeof(frame); i++)
+  {
+    frame[i] = (uint8_t)(i * 151 + 7);
+  }
+
+  Serial.print(F("cycles/byte"));
+  for (size_t s = 0; s < sizeof(frameSizes) / sizeof(frameSizes[0]); s++)
+  {
+    Serial.print('\t');
+    Serial.print(frameSizes[s]);
+  }
+  Serial.println();
+
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+  {
+    Serial.print(kernels[k].name);
+
+    for (size_t s = 0; s < sizeof(frameSizes) / sizeof(frameSizes[0]); s++)
+    {
+      // About 64 KiB per measurement, long enough for the resolution of micros()
+      unsigned long iterations = 65536UL / frameSizes[s];
+      unsigned long start = micros();
+
+      for (unsigned long i = 0; i < iterations; i++)
+      {
+        sink = kernels[k].kernel(0xFFFF, frame, frameSizes[s]);
+      }
+
+      unsigned long elapsed = micros() - start;
+
+      Serial.print('\t');
+      Serial.print((float)elapsed * (F_CPU / 1000000UL) / (iterations * frameSizes[s]), 1);
+    }
+    Serial.println();
+  }
+}
+
+void loop()
+{
+}
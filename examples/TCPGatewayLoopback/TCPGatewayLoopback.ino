@@ -0,0 +1,239 @@
+/*
+  TCP gateway loopback
+
+  Runs a Modbus TCP to RTU gateway and the serial slave it forwards to in
+  one process on a Linux host, so the tty transport and the gateway can be
+  tried without any hardware. Two pseudo-terminals stand for the serial
+  ports of the gateway and of the slave, and the sketch copies the bytes
+  between them as a cable would. A Modbus TCP client on the loopback
+  interface then writes a holding register of the slave through the
+  gateway every second, reads it back and prints the round trip.
+
+  Needs a core running sketches on Linux. Any Modbus TCP client can reach
+  the slave through port 5020 while the sketch runs.
+*/
+
+#include <ModbusRTUServer.hpp>
+
+#if !MODBUS_TCP || !MODBUS_RTU_TTY
+#error "The gateway and the tty transport are only built on Linux"
+#endif
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+const int port = 5020;
+const int unit = 1;
+const unsigned long baudrate = 115200;
+
+// Paths of the slave sides of the pseudo-terminals, the serial ports
+char slaveTty[32];
+char gatewayTty[32];
+
+// Master sides, the ends of the cable
+int slaveLine = -1;
+int gatewayLine = -1;
+
+ModbusRTUServerClass slave(slaveTty);
+ModbusTCPGatewayClass gateway(gatewayTty);
+
+int client = -1;
+
+enum
+{
+  IDLE,
+  WRITING,
+  READING
+} state = IDLE;
+
+uint16_t transactionId;
+uint16_t value;
+uint8_t response[MODBUS_TCP_MAX_ADU_LENGTH];
+size_t received;
+unsigned long sentAt;
+unsigned long writeUs;
+
+// Opens a pseudo-terminal, returns its master side and the path of its slave side in name
+int openPty(char *name, size_t size)
+{
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+  if (fd == -1)
+  {
+    return -1;
+  }
+  if (grantpt(fd) == -1 || unlockpt(fd) == -1 || ptsname_r(fd, name, size) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+
+  return fd;
+}
+
+// Copies what was sent on one line to the other
+void carry(int from, int to)
+{
+  uint8_t buffer[MODBUS_RTU_MAX_ADU_LENGTH];
+  ssize_t length = read(from, buffer, sizeof(buffer));
+
+  if (length > 0)
+  {
+    write(to, buffer, length);
+  }
+}
+
+void sendRequest(uint8_t function, uint16_t address, uint16_t data)
+{
+  uint8_t request[] = {
+      (uint8_t)(++transactionId >> 8), (uint8_t)transactionId, 0, 0, 0, 6, unit, function,
+      (uint8_t)(address >> 8), (uint8_t)address, (uint8_t)(data >> 8), (uint8_t)data};
+
+  send(client, request, sizeof(request), 0);
+  received = 0;
+  sentAt = micros();
+}
+
+// Returns true once the whole response is received
+bool receiveResponse()
+{
+  ssize_t length = recv(client, response + received, sizeof(response) - received, MSG_DONTWAIT);
+
+  if (length > 0)
+  {
+    received += length;
+  }
+
+  return received >= 6 && received >= 6 + (size_t)((response[4] << 8) | response[5]);
+}
+
+// Returns true if the response is an exception, which is printed
+bool exception()
+{
+  if (!(response[7] & 0x80))
+  {
+    return false;
+  }
+
+  Serial.print(F("Exception "));
+  Serial.println(response[8]);
+
+  return true;
+}
+
+void setup()
+{
+  Serial.begin(115200);
+
+  slaveLine = openPty(slaveTty, sizeof(slaveTty));
+  gatewayLine = openPty(gatewayTty, sizeof(gatewayTty));
+  if (slaveLine == -1 || gatewayLine == -1)
+  {
+    Serial.println(F("Failed to open the pseudo-terminals"));
+    while (1)
+      ;
+  }
+
+  if (!slave.begin(unit, baudrate) || slave.configureHoldingRegisters(0, 10) != 1)
+  {
+    Serial.println(F("Failed to start the slave"));
+    while (1)
+      ;
+  }
+
+  if (!gateway.begin(baudrate, port, "127.0.0.1"))
+  {
+    Serial.println(F("Failed to start the gateway"));
+    while (1)
+      ;
+  }
+
+  // Waits in the backlog of the gateway until its first poll
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  client = socket(AF_INET, SOCK_STREAM, 0);
+  if (client == -1 || connect(client, (struct sockaddr *)&address, sizeof(address)) == -1)
+  {
+    Serial.println(F("Failed to connect to the gateway"));
+    while (1)
+      ;
+  }
+  int one = 1;
+  setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  Serial.print(F("Slave on "));
+  Serial.print(slaveTty);
+  Serial.print(F(", gateway on "));
+  Serial.println(gatewayTty);
+}
+
+void loop()
+{
+  carry(gatewayLine, slaveLine);
+  carry(slaveLine, gatewayLine);
+  slave.poll();
+  gateway.poll();
+
+  if (state != IDLE && micros() - sentAt >= 2000000UL)
+  {
+    Serial.println(F("No response"));
+    sentAt = micros();
+    state = IDLE;
+  }
+
+  switch (state)
+  {
+  case IDLE:
+    if (micros() - sentAt >= 1000000UL)
+    {
+      sendRequest(MODBUS_FC_WRITE_SINGLE_REGISTER, 0, ++value);
+      state = WRITING;
+    }
+    break;
+
+  case WRITING:
+    if (receiveResponse())
+    {
+      writeUs = micros() - sentAt;
+      if (exception())
+      {
+        state = IDLE;
+        break;
+      }
+      sendRequest(MODBUS_FC_READ_HOLDING_REGISTERS, 0, 1);
+      state = READING;
+    }
+    break;
+
+  case READING:
+    if (receiveResponse())
+    {
+      if (!exception())
+      {
+        uint16_t readBack = (response[9] << 8) | response[10];
+
+        Serial.print(F("Wrote "));
+        Serial.print(value);
+        Serial.print(F(" in "));
+        Serial.print(writeUs);
+        Serial.print(F(" us, read back "));
+        Serial.print(readBack);
+        Serial.print(F(" in "));
+        Serial.print(micros() - sentAt);
+        Serial.print(F(" us"));
+        Serial.println(readBack == value && slave.holdingRegisterRead(0) == value ? "" : " MISMATCH");
+      }
+      sentAt = micros();
+      state = IDLE;
+    }
+    break;
+  }
+}
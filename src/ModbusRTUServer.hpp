@@ -22,5 +22,8 @@
 #define _MODBUS_RTU_SERVER_SRC_MODBUS_RTU_SERVER_HPP
 
 #include "ModbusServerClass.hpp"
+#include "ModbusServerTemplate.hpp"
+#include "ModbusTCPServerClass.hpp"
+#include "ModbusTCPGatewayClass.hpp"
 
 #endif
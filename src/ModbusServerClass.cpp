@@ -36,37 +36,72 @@ ModbusRTUServerClass::ModbusRTUServerClass(
     uint8_t receiver_enable_pin) :
 
                                    RS485_{RS485Class(hwSerial, tx_pin, driver_enable_pin, receiver_enable_pin)},
-                                   mb_(NULL)
+#if MODBUS_RTU_TTY
+                                   device_(NULL),
+#endif
+                                   flushMode_(MODBUS_FLUSH_T35),
+                                   retryWindow_(0),
+                                   responseCache_(0),
+                                   functions_(NULL),
+                                   nbFunctions_(0),
+                                   units_(NULL),
+                                   nbUnits_(0),
+                                   listenCallback_(NULL),
+                                   listenArg_(NULL),
+                                   mb_(NULL),
+                                   tableStorage_(TABLES_HEAP),
+                                   arena_(NULL)
 {
   memset(&mbMapping_, 0x00, sizeof(mbMapping_));
 }
 
+#if MODBUS_RTU_TTY
+ModbusRTUServerClass::ModbusRTUServerClass(const char *device, char parity, int data_bit, int stop_bit) :
+
+                                   device_(device),
+                                   parity_(parity),
+                                   dataBit_(data_bit),
+                                   stopBit_(stop_bit),
+                                   flushMode_(MODBUS_FLUSH_T35),
+                                   retryWindow_(0),
+                                   responseCache_(0),
+                                   functions_(NULL),
+                                   nbFunctions_(0),
+                                   units_(NULL),
+                                   nbUnits_(0),
+                                   listenCallback_(NULL),
+                                   listenArg_(NULL),
+                                   mb_(NULL),
+                                   tableStorage_(TABLES_HEAP),
+                                   arena_(NULL)
+{
+  memset(&mbMapping_, 0x00, sizeof(mbMapping_));
+}
+#endif
+
 ModbusRTUServerClass::~ModbusRTUServerClass()
 {
-  if (mbMapping_.tab_bits != NULL)
-  {
-    free(mbMapping_.tab_bits);
-  }
+  freeTables();
 
-  if (mbMapping_.tab_input_bits != NULL)
-  {
-    free(mbMapping_.tab_input_bits);
-  }
+  // Left by freeTables() for static tables, whose read handlers outlive restarts.
+  modbus_mapping_free_read_handlers(&mbMapping_);
+  modbus_mapping_set_dirty_tracking(&mbMapping_, MODBUS_TABLE_BITS, -1);
+  modbus_mapping_set_dirty_tracking(&mbMapping_, MODBUS_TABLE_REGISTERS, -1);
 
-  if (mbMapping_.tab_input_registers != NULL)
+  if (mb_ != NULL)
   {
-    free(mbMapping_.tab_input_registers);
+    modbus_free(mb_);
   }
 
-  if (mbMapping_.tab_registers != NULL)
-  {
-    free(mbMapping_.tab_registers);
-  }
+  free(functions_);
+  free(units_);
 
-  if (mb_ != NULL)
+#if MODBUS_RTU_TTY
+  if (device_ == NULL)
   {
-    modbus_free(mb_);
+    RS485_.~RS485Class();
   }
+#endif
 }
 
 ////////////
@@ -77,7 +112,7 @@ ModbusRTUServerClass::~ModbusRTUServerClass()
 
 int ModbusRTUServerClass::begin(int id, unsigned long baudrate, uint16_t config)
 {
-  // This test is kind of redundant, since `modbusBegin` won't return non-true, but that might change, so I'll leave here.
+  // Fails when the context can't be allocated or a tty can't be opened.
   if (!modbusBegin(id, baudrate, config))
   {
     return 0;
@@ -108,21 +143,124 @@ int ModbusRTUServerClass::poll()
   return 0;
 }
 
+int ModbusRTUServerClass::poll(unsigned long timeout_ms)
+{
+  unsigned long start = millis();
+
+  if (mb_ == NULL)
+  {
+    return 0;
+  }
+
+  for (;;)
+  {
+    unsigned long elapsed;
+
+    if (poll())
+    {
+      return 1;
+    }
+
+    elapsed = millis() - start;
+    if (elapsed >= timeout_ms)
+    {
+      return 0;
+    }
+
+    // In steps of at most a second, the wait is in microseconds.
+    modbus_rtu_wait(mb_, (timeout_ms - elapsed < 1000 ? timeout_ms - elapsed : 1000) * 1000UL);
+  }
+}
+
 void ModbusRTUServerClass::setRS485Pins(int tx_pin, int de_pin, int re_pin)
 {
   modbus_set_rs485_pins(mb_, tx_pin, de_pin, re_pin);
 }
 
+int ModbusRTUServerClass::setFlushMode(int mode)
+{
+  if (mode != MODBUS_FLUSH_T35 && mode != MODBUS_FLUSH_TIMEOUT)
+  {
+    errno = EINVAL;
+
+    return 0;
+  }
+
+  flushMode_ = (modbus_flush_mode)mode;
+
+  if (mb_ != NULL)
+  {
+    modbus_set_flush_mode(mb_, flushMode_);
+  }
+
+  return 1;
+}
+
+int ModbusRTUServerClass::setRetryWindow(unsigned long window_ms)
+{
+  if (mb_ != NULL && modbus_set_retry_window(mb_, window_ms) == -1)
+  {
+    return 0;
+  }
+
+  retryWindow_ = window_ms;
+
+  return 1;
+}
+
+int ModbusRTUServerClass::setResponseCache(int nb_entries)
+{
+  if (nb_entries < 0 || nb_entries > MODBUS_MAX_CACHED_RESPONSES)
+  {
+    errno = EINVAL;
+
+    return 0;
+  }
+
+  if (mb_ != NULL && modbus_set_response_cache(mb_, nb_entries) == -1)
+  {
+    return 0;
+  }
+
+  responseCache_ = nb_entries;
+
+  return 1;
+}
+
+int ModbusRTUServerClass::configureStorage(int flags)
+{
+  int changed = flags ^ mbMapping_.flags;
+
+  if (((changed & MODBUS_MAPPING_PACKED_BITS) &&
+       (mbMapping_.tab_bits != NULL || mbMapping_.nb_segments[MODBUS_TABLE_BITS] > 0)) ||
+      ((changed & MODBUS_MAPPING_PACKED_INPUT_BITS) &&
+       (mbMapping_.tab_input_bits != NULL || mbMapping_.nb_segments[MODBUS_TABLE_INPUT_BITS] > 0)) ||
+      ((changed & MODBUS_MAPPING_WIRE_REGISTERS) &&
+       (mbMapping_.tab_registers != NULL || mbMapping_.nb_segments[MODBUS_TABLE_REGISTERS] > 0)) ||
+      ((changed & MODBUS_MAPPING_WIRE_INPUT_REGISTERS) &&
+       (mbMapping_.tab_input_registers != NULL || mbMapping_.nb_segments[MODBUS_TABLE_INPUT_REGISTERS] > 0)))
+  {
+    errno = EINVAL;
+
+    return -1;
+  }
+
+  mbMapping_.flags = flags;
+
+  return 1;
+}
+
 int ModbusRTUServerClass::configureCoils(int start_address, int nb)
 {
-  if (start_address < 0 || nb < 1)
+  if (start_address < 0 || nb < 1 || tableStorage_ != TABLES_HEAP ||
+      modbus_mapping_check_window(&mbMapping_, MODBUS_TABLE_BITS, start_address, nb) == -1)
   {
     errno = EINVAL;
 
     return -1;
   }
 
-  size_t s = sizeof(mbMapping_.tab_bits[0]) * nb;
+  size_t s = (mbMapping_.flags & MODBUS_MAPPING_PACKED_BITS) ? MODBUS_PACKED_BITS_SIZE(nb) : sizeof(mbMapping_.tab_bits[0]) * nb;
 
   mbMapping_.tab_bits = (uint8_t *)realloc(mbMapping_.tab_bits, s);
 
@@ -137,20 +275,22 @@ int ModbusRTUServerClass::configureCoils(int start_address, int nb)
   memset(mbMapping_.tab_bits, 0x00, s);
   mbMapping_.start_bits = start_address;
   mbMapping_.nb_bits = nb;
+  mbMapping_.generation = mbMapping_.generation + 1;
 
-  return 1;
+  return resizeDirtyTracking(MODBUS_TABLE_BITS);
 }
 
 int ModbusRTUServerClass::configureDiscreteInputs(int start_address, int nb)
 {
-  if (start_address < 0 || nb < 1)
+  if (start_address < 0 || nb < 1 || tableStorage_ != TABLES_HEAP ||
+      modbus_mapping_check_window(&mbMapping_, MODBUS_TABLE_INPUT_BITS, start_address, nb) == -1)
   {
     errno = EINVAL;
 
     return -1;
   }
 
-  size_t s = sizeof(mbMapping_.tab_input_bits[0]) * nb;
+  size_t s = (mbMapping_.flags & MODBUS_MAPPING_PACKED_INPUT_BITS) ? MODBUS_PACKED_BITS_SIZE(nb) : sizeof(mbMapping_.tab_input_bits[0]) * nb;
 
   mbMapping_.tab_input_bits = (uint8_t *)realloc(mbMapping_.tab_input_bits, s);
 
@@ -165,13 +305,15 @@ int ModbusRTUServerClass::configureDiscreteInputs(int start_address, int nb)
   memset(mbMapping_.tab_input_bits, 0x00, s);
   mbMapping_.start_input_bits = start_address;
   mbMapping_.nb_input_bits = nb;
+  mbMapping_.generation = mbMapping_.generation + 1;
 
   return 1;
 }
 
 int ModbusRTUServerClass::configureHoldingRegisters(int start_address, int nb)
 {
-  if (start_address < 0 || nb < 1)
+  if (start_address < 0 || nb < 1 || tableStorage_ != TABLES_HEAP ||
+      modbus_mapping_check_window(&mbMapping_, MODBUS_TABLE_REGISTERS, start_address, nb) == -1)
   {
     errno = EINVAL;
 
@@ -193,13 +335,15 @@ int ModbusRTUServerClass::configureHoldingRegisters(int start_address, int nb)
   memset(mbMapping_.tab_registers, 0x00, s);
   mbMapping_.start_registers = start_address;
   mbMapping_.nb_registers = nb;
+  mbMapping_.generation = mbMapping_.generation + 1;
 
-  return 1;
+  return resizeDirtyTracking(MODBUS_TABLE_REGISTERS);
 }
 
 int ModbusRTUServerClass::configureInputRegisters(int start_address, int nb)
 {
-  if (start_address < 0 || nb < 1)
+  if (start_address < 0 || nb < 1 || tableStorage_ != TABLES_HEAP ||
+      modbus_mapping_check_window(&mbMapping_, MODBUS_TABLE_INPUT_REGISTERS, start_address, nb) == -1)
   {
     errno = EINVAL;
 
@@ -221,88 +365,359 @@ int ModbusRTUServerClass::configureInputRegisters(int start_address, int nb)
   memset(mbMapping_.tab_input_registers, 0x00, s);
   mbMapping_.start_input_registers = start_address;
   mbMapping_.nb_input_registers = nb;
+  mbMapping_.generation = mbMapping_.generation + 1;
+
+  return 1;
+}
+
+int ModbusRTUServerClass::configureTables(int coils_start, int nb_coils,
+                                          int discrete_inputs_start, int nb_discrete_inputs,
+                                          int holding_registers_start, int nb_holding_registers,
+                                          int input_registers_start, int nb_input_registers,
+                                          void *buffer, size_t size)
+{
+  if (coils_start < 0 || nb_coils < 0 ||
+      discrete_inputs_start < 0 || nb_discrete_inputs < 0 ||
+      holding_registers_start < 0 || nb_holding_registers < 0 ||
+      input_registers_start < 0 || nb_input_registers < 0 ||
+      tableStorage_ == TABLES_STATIC)
+  {
+    errno = EINVAL;
+
+    return -1;
+  }
+
+  // A caller's buffer too small leaves the tables in use as they are.
+  if (buffer != NULL &&
+      size < (MODBUS_ARENA_ALIGN((uintptr_t)buffer) - (uintptr_t)buffer) +
+                 MODBUS_MAPPING_ARENA_SIZE(mbMapping_.flags, nb_coils, nb_discrete_inputs,
+                                           nb_holding_registers, nb_input_registers))
+  {
+    errno = EINVAL;
+
+    return -1;
+  }
+
+  freeTables();
+
+  if (buffer == NULL)
+  {
+    size = MODBUS_MAPPING_ARENA_SIZE(mbMapping_.flags, nb_coils, nb_discrete_inputs,
+                                     nb_holding_registers, nb_input_registers) +
+           MODBUS_ARENA_ALIGNMENT - 1;
+
+    arena_ = malloc(size);
+
+    if (arena_ == NULL)
+    {
+      return 0;
+    }
+
+    buffer = arena_;
+  }
+
+  if (modbus_mapping_init_arena(&mbMapping_, buffer, size,
+                                coils_start, nb_coils, discrete_inputs_start, nb_discrete_inputs,
+                                holding_registers_start, nb_holding_registers,
+                                input_registers_start, nb_input_registers) == -1)
+  {
+    return -1;
+  }
+
+  tableStorage_ = arena_ != NULL ? TABLES_ARENA : TABLES_EXTERNAL;
+
+  return 1;
+}
+
+void ModbusRTUServerClass::onWrite(modbus_write_callback_t callback, void *arg)
+{
+  modbus_mapping_set_write_callback(&mbMapping_, callback, arg);
+}
+
+int ModbusRTUServerClass::addReadHandler(int table, int start_address, int nb, modbus_read_callback_t handler,
+                                         void *arg, unsigned long ttl_ms)
+{
+  if (modbus_mapping_add_read_handler(&mbMapping_, table, start_address, nb, handler, arg, ttl_ms) == -1)
+  {
+    return errno == ENOMEM ? 0 : -1;
+  }
+
+  return 1;
+}
+
+void ModbusRTUServerClass::beginUpdate()
+{
+  modbus_mapping_begin_update(&mbMapping_);
+}
+
+void ModbusRTUServerClass::endUpdate()
+{
+  modbus_mapping_end_update(&mbMapping_);
+}
+
+int ModbusRTUServerClass::configureDirtyTracking(int table, int block_shift)
+{
+  if (modbus_mapping_set_dirty_tracking(&mbMapping_, table, block_shift) == -1)
+  {
+    return errno == ENOMEM ? 0 : -1;
+  }
+
+  return 1;
+}
+
+int ModbusRTUServerClass::forEachDirty(int table, modbus_write_callback_t callback, void *arg)
+{
+  return modbus_mapping_for_each_dirty(&mbMapping_, table, callback, arg);
+}
+
+void ModbusRTUServerClass::clearDirty(int table)
+{
+  modbus_mapping_clear_dirty(&mbMapping_, table);
+}
+
+int ModbusRTUServerClass::registerFunction(int function, modbus_function_handler_t handler, void *arg,
+                                           int meta_length, bool byte_count)
+{
+  int i;
+
+  // Checked here too, the function may not reach a context before begin().
+  if (!MODBUS_IS_USER_FUNCTION(function) || meta_length < 0 || meta_length > MODBUS_MAX_PDU_LENGTH - 1 ||
+      (byte_count && meta_length < 1))
+  {
+    errno = EINVAL;
+
+    return -1;
+  }
+
+  i = 0;
+  while (i < nbFunctions_ && functions_[i].function != function)
+  {
+    i++;
+  }
+
+  if (handler != NULL && i == nbFunctions_)
+  {
+    UserFunction *functions = (UserFunction *)realloc(functions_, (nbFunctions_ + 1) * sizeof(UserFunction));
+
+    if (functions == NULL)
+    {
+      errno = ENOMEM;
+
+      return 0;
+    }
+
+    functions_ = functions;
+  }
+
+  if (mb_ != NULL && modbus_register_function(mb_, function, handler, arg, meta_length, byte_count) == -1)
+  {
+    return errno == ENOMEM ? 0 : -1;
+  }
+
+  if (handler == NULL)
+  {
+    if (i < nbFunctions_)
+    {
+      functions_[i] = functions_[--nbFunctions_];
+    }
+
+    return 1;
+  }
+
+  functions_[i].function = function;
+  functions_[i].metaLength = meta_length;
+  functions_[i].byteCount = byte_count;
+  functions_[i].handler = handler;
+  functions_[i].arg = arg;
+  if (i == nbFunctions_)
+  {
+    nbFunctions_++;
+  }
+
+  return 1;
+}
+
+int ModbusRTUServerClass::addUnit(int id, modbus_mapping_t *mapping)
+{
+  int i;
+
+  if (id < 1 || id > 247)
+  {
+    errno = EINVAL;
+
+    return -1;
+  }
+
+  i = 0;
+  while (i < nbUnits_ && units_[i].id != id)
+  {
+    i++;
+  }
+
+  if (mapping != NULL && i == nbUnits_)
+  {
+    Unit *units = nbUnits_ < MODBUS_MAX_UNITS ? (Unit *)realloc(units_, (nbUnits_ + 1) * sizeof(Unit)) : NULL;
+
+    if (units == NULL)
+    {
+      errno = ENOMEM;
+
+      return 0;
+    }
+
+    units_ = units;
+  }
+
+  if (mb_ != NULL && modbus_add_unit(mb_, id, mapping) == -1)
+  {
+    return errno == ENOMEM ? 0 : -1;
+  }
+
+  if (mapping == NULL)
+  {
+    if (i < nbUnits_)
+    {
+      units_[i] = units_[--nbUnits_];
+    }
+
+    return 1;
+  }
+
+  units_[i].id = id;
+  units_[i].mapping = mapping;
+  if (i == nbUnits_)
+  {
+    nbUnits_++;
+  }
+
+  return 1;
+}
+
+int ModbusRTUServerClass::listenOnly(modbus_transaction_callback_t callback, void *arg)
+{
+  if (mb_ != NULL && modbus_rtu_set_listen_only(mb_, callback, arg) == -1)
+  {
+    return errno == ENOMEM ? 0 : -1;
+  }
+
+  listenCallback_ = callback;
+  listenArg_ = arg;
 
   return 1;
 }
 
+int ModbusRTUServerClass::addCoilSegment(int start_address, int nb)
+{
+  return addSegment(MODBUS_TABLE_BITS, start_address, nb);
+}
+
+int ModbusRTUServerClass::addDiscreteInputSegment(int start_address, int nb)
+{
+  return addSegment(MODBUS_TABLE_INPUT_BITS, start_address, nb);
+}
+
+int ModbusRTUServerClass::addHoldingRegisterSegment(int start_address, int nb)
+{
+  return addSegment(MODBUS_TABLE_REGISTERS, start_address, nb);
+}
+
+int ModbusRTUServerClass::addInputRegisterSegment(int start_address, int nb)
+{
+  return addSegment(MODBUS_TABLE_INPUT_REGISTERS, start_address, nb);
+}
+
 int ModbusRTUServerClass::coilRead(int address)
 {
-  if (mbMapping_.start_bits > address ||
-      (mbMapping_.start_bits + mbMapping_.nb_bits) < (address + 1))
+  int index;
+  const uint8_t *tab = (const uint8_t *)modbus_mapping_lookup(&mbMapping_, MODBUS_TABLE_BITS, address, 1, &index);
+
+  if (tab == NULL)
   {
     errno = EMBXILADD;
 
     return -1;
   }
 
-  return mbMapping_.tab_bits[address - mbMapping_.start_bits];
+  return tableBitRead(tab, index, mbMapping_.flags & MODBUS_MAPPING_PACKED_BITS);
 }
 
 int ModbusRTUServerClass::discreteInputRead(int address)
 {
-  if (mbMapping_.start_input_bits > address ||
-      (mbMapping_.start_input_bits + mbMapping_.nb_input_bits) < (address + 1))
+  int index;
+  const uint8_t *tab = (const uint8_t *)modbus_mapping_lookup(&mbMapping_, MODBUS_TABLE_INPUT_BITS, address, 1, &index);
+
+  if (tab == NULL)
   {
     errno = EMBXILADD;
 
     return -1;
   }
 
-  return mbMapping_.tab_input_bits[address - mbMapping_.start_input_bits];
+  return tableBitRead(tab, index, mbMapping_.flags & MODBUS_MAPPING_PACKED_INPUT_BITS);
 }
 
 long ModbusRTUServerClass::holdingRegisterRead(int address)
 {
-  if (mbMapping_.start_registers > address ||
-      (mbMapping_.start_registers + mbMapping_.nb_registers) < (address + 1))
+  int index;
+  const uint16_t *tab = (const uint16_t *)modbus_mapping_lookup(&mbMapping_, MODBUS_TABLE_REGISTERS, address, 1, &index);
+
+  if (tab == NULL)
   {
     errno = EMBXILADD;
 
     return -1;
   }
 
-  return mbMapping_.tab_registers[address - mbMapping_.start_registers];
+  return tableRegisterRead(tab, index, mbMapping_.flags & MODBUS_MAPPING_WIRE_REGISTERS);
 }
 
 long ModbusRTUServerClass::inputRegisterRead(int address)
 {
-  if (mbMapping_.start_input_registers > address ||
-      (mbMapping_.start_input_registers + mbMapping_.nb_input_registers) < (address + 1))
+  int index;
+  const uint16_t *tab = (const uint16_t *)modbus_mapping_lookup(&mbMapping_, MODBUS_TABLE_INPUT_REGISTERS, address, 1, &index);
+
+  if (tab == NULL)
   {
     errno = EMBXILADD;
 
     return -1;
   }
 
-  return mbMapping_.tab_input_registers[address - mbMapping_.start_input_registers];
+  return tableRegisterRead(tab, index, mbMapping_.flags & MODBUS_MAPPING_WIRE_INPUT_REGISTERS);
 }
 
 int ModbusRTUServerClass::coilWrite(int address, uint8_t value)
 {
-  if (mbMapping_.start_bits > address ||
-      (mbMapping_.start_bits + mbMapping_.nb_bits) < (address + 1))
+  int index;
+  uint8_t *tab = (uint8_t *)modbus_mapping_lookup(&mbMapping_, MODBUS_TABLE_BITS, address, 1, &index);
+
+  if (tab == NULL)
   {
     errno = EMBXILADD;
 
     return 0;
   }
 
-  mbMapping_.tab_bits[address - mbMapping_.start_bits] = value;
+  tableBitWrite(tab, index, value, mbMapping_.flags & MODBUS_MAPPING_PACKED_BITS);
+  mbMapping_.generation = mbMapping_.generation + 1;
 
   return 1;
 }
 
 int ModbusRTUServerClass::holdingRegisterWrite(int address, uint16_t value)
 {
-  if (mbMapping_.start_registers > address ||
-      (mbMapping_.start_registers + mbMapping_.nb_registers) < (address + 1))
+  int index;
+  uint16_t *tab = (uint16_t *)modbus_mapping_lookup(&mbMapping_, MODBUS_TABLE_REGISTERS, address, 1, &index);
+
+  if (tab == NULL)
   {
     errno = EMBXILADD;
 
     return 0;
   }
 
-  mbMapping_.tab_registers[address - mbMapping_.start_registers] = value;
+  tableRegisterWrite(tab, index, value, mbMapping_.flags & MODBUS_MAPPING_WIRE_REGISTERS);
+  mbMapping_.generation = mbMapping_.generation + 1;
 
   return 1;
 }
@@ -329,34 +744,120 @@ int ModbusRTUServerClass::registerMaskWrite(int address, uint16_t and_mask, uint
 
 int ModbusRTUServerClass::discreteInputWrite(int address, uint8_t value)
 {
-  if (mbMapping_.start_input_bits > address ||
-      (mbMapping_.start_input_bits + mbMapping_.nb_input_bits) < (address + 1))
+  int index;
+  uint8_t *tab = (uint8_t *)modbus_mapping_lookup(&mbMapping_, MODBUS_TABLE_INPUT_BITS, address, 1, &index);
+
+  if (tab == NULL)
   {
     errno = EMBXILADD;
 
     return 0;
   }
 
-  mbMapping_.tab_input_bits[address - mbMapping_.start_input_bits] = value;
+  tableBitWrite(tab, index, value, mbMapping_.flags & MODBUS_MAPPING_PACKED_INPUT_BITS);
+  mbMapping_.generation = mbMapping_.generation + 1;
 
   return 1;
 }
 
 int ModbusRTUServerClass::inputRegisterWrite(int address, uint16_t value)
 {
-  if (mbMapping_.start_input_registers > address ||
-      (mbMapping_.start_input_registers + mbMapping_.nb_input_registers) < (address + 1))
+  int index;
+  uint16_t *tab = (uint16_t *)modbus_mapping_lookup(&mbMapping_, MODBUS_TABLE_INPUT_REGISTERS, address, 1, &index);
+
+  if (tab == NULL)
   {
     errno = EMBXILADD;
 
     return 0;
   }
 
-  mbMapping_.tab_input_registers[address - mbMapping_.start_input_registers] = value;
+  tableRegisterWrite(tab, index, value, mbMapping_.flags & MODBUS_MAPPING_WIRE_INPUT_REGISTERS);
+  mbMapping_.generation = mbMapping_.generation + 1;
 
   return 1;
 }
 
+int ModbusRTUServerClass::holdingRegistersRead(int address, uint16_t *values, int nb)
+{
+  return registersRead(MODBUS_TABLE_REGISTERS, address, values, nb);
+}
+
+int ModbusRTUServerClass::holdingRegistersRead(int address, uint32_t *values, int nb, int order)
+{
+  return registersRead32(MODBUS_TABLE_REGISTERS, address, values, nb, order);
+}
+
+int ModbusRTUServerClass::holdingRegistersRead(int address, int32_t *values, int nb, int order)
+{
+  return registersRead32(MODBUS_TABLE_REGISTERS, address, values, nb, order);
+}
+
+int ModbusRTUServerClass::holdingRegistersRead(int address, float *values, int nb, int order)
+{
+  return registersRead32(MODBUS_TABLE_REGISTERS, address, values, nb, order);
+}
+
+int ModbusRTUServerClass::inputRegistersRead(int address, uint16_t *values, int nb)
+{
+  return registersRead(MODBUS_TABLE_INPUT_REGISTERS, address, values, nb);
+}
+
+int ModbusRTUServerClass::inputRegistersRead(int address, uint32_t *values, int nb, int order)
+{
+  return registersRead32(MODBUS_TABLE_INPUT_REGISTERS, address, values, nb, order);
+}
+
+int ModbusRTUServerClass::inputRegistersRead(int address, int32_t *values, int nb, int order)
+{
+  return registersRead32(MODBUS_TABLE_INPUT_REGISTERS, address, values, nb, order);
+}
+
+int ModbusRTUServerClass::inputRegistersRead(int address, float *values, int nb, int order)
+{
+  return registersRead32(MODBUS_TABLE_INPUT_REGISTERS, address, values, nb, order);
+}
+
+int ModbusRTUServerClass::holdingRegistersWrite(int address, const uint16_t *values, int nb)
+{
+  return registersWrite(MODBUS_TABLE_REGISTERS, address, values, nb);
+}
+
+int ModbusRTUServerClass::holdingRegistersWrite(int address, const uint32_t *values, int nb, int order)
+{
+  return registersWrite32(MODBUS_TABLE_REGISTERS, address, values, nb, order);
+}
+
+int ModbusRTUServerClass::holdingRegistersWrite(int address, const int32_t *values, int nb, int order)
+{
+  return registersWrite32(MODBUS_TABLE_REGISTERS, address, values, nb, order);
+}
+
+int ModbusRTUServerClass::holdingRegistersWrite(int address, const float *values, int nb, int order)
+{
+  return registersWrite32(MODBUS_TABLE_REGISTERS, address, values, nb, order);
+}
+
+int ModbusRTUServerClass::inputRegistersWrite(int address, const uint16_t *values, int nb)
+{
+  return registersWrite(MODBUS_TABLE_INPUT_REGISTERS, address, values, nb);
+}
+
+int ModbusRTUServerClass::inputRegistersWrite(int address, const uint32_t *values, int nb, int order)
+{
+  return registersWrite32(MODBUS_TABLE_INPUT_REGISTERS, address, values, nb, order);
+}
+
+int ModbusRTUServerClass::inputRegistersWrite(int address, const int32_t *values, int nb, int order)
+{
+  return registersWrite32(MODBUS_TABLE_INPUT_REGISTERS, address, values, nb, order);
+}
+
+int ModbusRTUServerClass::inputRegistersWrite(int address, const float *values, int nb, int order)
+{
+  return registersWrite32(MODBUS_TABLE_INPUT_REGISTERS, address, values, nb, order);
+}
+
 /////////////
 // PRIVATE //
 /////////////
@@ -367,44 +868,272 @@ int ModbusRTUServerClass::modbusBegin(int id, unsigned long baudrate, uint16_t c
 {
   modbusEnd();
 
-  mb_ = modbus_new_rtu(RS485_, baudrate, config);
+#if MODBUS_RTU_TTY
+  if (device_ != NULL)
+  {
+    mb_ = modbus_new_rtu_tty(device_, baudrate, parity_, dataBit_, stopBit_);
+  }
+  else
+#endif
+  {
+    mb_ = modbus_new_rtu(RS485_, baudrate, config);
+  }
+
+  if (mb_ == NULL)
+  {
+    return 0;
+  }
 
   modbus_set_slave(mb_, id);
+  modbus_set_flush_mode(mb_, flushMode_);
+  modbus_set_retry_window(mb_, retryWindow_);
+  modbus_set_response_cache(mb_, responseCache_);
+
+  bool restored = true;
 
-  modbus_connect(mb_);
+  for (int i = 0; i < nbFunctions_; i++)
+  {
+    restored = restored && modbus_register_function(mb_, functions_[i].function, functions_[i].handler, functions_[i].arg,
+                                                    functions_[i].metaLength, functions_[i].byteCount) == 0;
+  }
+
+  for (int i = 0; i < nbUnits_; i++)
+  {
+    restored = restored && modbus_add_unit(mb_, units_[i].id, units_[i].mapping) == 0;
+  }
+
+  if (listenCallback_ != NULL)
+  {
+    restored = restored && modbus_rtu_set_listen_only(mb_, listenCallback_, listenArg_) == 0;
+  }
+
+  if (!restored || modbus_connect(mb_) == -1)
+  {
+    modbus_free(mb_);
+    mb_ = NULL;
+
+    return 0;
+  }
 
   return 1;
 }
 
 void ModbusRTUServerClass::modbusEnd()
 {
-  if (mbMapping_.tab_bits != NULL)
+  freeTables();
+
+  if (mb_ != NULL)
   {
-    free(mbMapping_.tab_bits);
+    modbus_close(mb_);
+    modbus_free(mb_);
+
+    mb_ = NULL;
   }
+}
+
+// SEGMENTS //
 
-  if (mbMapping_.tab_input_bits != NULL)
+int ModbusRTUServerClass::addSegment(int table, int start_address, int nb)
+{
+  if (tableStorage_ == TABLES_STATIC)
   {
-    free(mbMapping_.tab_input_bits);
+    errno = EINVAL;
+
+    return -1;
   }
 
-  if (mbMapping_.tab_input_registers != NULL)
+  if (modbus_mapping_add_segment(&mbMapping_, table, start_address, nb) == -1)
   {
-    free(mbMapping_.tab_input_registers);
+    return errno == ENOMEM ? 0 : -1;
   }
 
-  if (mbMapping_.tab_registers != NULL)
+  return 1;
+}
+
+// DIRTY TRACKING //
+
+int ModbusRTUServerClass::resizeDirtyTracking(int table)
+{
+  if (mbMapping_.dirty[table] != NULL &&
+      modbus_mapping_set_dirty_tracking(&mbMapping_, table, mbMapping_.dirty[table]->shift) == -1)
   {
-    free(mbMapping_.tab_registers);
+    return 0;
   }
 
-  memset(&mbMapping_, 0x00, sizeof(mbMapping_));
+  return 1;
+}
 
-  if (mb_ != NULL)
+// BULK REGISTERS //
+
+int ModbusRTUServerClass::registersRead(int table, int address, uint16_t *values, int nb)
+{
+  int index;
+  const uint16_t *tab = (const uint16_t *)modbus_mapping_lookup(&mbMapping_, table, address, nb, &index);
+
+  if (nb < 1 || tab == NULL)
   {
-    modbus_close(mb_);
-    modbus_free(mb_);
+    errno = EMBXILADD;
 
-    mb_ = NULL;
+    return -1;
+  }
+
+  if (mbMapping_.flags & (table == MODBUS_TABLE_REGISTERS ? MODBUS_MAPPING_WIRE_REGISTERS : MODBUS_MAPPING_WIRE_INPUT_REGISTERS))
+  {
+    for (int i = 0; i < nb; i++)
+    {
+      values[i] = MODBUS_GET_WIRE_REGISTER(tab, index + i);
+    }
   }
+  else
+  {
+    memcpy(values, tab + index, nb * sizeof(uint16_t));
+  }
+
+  return nb;
+}
+
+int ModbusRTUServerClass::registersWrite(int table, int address, const uint16_t *values, int nb)
+{
+  int index;
+  uint16_t *tab = (uint16_t *)modbus_mapping_lookup(&mbMapping_, table, address, nb, &index);
+
+  if (nb < 1 || tab == NULL)
+  {
+    errno = EMBXILADD;
+
+    return 0;
+  }
+
+  if (mbMapping_.flags & (table == MODBUS_TABLE_REGISTERS ? MODBUS_MAPPING_WIRE_REGISTERS : MODBUS_MAPPING_WIRE_INPUT_REGISTERS))
+  {
+    for (int i = 0; i < nb; i++)
+    {
+      MODBUS_SET_WIRE_REGISTER(tab, index + i, values[i]);
+    }
+  }
+  else
+  {
+    memcpy(tab + index, values, nb * sizeof(uint16_t));
+  }
+  mbMapping_.generation = mbMapping_.generation + 1;
+
+  return 1;
+}
+
+template <typename T>
+int ModbusRTUServerClass::registersRead32(int table, int address, T *values, int nb, int order)
+{
+  static_assert(sizeof(T) == sizeof(uint32_t), "32 bit values only");
+
+  int index;
+  const uint16_t *tab = (const uint16_t *)modbus_mapping_lookup(&mbMapping_, table, address, nb * 2, &index);
+
+  if (nb < 1 || tab == NULL)
+  {
+    errno = EMBXILADD;
+
+    return -1;
+  }
+
+  int wire = mbMapping_.flags & (table == MODBUS_TABLE_REGISTERS ? MODBUS_MAPPING_WIRE_REGISTERS : MODBUS_MAPPING_WIRE_INPUT_REGISTERS);
+
+  for (int i = 0; i < nb; i++, index += 2)
+  {
+    uint16_t registers[2] = {tableRegisterRead(tab, index, wire), tableRegisterRead(tab, index + 1, wire)};
+    uint32_t value = modbus_get_uint32(registers, order);
+
+    // Copied rather than cast, `float` may not alias `uint32_t`.
+    memcpy(&values[i], &value, sizeof(value));
+  }
+
+  return nb;
+}
+
+template <typename T>
+int ModbusRTUServerClass::registersWrite32(int table, int address, const T *values, int nb, int order)
+{
+  static_assert(sizeof(T) == sizeof(uint32_t), "32 bit values only");
+
+  int index;
+  uint16_t *tab = (uint16_t *)modbus_mapping_lookup(&mbMapping_, table, address, nb * 2, &index);
+
+  if (nb < 1 || tab == NULL)
+  {
+    errno = EMBXILADD;
+
+    return 0;
+  }
+
+  int wire = mbMapping_.flags & (table == MODBUS_TABLE_REGISTERS ? MODBUS_MAPPING_WIRE_REGISTERS : MODBUS_MAPPING_WIRE_INPUT_REGISTERS);
+
+  for (int i = 0; i < nb; i++, index += 2)
+  {
+    uint32_t value;
+    uint16_t registers[2];
+
+    memcpy(&value, &values[i], sizeof(value));
+    modbus_set_uint32(value, registers, order);
+    tableRegisterWrite(tab, index, registers[0], wire);
+    tableRegisterWrite(tab, index + 1, registers[1], wire);
+  }
+  mbMapping_.generation = mbMapping_.generation + 1;
+
+  return 1;
+}
+
+// TABLES //
+
+void ModbusRTUServerClass::freeTables()
+{
+  // Static tables are part of the server's type and outlive any restart.
+  if (tableStorage_ == TABLES_STATIC)
+  {
+    return;
+  }
+
+  if (tableStorage_ == TABLES_HEAP)
+  {
+    if (mbMapping_.tab_bits != NULL)
+    {
+      free(mbMapping_.tab_bits);
+    }
+
+    if (mbMapping_.tab_input_bits != NULL)
+    {
+      free(mbMapping_.tab_input_bits);
+    }
+
+    if (mbMapping_.tab_input_registers != NULL)
+    {
+      free(mbMapping_.tab_input_registers);
+    }
+
+    if (mbMapping_.tab_registers != NULL)
+    {
+      free(mbMapping_.tab_registers);
+    }
+  }
+  else if (arena_ != NULL)
+  {
+    free(arena_);
+    arena_ = NULL;
+  }
+
+  modbus_mapping_free_segments(&mbMapping_);
+  modbus_mapping_free_read_handlers(&mbMapping_);
+
+  // The storage layout, the callback and dirty tracking are configuration, not table data, so they survive a restart.
+  modbus_mapping_t kept = mbMapping_;
+
+  memset(&mbMapping_, 0x00, sizeof(mbMapping_));
+  mbMapping_.flags = kept.flags;
+  // Responses cached from the old tables must not match the new ones.
+  mbMapping_.generation = kept.generation + 1;
+  modbus_mapping_set_write_callback(&mbMapping_, kept.write_cb, kept.write_cb_data);
+  memcpy(mbMapping_.dirty, kept.dirty, sizeof(kept.dirty));
+  modbus_mapping_clear_dirty(&mbMapping_, MODBUS_TABLE_BITS);
+  modbus_mapping_clear_dirty(&mbMapping_, MODBUS_TABLE_REGISTERS);
+  resizeDirtyTracking(MODBUS_TABLE_BITS);
+  resizeDirtyTracking(MODBUS_TABLE_REGISTERS);
+  tableStorage_ = TABLES_HEAP;
 }
@@ -34,6 +34,23 @@ public:
       uint8_t tx_pin,
       uint8_t driver_enable_pin,
       uint8_t receiver_enable_pin);
+#if MODBUS_RTU_TTY
+  /**
+   * Server on a Linux tty, such as "/dev/ttyUSB0" or the slave side of a
+   * pseudo-terminal, opened by `begin()` whose config argument is then
+   * unused. Where the serial driver supports it (TIOCSRS485), the kernel
+   * switches the RS-485 transceiver around each response. The tty is held
+   * exclusively while the server runs. On a USB adapter a request only ends
+   * after a silence of MODBUS_RTU_TTY_FRAME_GAP_US (20 ms) at least, which
+   * delays each response as much.
+   *
+   * @param device path of the tty, kept until the server is destroyed
+   * @param parity 'N', 'E' or 'O'
+   * @param data_bit number of data bits, 5 to 8
+   * @param stop_bit number of stop bits, 1 or 2
+   */
+  ModbusRTUServerClass(const char *device, char parity = 'N', int data_bit = 8, int stop_bit = 1);
+#endif
   ~ModbusRTUServerClass();
 
   int begin(int id, unsigned long baudrate = 19200, uint16_t config = SERIAL_8N1);
@@ -41,13 +58,94 @@ public:
 
   void setRS485Pins(int tx_pin, int de_pin, int re_pin);
 
+  /**
+   * Choose how a malformed request is discarded before its exception response.
+   *
+   * MODBUS_FLUSH_T35 (default) reads until the line has been silent for 3.5
+   * characters, so the response goes out right after the frame.
+   * MODBUS_FLUSH_TIMEOUT restores the former behaviour of waiting 500 ms.
+   *
+   * @param mode MODBUS_FLUSH_T35 or MODBUS_FLUSH_TIMEOUT
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int setFlushMode(int mode);
+
+  /**
+   * Answer retries with the response already sent.
+   *
+   * A write request (function codes 5, 6, 15, 16, 22 and 23) byte for byte
+   * identical to the previous one, received less than `window_ms`
+   * milliseconds after its response, gets that response frame again, CRC
+   * included, without being executed a second time. Masters retrying after a
+   * lost response then get a prompt answer, and writes such as mask write
+   * (22) or read/write (23) aren't applied twice. Reads are always executed.
+   * Keep the window shorter than the interval of identical writes meant to
+   * be applied again.
+   *
+   * @param window_ms how long a response is replayed, 0 (the default) to execute every request
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int setRetryWindow(unsigned long window_ms);
+
+  /**
+   * Keep the responses to repeated read requests ready to send.
+   *
+   * The response frames to the last `nb_entries` different read requests
+   * (function codes 1 to 4) are kept, CRC included, and sent again for the
+   * same request until the tables change: any write, from a request or from
+   * the write functions here, invalidates them. Values written through the
+   * table pointers directly must be followed by `modbus_mapping_touch()`.
+   * Ranges with a read handler are always read again. Each entry takes about
+   * 280 bytes.
+   *
+   * @param nb_entries number of responses to keep, 0 (the default) to 16
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int setResponseCache(int nb_entries);
+
   /**
    * Poll interface for requests
-   * 
+   *
+   * Never waits for the serial line: each call consumes the bytes received
+   * so far, a request split over several calls is answered by the call that
+   * completes it.
+   *
    * Return 1 if a message was received, 0 otherwise
    */
   int poll();
 
+  /**
+   * Poll interface waiting for a request
+   *
+   * Calls `poll()` until a request is answered or `timeout_ms` has elapsed.
+   * On a tty the time in between is spent blocked in select(), an RS485
+   * port is polled.
+   *
+   * @param timeout_ms longest wait, in milliseconds
+   *
+   * Return 1 if a message was received, 0 otherwise
+   */
+  int poll(unsigned long timeout_ms);
+
+  /**
+   * Configure the storage layout of the servers tables.
+   *
+   * Must be called before the tables it affects are configured. With
+   * MODBUS_MAPPING_PACKED_BITS and/or MODBUS_MAPPING_PACKED_INPUT_BITS, coils
+   * and/or discrete inputs are stored 8 per byte instead of one per byte.
+   * With MODBUS_MAPPING_WIRE_REGISTERS and/or MODBUS_MAPPING_WIRE_INPUT_REGISTERS,
+   * holding and/or input registers are stored big-endian so requests are served
+   * with a single copy; the register accessors swap transparently.
+   *
+   * @param flags bitwise OR of MODBUS_MAPPING_* storage flags
+   *
+   * @return 1 on success, -1 if the layout of an already configured table would change
+   */
+  int configureStorage(int flags);
+
   /**
    * Configure the servers coils.
    *
@@ -88,6 +186,241 @@ public:
    */
   int configureInputRegisters(int start_address, int nb);
 
+  /**
+   * Configure all four tables at once, in a single block of memory.
+   *
+   * Replaces the tables (and segments) configured before. The tables are laid
+   * out according to the storage flags, holding registers first, each one
+   * aligned on MODBUS_ARENA_ALIGNMENT. Without `buffer` the block is allocated
+   * here and freed by `end()`; its size is MODBUS_MAPPING_ARENA_SIZE() plus
+   * alignment slack. A caller-owned `buffer` of `size` bytes is used as is and
+   * never freed; MODBUS_MAPPING_ARENA_SIZE() gives the size it needs when it is
+   * aligned. A table with `nb` 0 is not served. The configure* functions for
+   * single tables fail while these tables are in use.
+   *
+   * @param coils_start start address of coils
+   * @param nb_coils number of coils
+   * @param discrete_inputs_start start address of discrete inputs
+   * @param nb_discrete_inputs number of discrete inputs
+   * @param holding_registers_start start address of holding registers
+   * @param nb_holding_registers number of holding registers
+   * @param input_registers_start start address of input registers
+   * @param nb_input_registers number of input registers
+   * @param buffer caller-owned memory for the tables, or NULL to allocate it
+   * @param size size of `buffer` in bytes
+   *
+   * @return 1 on success, 0 or -1 on failure (-1 for incorrect parameters or a buffer that is too small, the tables configured before are then kept)
+   */
+  int configureTables(int coils_start, int nb_coils,
+                      int discrete_inputs_start, int nb_discrete_inputs,
+                      int holding_registers_start, int nb_holding_registers,
+                      int input_registers_start, int nb_input_registers,
+                      void *buffer = NULL, size_t size = 0);
+
+  /**
+   * Add a range of coils to the server, in addition to those configured with
+   * `configureCoils`.
+   *
+   * Segments let a sparse address map be served without allocating the gaps
+   * between its ranges. A request spanning a gap is answered with an illegal
+   * data address exception. A request is served from a single range, so a
+   * segment can't adjoin the configured coils or another segment: ranges
+   * meant to be accessed together go in one segment. For the same reason
+   * `configureCoils` fails on a window overlapping or adjoining a segment.
+   *
+   * @param start_address start address of the range
+   * @param nb number of coils in the range
+   *
+   * @return 1 on success, 0 or -1 on failure (-1 if the range overlaps or adjoins another one or parameters are incorrect)
+   */
+  int addCoilSegment(int start_address, int nb);
+
+  /**
+   * Add a range of discrete inputs to the server, see `addCoilSegment`.
+   *
+   * @param start_address start address of the range
+   * @param nb number of discrete inputs in the range
+   *
+   * @return 1 on success, 0 or -1 on failure
+   */
+  int addDiscreteInputSegment(int start_address, int nb);
+
+  /**
+   * Add a range of holding registers to the server, see `addCoilSegment`.
+   *
+   * @param start_address start address of the range
+   * @param nb number of holding registers in the range
+   *
+   * @return 1 on success, 0 or -1 on failure
+   */
+  int addHoldingRegisterSegment(int start_address, int nb);
+
+  /**
+   * Add a range of input registers to the server, see `addCoilSegment`.
+   *
+   * @param start_address start address of the range
+   * @param nb number of input registers in the range
+   *
+   * @return 1 on success, 0 or -1 on failure
+   */
+  int addInputRegisterSegment(int start_address, int nb);
+
+  /**
+   * Set the function called when a request writes coils or holding registers.
+   *
+   * It is called once per write request (function codes 5, 6, 15, 16, 22 and
+   * the write part of 23), from `poll()` after the response has been sent, as
+   * `callback(arg, table, address, nb)`: `table` is MODBUS_TABLE_BITS for
+   * coils or MODBUS_TABLE_REGISTERS for holding registers, and the range
+   * written is `nb` values from `address` on. Writes done with the accessor
+   * functions are not reported.
+   *
+   * @param callback function to call, NULL to stop notifications
+   * @param arg passed back to `callback` unchanged
+   */
+  void onWrite(modbus_write_callback_t callback, void *arg = NULL);
+
+  /**
+   * Compute values of a table only when a request reads them.
+   *
+   * Before a read request covering part of the range is answered,
+   * `handler(arg, table, address, nb)` is called for that part and stores the
+   * values with the write functions (e.g. `inputRegisterWrite`); returning
+   * non-zero answers the request with a server failure exception instead.
+   * With a `ttl_ms` other than 0 the whole range is computed at once and then
+   * served from the table for `ttl_ms` milliseconds, so back-to-back polls
+   * don't sample again. The range must already be configured, in one table
+   * or segment, and handlers are removed with the tables by `end()`.
+   *
+   * @param table MODBUS_TABLE_BITS, MODBUS_TABLE_INPUT_BITS, MODBUS_TABLE_REGISTERS or MODBUS_TABLE_INPUT_REGISTERS
+   * @param start_address start address of the range
+   * @param nb number of values in the range
+   * @param handler function computing the values
+   * @param arg passed back to `handler` unchanged
+   * @param ttl_ms how long computed values stay valid, 0 to compute them for every read
+   *
+   * @return 1 on success, 0 or -1 on failure (-1 if the range isn't configured or overlaps another handler)
+   */
+  int addReadHandler(int table, int start_address, int nb, modbus_read_callback_t handler,
+                     void *arg = NULL, unsigned long ttl_ms = 0);
+
+  /**
+   * Start a group of writes that requests must see all at once.
+   *
+   * For values written from an ISR or another thread, such as a float spread
+   * over two registers: call the write functions between `beginUpdate()` and
+   * `endUpdate()`, and a response being built meanwhile is copied again
+   * instead of mixing old and new values (after a few attempts it is answered
+   * with a server busy exception). Only one producer may update at a time,
+   * and the tables must not be reconfigured while producers run.
+   */
+  void beginUpdate();
+
+  /**
+   * Publish the writes done since `beginUpdate()`.
+   */
+  void endUpdate();
+
+  /**
+   * Track which coils or holding registers requests write to.
+   *
+   * A polling alternative to `onWrite`: the server keeps one bit per block of
+   * 2^`block_shift` addresses of the configured range and of each segment of
+   * the table, set by every write request, and `forEachDirty` walks the
+   * written blocks. The bitmap follows the ranges configured later on, the
+   * blocks still served staying dirty.
+   *
+   * @param table MODBUS_TABLE_BITS for coils or MODBUS_TABLE_REGISTERS for holding registers
+   * @param block_shift log2 of the block size, 0 to 16, or -1 to stop tracking
+   *
+   * @return 1 on success, 0 or -1 on failure (-1 for incorrect parameters)
+   */
+  int configureDirtyTracking(int table, int block_shift);
+
+  /**
+   * Call `callback(arg, table, address, nb)` for each run of written blocks of
+   * a table, in ascending address order.
+   *
+   * The ranges cover whole blocks, cut to the configured range or segment
+   * holding them. Blocks stay dirty until `clearDirty` is called.
+   *
+   * @param table table given to `configureDirtyTracking`
+   * @param callback function to call for each run
+   * @param arg passed back to `callback` unchanged
+   *
+   * @return number of runs, or -1 if the table isn't tracked
+   */
+  int forEachDirty(int table, modbus_write_callback_t callback, void *arg = NULL);
+
+  /**
+   * Mark all blocks of a table as clean.
+   *
+   * @param table table given to `configureDirtyTracking`
+   */
+  void clearDirty(int table);
+
+  /**
+   * Answer a user defined function code (0x41 to 0x48 or 0x64 to 0x6E).
+   *
+   * `handler(arg, req, req_length, rsp, rsp_max_length)` gets the request
+   * bytes following the function code and writes the response bytes following
+   * the function code to `rsp`, returning their number, or the opposite of an
+   * exception code (e.g. -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE); a result
+   * above `rsp_max_length` (at most 252) or below -255 is answered with a
+   * server failure exception. Requests are
+   * `meta_length` bytes long after the function code; with `byte_count` set,
+   * the last of them counts the bytes that follow. The functions registered
+   * are kept across `end()` and `begin()`.
+   *
+   * @param function function code
+   * @param handler function answering the requests, NULL to unregister the function code
+   * @param arg passed back to `handler` unchanged
+   * @param meta_length number of fixed request bytes after the function code
+   * @param byte_count true if the last fixed byte counts the request bytes that follow
+   *
+   * @return 1 on success, 0 or -1 on failure
+   */
+  int registerFunction(int function, modbus_function_handler_t handler, void *arg = NULL,
+                       int meta_length = 0, bool byte_count = false);
+
+  /**
+   * Answer the requests to another slave id from its own tables.
+   *
+   * For a board standing in for several devices on one line: the requests to
+   * `id` are served from `mapping` (e.g. built with
+   * `modbus_mapping_new_start_address`), with the write callback and read
+   * handlers set on it, while the tables configured here answer the id given
+   * to `begin()`. Broadcasts are applied to every unit. A 256 entry index
+   * finds the unit of a frame from its first byte, so frames to other ids are
+   * skipped without computing their CRC. The mapping stays owned by the caller
+   * and must outlive its use. The units are kept across `end()` and `begin()`.
+   *
+   * @param id slave id of the unit, 1 to 247
+   * @param mapping tables of the unit, NULL to stop answering `id`
+   *
+   * @return 1 on success, 0 or -1 on failure (0 when MODBUS_MAX_UNITS units are already served)
+   */
+  int addUnit(int id, modbus_mapping_t *mapping);
+
+  /**
+   * Monitor the bus instead of serving requests.
+   *
+   * The server never transmits and `poll()` returns 0; every request seen on
+   * the line, whatever its slave id, is paired with the response that follows
+   * it and passed to `callback(arg, req, req_length, rsp, rsp_length)`. The
+   * frames start with the slave id and leave out the CRC; `rsp` is NULL for
+   * broadcasts and for requests not answered within the response timeout
+   * (500 ms). Responses to user defined function codes are only recognised
+   * when the line falls silent after them. The mode is kept across `end()`
+   * and `begin()`.
+   *
+   * @param callback function to call for each transaction, NULL to serve requests again
+   * @param arg passed back to `callback` unchanged
+   *
+   * @return 1 on success, 0 or -1 on failure
+   */
+  int listenOnly(modbus_transaction_callback_t callback, void *arg = NULL);
+
   // same as ModbusClientClass.h
   int coilRead(int address);
   int discreteInputRead(int address);
@@ -119,12 +452,153 @@ public:
    */
   int inputRegisterWrite(int address, uint16_t value);
 
+  /**
+   * Read consecutive holding registers or input registers with a single
+   * bounds check.
+   *
+   * The `uint32_t`, `int32_t` and `float` overloads read 32 bit values, each
+   * one from two registers with its bytes in `order` (MODBUS_ORDER_ABCD,
+   * MODBUS_ORDER_DCBA, MODBUS_ORDER_BADC or MODBUS_ORDER_CDAB, where A is the
+   * most significant byte); `nb` then counts values, not registers.
+   *
+   * @param address address of the first register
+   * @param values where to store the values
+   * @param nb number of values to read
+   * @param order byte order of 32 bit values
+   *
+   * @return nb on success, -1 on failure (all the registers must be in one table or segment)
+   */
+  int holdingRegistersRead(int address, uint16_t *values, int nb);
+  int holdingRegistersRead(int address, uint32_t *values, int nb, int order = MODBUS_ORDER_ABCD);
+  int holdingRegistersRead(int address, int32_t *values, int nb, int order = MODBUS_ORDER_ABCD);
+  int holdingRegistersRead(int address, float *values, int nb, int order = MODBUS_ORDER_ABCD);
+  int inputRegistersRead(int address, uint16_t *values, int nb);
+  int inputRegistersRead(int address, uint32_t *values, int nb, int order = MODBUS_ORDER_ABCD);
+  int inputRegistersRead(int address, int32_t *values, int nb, int order = MODBUS_ORDER_ABCD);
+  int inputRegistersRead(int address, float *values, int nb, int order = MODBUS_ORDER_ABCD);
+
+  /**
+   * Write consecutive holding registers or input registers with a single
+   * bounds check, see `holdingRegistersRead` for the 32 bit overloads.
+   *
+   * @param address address of the first register
+   * @param values values to write
+   * @param nb number of values to write
+   * @param order byte order of 32 bit values
+   *
+   * @return 1 on success, 0 on failure (all the registers must be in one table or segment)
+   */
+  int holdingRegistersWrite(int address, const uint16_t *values, int nb);
+  int holdingRegistersWrite(int address, const uint32_t *values, int nb, int order = MODBUS_ORDER_ABCD);
+  int holdingRegistersWrite(int address, const int32_t *values, int nb, int order = MODBUS_ORDER_ABCD);
+  int holdingRegistersWrite(int address, const float *values, int nb, int order = MODBUS_ORDER_ABCD);
+  int inputRegistersWrite(int address, const uint16_t *values, int nb);
+  int inputRegistersWrite(int address, const uint32_t *values, int nb, int order = MODBUS_ORDER_ABCD);
+  int inputRegistersWrite(int address, const int32_t *values, int nb, int order = MODBUS_ORDER_ABCD);
+  int inputRegistersWrite(int address, const float *values, int nb, int order = MODBUS_ORDER_ABCD);
+
 private:
+  // Serves the tables of this server over TCP.
+  friend class ModbusTCPServerClass;
+
+#if MODBUS_RTU_TTY
+  // RS485_ is only constructed for a serial port, device_ is set instead for a tty.
+  union
+  {
+    RS485Class RS485_;
+  };
+  const char *device_;
+  char parity_;
+  uint8_t dataBit_;
+  uint8_t stopBit_;
+#else
   RS485Class RS485_;
+#endif
+  modbus_flush_mode flushMode_;
+  unsigned long retryWindow_;
+  int responseCache_;
+
+  // Settings of the context kept for the next begin(), which starts a new one.
+  struct UserFunction
+  {
+    uint8_t function;
+    uint8_t metaLength;
+    bool byteCount;
+    modbus_function_handler_t handler;
+    void *arg;
+  };
+
+  struct Unit
+  {
+    uint8_t id;
+    modbus_mapping_t *mapping;
+  };
+
+  UserFunction *functions_;
+  int nbFunctions_;
+  Unit *units_;
+  int nbUnits_;
+  modbus_transaction_callback_t listenCallback_;
+  void *listenArg_;
+
+protected:
+  /**
+   * Where the data tables live, which decides how they are released.
+   */
+  enum TableStorage
+  {
+    TABLES_HEAP,     // allocated by the configure* functions, freed by end()
+    TABLES_ARENA,    // carved out of `arena_` by configureTables(), freed by end()
+    TABLES_EXTERNAL, // carved out of a caller-owned buffer, cleared by end()
+    TABLES_STATIC    // owned by a derived class, never freed or cleared
+  };
 
   modbus_t *mb_;
   modbus_mapping_t mbMapping_;
+  TableStorage tableStorage_;
+  void *arena_;
+
+  // Unchecked table accessors; `index` is relative to the table's start address.
+
+  static inline int tableBitRead(const uint8_t *tab, int index, int packed)
+  {
+    return packed ? (tab[index >> 3] >> (index & 7)) & 0x01 : tab[index];
+  }
+
+  static inline void tableBitWrite(uint8_t *tab, int index, uint8_t value, int packed)
+  {
+    if (!packed)
+    {
+      tab[index] = value;
+    }
+    else if (value)
+    {
+      tab[index >> 3] |= (1 << (index & 7));
+    }
+    else
+    {
+      tab[index >> 3] &= ~(1 << (index & 7));
+    }
+  }
+
+  static inline uint16_t tableRegisterRead(const uint16_t *tab, int index, int wire)
+  {
+    return wire ? MODBUS_GET_WIRE_REGISTER(tab, index) : tab[index];
+  }
 
+  static inline void tableRegisterWrite(uint16_t *tab, int index, uint16_t value, int wire)
+  {
+    if (wire)
+    {
+      MODBUS_SET_WIRE_REGISTER(tab, index, value);
+    }
+    else
+    {
+      tab[index] = value;
+    }
+  }
+
+private:
   /**
    * Start the Modbus RTU server with the specified parameters
    *
@@ -140,6 +614,38 @@ private:
    * Stop the server
    */
   void modbusEnd();
+
+  /**
+   * Add a segment to one of the mapping's tables (MODBUS_TABLE_*)
+   */
+  int addSegment(int table, int start_address, int nb);
+
+  /**
+   * Size the dirty bitmap of a tracked table (MODBUS_TABLE_*) to its ranges
+   * after its window changed
+   *
+   * Return 1 on success, 0 on failure
+   */
+  int resizeDirtyTracking(int table);
+
+  /**
+   * Bulk register access shared by the holding and input register functions
+   */
+  int registersRead(int table, int address, uint16_t *values, int nb);
+  int registersWrite(int table, int address, const uint16_t *values, int nb);
+
+  template <typename T>
+  int registersRead32(int table, int address, T *values, int nb, int order);
+
+  template <typename T>
+  int registersWrite32(int table, int address, const T *values, int nb, int order);
+
+  /**
+   * Release the data tables (unless they are static) and clear the mapping
+   *
+   * Non-static servers return to heap storage afterwards.
+   */
+  void freeTables();
 };
 
 #endif
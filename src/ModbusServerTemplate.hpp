@@ -0,0 +1,256 @@
+/*
+  This file is part of the ModbusRTUServer library.
+
+  Copyright (c) 2022 Darryl Noakes <darryl.noakes@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+  See the GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _MODBUS_RTU_SERVER_SRC_MODBUS_SERVER_TEMPLATE_HPP
+#define _MODBUS_RTU_SERVER_SRC_MODBUS_SERVER_TEMPLATE_HPP
+
+#include <errno.h>
+
+#include "ModbusServerClass.hpp"
+
+/**
+ * Modbus RTU server whose tables are sized at compile time.
+ *
+ * The tables are static members, so nothing is allocated from construction
+ * through `poll()` (the RTU context comes from the static pool, see
+ * MODBUS_RTU_STATIC_CONTEXTS), and the bounds checks of the accessors below
+ * compare against constants. Each instantiation owns one set of tables, so
+ * use distinct template arguments for servers that must not share data.
+ *
+ * @tparam NbCoils number of coils
+ * @tparam NbDiscreteInputs number of discrete inputs
+ * @tparam NbHoldingRegisters number of holding registers
+ * @tparam NbInputRegisters number of input registers
+ * @tparam StartCoils start address of coils
+ * @tparam StartDiscreteInputs start address of discrete inputs
+ * @tparam StartHoldingRegisters start address of holding registers
+ * @tparam StartInputRegisters start address of input registers
+ * @tparam StorageFlags MODBUS_MAPPING_* storage flags, see `configureStorage`
+ */
+template <int NbCoils, int NbDiscreteInputs, int NbHoldingRegisters, int NbInputRegisters,
+          int StartCoils = 0, int StartDiscreteInputs = 0,
+          int StartHoldingRegisters = 0, int StartInputRegisters = 0,
+          int StorageFlags = 0>
+class ModbusRTUServer : public ModbusRTUServerClass
+{
+  static_assert(NbCoils >= 0 && NbDiscreteInputs >= 0 &&
+                    NbHoldingRegisters >= 0 && NbInputRegisters >= 0,
+                "table sizes must not be negative");
+  static_assert(StartCoils >= 0 && StartCoils + NbCoils <= 0x10000 &&
+                    StartDiscreteInputs >= 0 && StartDiscreteInputs + NbDiscreteInputs <= 0x10000 &&
+                    StartHoldingRegisters >= 0 && StartHoldingRegisters + NbHoldingRegisters <= 0x10000 &&
+                    StartInputRegisters >= 0 && StartInputRegisters + NbInputRegisters <= 0x10000,
+                "tables must fit in the Modbus address space");
+
+public:
+  ModbusRTUServer(
+      HardwareSerial &hwSerial,
+      uint8_t tx_pin,
+      uint8_t driver_enable_pin,
+      uint8_t receiver_enable_pin) : ModbusRTUServerClass(hwSerial, tx_pin, driver_enable_pin, receiver_enable_pin)
+  {
+    mbMapping_.start_bits = StartCoils;
+    mbMapping_.nb_bits = NbCoils;
+    mbMapping_.tab_bits = NbCoils > 0 ? tables_.coils : NULL;
+
+    mbMapping_.start_input_bits = StartDiscreteInputs;
+    mbMapping_.nb_input_bits = NbDiscreteInputs;
+    mbMapping_.tab_input_bits = NbDiscreteInputs > 0 ? tables_.discreteInputs : NULL;
+
+    mbMapping_.start_registers = StartHoldingRegisters;
+    mbMapping_.nb_registers = NbHoldingRegisters;
+    mbMapping_.tab_registers = NbHoldingRegisters > 0 ? tables_.holdingRegisters : NULL;
+
+    mbMapping_.start_input_registers = StartInputRegisters;
+    mbMapping_.nb_input_registers = NbInputRegisters;
+    mbMapping_.tab_input_registers = NbInputRegisters > 0 ? tables_.inputRegisters : NULL;
+
+    mbMapping_.flags = StorageFlags;
+
+    tableStorage_ = TABLES_STATIC;
+  }
+
+  // The layout is fixed by the template arguments.
+  int configureStorage(int flags) = delete;
+  int configureCoils(int start_address, int nb) = delete;
+  int configureDiscreteInputs(int start_address, int nb) = delete;
+  int configureHoldingRegisters(int start_address, int nb) = delete;
+  int configureInputRegisters(int start_address, int nb) = delete;
+  int configureTables(int, int, int, int, int, int, int, int, void * = NULL, size_t = 0) = delete;
+  int addCoilSegment(int start_address, int nb) = delete;
+  int addDiscreteInputSegment(int start_address, int nb) = delete;
+  int addHoldingRegisterSegment(int start_address, int nb) = delete;
+  int addInputRegisterSegment(int start_address, int nb) = delete;
+
+  int coilRead(int address)
+  {
+    if (address < StartCoils || address >= StartCoils + NbCoils)
+    {
+      errno = EMBXILADD;
+
+      return -1;
+    }
+
+    return tableBitRead(tables_.coils, address - StartCoils, StorageFlags & MODBUS_MAPPING_PACKED_BITS);
+  }
+
+  int discreteInputRead(int address)
+  {
+    if (address < StartDiscreteInputs || address >= StartDiscreteInputs + NbDiscreteInputs)
+    {
+      errno = EMBXILADD;
+
+      return -1;
+    }
+
+    return tableBitRead(tables_.discreteInputs, address - StartDiscreteInputs,
+                        StorageFlags & MODBUS_MAPPING_PACKED_INPUT_BITS);
+  }
+
+  long holdingRegisterRead(int address)
+  {
+    if (address < StartHoldingRegisters || address >= StartHoldingRegisters + NbHoldingRegisters)
+    {
+      errno = EMBXILADD;
+
+      return -1;
+    }
+
+    return tableRegisterRead(tables_.holdingRegisters, address - StartHoldingRegisters,
+                             StorageFlags & MODBUS_MAPPING_WIRE_REGISTERS);
+  }
+
+  long inputRegisterRead(int address)
+  {
+    if (address < StartInputRegisters || address >= StartInputRegisters + NbInputRegisters)
+    {
+      errno = EMBXILADD;
+
+      return -1;
+    }
+
+    return tableRegisterRead(tables_.inputRegisters, address - StartInputRegisters,
+                             StorageFlags & MODBUS_MAPPING_WIRE_INPUT_REGISTERS);
+  }
+
+  int coilWrite(int address, uint8_t value)
+  {
+    if (address < StartCoils || address >= StartCoils + NbCoils)
+    {
+      errno = EMBXILADD;
+
+      return 0;
+    }
+
+    tableBitWrite(tables_.coils, address - StartCoils, value, StorageFlags & MODBUS_MAPPING_PACKED_BITS);
+    mbMapping_.generation = mbMapping_.generation + 1;
+
+    return 1;
+  }
+
+  int holdingRegisterWrite(int address, uint16_t value)
+  {
+    if (address < StartHoldingRegisters || address >= StartHoldingRegisters + NbHoldingRegisters)
+    {
+      errno = EMBXILADD;
+
+      return 0;
+    }
+
+    tableRegisterWrite(tables_.holdingRegisters, address - StartHoldingRegisters, value,
+                       StorageFlags & MODBUS_MAPPING_WIRE_REGISTERS);
+    mbMapping_.generation = mbMapping_.generation + 1;
+
+    return 1;
+  }
+
+  int registerMaskWrite(int address, uint16_t and_mask, uint16_t or_mask)
+  {
+    long value = holdingRegisterRead(address);
+
+    if (value < 0)
+    {
+      return 0;
+    }
+
+    return holdingRegisterWrite(address, (value & and_mask) | or_mask);
+  }
+
+  int discreteInputWrite(int address, uint8_t value)
+  {
+    if (address < StartDiscreteInputs || address >= StartDiscreteInputs + NbDiscreteInputs)
+    {
+      errno = EMBXILADD;
+
+      return 0;
+    }
+
+    tableBitWrite(tables_.discreteInputs, address - StartDiscreteInputs, value,
+                  StorageFlags & MODBUS_MAPPING_PACKED_INPUT_BITS);
+    mbMapping_.generation = mbMapping_.generation + 1;
+
+    return 1;
+  }
+
+  int inputRegisterWrite(int address, uint16_t value)
+  {
+    if (address < StartInputRegisters || address >= StartInputRegisters + NbInputRegisters)
+    {
+      errno = EMBXILADD;
+
+      return 0;
+    }
+
+    tableRegisterWrite(tables_.inputRegisters, address - StartInputRegisters, value,
+                       StorageFlags & MODBUS_MAPPING_WIRE_INPUT_REGISTERS);
+    mbMapping_.generation = mbMapping_.generation + 1;
+
+    return 1;
+  }
+
+private:
+  enum
+  {
+    CoilsSize = (StorageFlags & MODBUS_MAPPING_PACKED_BITS) ? MODBUS_PACKED_BITS_SIZE(NbCoils) : NbCoils,
+    DiscreteInputsSize = (StorageFlags & MODBUS_MAPPING_PACKED_INPUT_BITS) ? MODBUS_PACKED_BITS_SIZE(NbDiscreteInputs) : NbDiscreteInputs
+  };
+
+  // Empty tables still get one element, zero-length arrays are not standard C++.
+  struct Tables
+  {
+    uint8_t coils[CoilsSize > 0 ? CoilsSize : 1];
+    uint8_t discreteInputs[DiscreteInputsSize > 0 ? DiscreteInputsSize : 1];
+    uint16_t holdingRegisters[NbHoldingRegisters > 0 ? NbHoldingRegisters : 1];
+    uint16_t inputRegisters[NbInputRegisters > 0 ? NbInputRegisters : 1];
+  };
+
+  static Tables tables_;
+};
+
+template <int NbCoils, int NbDiscreteInputs, int NbHoldingRegisters, int NbInputRegisters,
+          int StartCoils, int StartDiscreteInputs, int StartHoldingRegisters, int StartInputRegisters,
+          int StorageFlags>
+typename ModbusRTUServer<NbCoils, NbDiscreteInputs, NbHoldingRegisters, NbInputRegisters,
+                         StartCoils, StartDiscreteInputs, StartHoldingRegisters, StartInputRegisters,
+                         StorageFlags>::Tables
+    ModbusRTUServer<NbCoils, NbDiscreteInputs, NbHoldingRegisters, NbInputRegisters,
+                    StartCoils, StartDiscreteInputs, StartHoldingRegisters, StartInputRegisters,
+                    StorageFlags>::tables_;
+
+#endif
@@ -0,0 +1,192 @@
+/*
+  This file is part of the ModbusRTUServer library.
+
+  Copyright (c) 2022 Darryl Noakes <darryl.noakes@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+  See the GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <limits.h>
+
+#include "ModbusTCPGatewayClass.hpp"
+
+#if MODBUS_TCP && MODBUS_RTU_TTY
+
+/////////////////////////////
+// CONSTRUCTORS/DESTRUCTOR //
+/////////////////////////////
+
+ModbusTCPGatewayClass::ModbusTCPGatewayClass(const char *device, char parity, int data_bit, int stop_bit) :
+
+                                   device_(device),
+                                   parity_(parity),
+                                   dataBit_(data_bit),
+                                   stopBit_(stop_bit),
+                                   nbRequests_(64),
+                                   maxPerUnit_(8),
+                                   queueTimeout_(1000),
+                                   responseTimeout_(500),
+                                   readCacheTtl_(0),
+                                   tcp_(NULL),
+                                   rtu_(NULL),
+                                   gw_(NULL)
+{
+}
+
+ModbusTCPGatewayClass::~ModbusTCPGatewayClass()
+{
+  end();
+}
+
+////////////
+// PUBLIC //
+////////////
+
+// BEGIN/END //
+
+int ModbusTCPGatewayClass::begin(unsigned long baudrate, int port, const char *ip, int nb_connection)
+{
+  end();
+
+  rtu_ = modbus_new_rtu_tty(device_, baudrate, parity_, dataBit_, stopBit_);
+  tcp_ = modbus_new_tcp(ip, port);
+  if (rtu_ == NULL || tcp_ == NULL)
+  {
+    end();
+
+    return 0;
+  }
+
+  modbus_set_response_timeout(rtu_, responseTimeout_ / 1000, (responseTimeout_ % 1000) * 1000);
+
+  if (modbus_connect(rtu_) == -1 || modbus_tcp_listen(tcp_, nb_connection) == -1)
+  {
+    end();
+
+    return 0;
+  }
+
+  gw_ = modbus_gateway_new(tcp_, rtu_, nbRequests_);
+  if (gw_ == NULL)
+  {
+    end();
+
+    return 0;
+  }
+
+  modbus_gateway_set_queue_limits(gw_, maxPerUnit_, queueTimeout_);
+  modbus_gateway_set_read_cache(gw_, readCacheTtl_);
+
+  return 1;
+}
+
+void ModbusTCPGatewayClass::end()
+{
+  if (gw_ != NULL)
+  {
+    modbus_gateway_free(gw_);
+
+    gw_ = NULL;
+  }
+
+  if (tcp_ != NULL)
+  {
+    modbus_close(tcp_);
+    modbus_free(tcp_);
+
+    tcp_ = NULL;
+  }
+
+  if (rtu_ != NULL)
+  {
+    modbus_close(rtu_);
+    modbus_free(rtu_);
+
+    rtu_ = NULL;
+  }
+}
+
+int ModbusTCPGatewayClass::setQueue(int nb_requests, int max_per_unit, unsigned long timeout_ms)
+{
+  if (nb_requests < 1 || nb_requests > MODBUS_GATEWAY_MAX_REQUESTS ||
+      max_per_unit < 1 || max_per_unit > nb_requests)
+  {
+    errno = EINVAL;
+
+    return 0;
+  }
+
+  // The number of requests is only changed by the next begin().
+  if (gw_ != NULL && modbus_gateway_set_queue_limits(gw_, max_per_unit, timeout_ms) == -1)
+  {
+    return 0;
+  }
+
+  nbRequests_ = nb_requests;
+  maxPerUnit_ = max_per_unit;
+  queueTimeout_ = timeout_ms;
+
+  return 1;
+}
+
+int ModbusTCPGatewayClass::setResponseTimeout(unsigned long timeout_ms)
+{
+  if (timeout_ms == 0)
+  {
+    errno = EINVAL;
+
+    return 0;
+  }
+
+  if (rtu_ != NULL &&
+      modbus_set_response_timeout(rtu_, timeout_ms / 1000, (timeout_ms % 1000) * 1000) == -1)
+  {
+    return 0;
+  }
+
+  responseTimeout_ = timeout_ms;
+
+  return 1;
+}
+
+int ModbusTCPGatewayClass::setReadCache(unsigned long ttl_ms)
+{
+  if (gw_ != NULL && modbus_gateway_set_read_cache(gw_, ttl_ms) == -1)
+  {
+    return 0;
+  }
+
+  readCacheTtl_ = ttl_ms;
+
+  return 1;
+}
+
+// MODBUS //
+
+int ModbusTCPGatewayClass::poll(unsigned long timeout_ms)
+{
+  int rc;
+
+  if (gw_ == NULL)
+  {
+    return 0;
+  }
+
+  rc = modbus_gateway_poll(gw_, timeout_ms > INT_MAX ? -1 : (int)timeout_ms);
+
+  return rc > 0 ? rc : 0;
+}
+
+#endif
@@ -0,0 +1,137 @@
+/*
+  This file is part of the ModbusRTUServer library.
+
+  Copyright (c) 2022 Darryl Noakes <darryl.noakes@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+  See the GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _MODBUS_RTU_SERVER_SRC_MODBUS_TCP_GATEWAY_CLASS_HPP
+#define _MODBUS_RTU_SERVER_SRC_MODBUS_TCP_GATEWAY_CLASS_HPP
+
+#include "libmodbus/modbus.h"
+#include "libmodbus/modbus-rtu.h"
+#include "libmodbus/modbus-tcp.h"
+#include "libmodbus/modbus-gateway.h"
+
+#if MODBUS_TCP && MODBUS_RTU_TTY
+
+/**
+ * Modbus TCP to RTU gateway.
+ *
+ * Requests from TCP clients to units 1 to 247 are forwarded, one at a time,
+ * to the slaves on a Linux tty and their responses sent back. Each unit has
+ * its own queue and the units take turns on the serial line, so a slave slow
+ * to answer doesn't hold up the others. A request that can't be queued, or
+ * waited too long, gets a busy exception (6); one the slave doesn't answer
+ * gets a gateway target exception (11), and one to another unit identifier
+ * a gateway path exception (10).
+ */
+class ModbusTCPGatewayClass
+{
+public:
+  /**
+   * @param device path of the tty of the serial line, kept until the gateway is destroyed
+   * @param parity 'N', 'E' or 'O'
+   * @param data_bit number of data bits, 5 to 8
+   * @param stop_bit number of stop bits, 1 or 2
+   */
+  ModbusTCPGatewayClass(const char *device, char parity = 'N', int data_bit = 8, int stop_bit = 1);
+  ~ModbusTCPGatewayClass();
+
+  /**
+   * Open the serial line and start listening for clients.
+   *
+   * @param baudrate baud rate of the serial line
+   * @param port TCP port
+   * @param ip IPv4 address to listen on, NULL for all
+   * @param nb_connection largest number of clients connected at once
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int begin(unsigned long baudrate = 19200, int port = MODBUS_TCP_DEFAULT_PORT,
+            const char *ip = NULL, int nb_connection = 256);
+  void end();
+
+  /**
+   * Bound the requests waiting for the serial line; a new `nb_requests`
+   * takes effect at the next `begin()`.
+   *
+   * @param nb_requests requests queued at once, for all the units (default 64)
+   * @param max_per_unit requests queued at once for one unit (default 8)
+   * @param timeout_ms longest wait in a queue, 0 for no limit (default 1000)
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int setQueue(int nb_requests, int max_per_unit, unsigned long timeout_ms);
+
+  /**
+   * Set how long a slave has to respond.
+   *
+   * @param timeout_ms response timeout, in milliseconds (default 500)
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int setResponseTimeout(unsigned long timeout_ms);
+
+  /**
+   * Answer identical read requests from the last response.
+   *
+   * A read request (function codes 1 to 4) for the same unit and range as
+   * one answered less than `ttl_ms` milliseconds ago gets the same response
+   * without going to the slave, and one for the same values as a request
+   * still queued gets its response, outside the limit per unit. Clients
+   * polling the same values then share the serial line. Any other request
+   * to a unit drops its responses, and the reads received after it are
+   * answered once it is done.
+   *
+   * @param ttl_ms how long a response is reused, 0 (the default) to forward every request
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int setReadCache(unsigned long ttl_ms);
+
+  /**
+   * Poll interface for requests
+   *
+   * Accepts the clients waiting and queues their requests, waiting up to
+   * `timeout_ms` when none is queued, then forwards the next request queued
+   * once the serial line is free. The response of the slave is received
+   * over the following calls, which keep serving the clients meanwhile.
+   *
+   * @param timeout_ms longest wait, in milliseconds, 0 to return at once
+   *
+   * Return the number of requests answered
+   */
+  int poll(unsigned long timeout_ms = 0);
+
+private:
+  const char *device_;
+  char parity_;
+  uint8_t dataBit_;
+  uint8_t stopBit_;
+  int nbRequests_;
+  int maxPerUnit_;
+  unsigned long queueTimeout_;
+  unsigned long responseTimeout_;
+  unsigned long readCacheTtl_;
+
+  modbus_t *tcp_;
+  modbus_t *rtu_;
+  modbus_gateway_t *gw_;
+};
+
+#endif
+
+#endif
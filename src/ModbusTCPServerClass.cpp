@@ -0,0 +1,98 @@
+/*
+  This file is part of the ModbusRTUServer library.
+
+  Copyright (c) 2022 Darryl Noakes <darryl.noakes@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+  See the GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <limits.h>
+
+#include "ModbusTCPServerClass.hpp"
+
+#if MODBUS_TCP
+
+/////////////////////////////
+// CONSTRUCTORS/DESTRUCTOR //
+/////////////////////////////
+
+ModbusTCPServerClass::ModbusTCPServerClass(ModbusRTUServerClass &server) :
+
+                                   server_(server),
+                                   mb_(NULL)
+{
+}
+
+ModbusTCPServerClass::~ModbusTCPServerClass()
+{
+  end();
+}
+
+////////////
+// PUBLIC //
+////////////
+
+// BEGIN/END //
+
+int ModbusTCPServerClass::begin(int port, const char *ip, int nb_connection)
+{
+  end();
+
+  mb_ = modbus_new_tcp(ip, port);
+  if (mb_ == NULL)
+  {
+    return 0;
+  }
+
+  modbus_set_response_cache(mb_, server_.responseCache_);
+
+  if (modbus_tcp_listen(mb_, nb_connection) == -1)
+  {
+    modbus_free(mb_);
+    mb_ = NULL;
+
+    return 0;
+  }
+
+  return 1;
+}
+
+void ModbusTCPServerClass::end()
+{
+  if (mb_ != NULL)
+  {
+    modbus_close(mb_);
+    modbus_free(mb_);
+
+    mb_ = NULL;
+  }
+}
+
+// MODBUS //
+
+int ModbusTCPServerClass::poll(unsigned long timeout_ms)
+{
+  int rc;
+
+  if (mb_ == NULL)
+  {
+    return 0;
+  }
+
+  rc = modbus_tcp_poll(mb_, &server_.mbMapping_, timeout_ms > INT_MAX ? -1 : (int)timeout_ms);
+
+  return rc > 0 ? rc : 0;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+  This file is part of the ModbusRTUServer library.
+
+  Copyright (c) 2022 Darryl Noakes <darryl.noakes@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+  See the GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _MODBUS_RTU_SERVER_SRC_MODBUS_TCP_SERVER_CLASS_HPP
+#define _MODBUS_RTU_SERVER_SRC_MODBUS_TCP_SERVER_CLASS_HPP
+
+#include "libmodbus/modbus.h"
+#include "libmodbus/modbus-tcp.h"
+
+#include "ModbusServerClass.hpp"
+
+#if MODBUS_TCP
+
+/**
+ * Modbus TCP server answering from the tables of an RTU server.
+ *
+ * Both servers share one register map, so a value written over TCP is read
+ * back over RTU and the other way round, and the write callbacks, dirty
+ * tracking and read handlers of the RTU server apply to both. The units and
+ * function handlers added to the RTU server are not served over TCP.
+ *
+ * One thread serves every client: `poll()` waits on all the sockets at once
+ * (epoll) and answers each complete request as soon as it is read. Requests
+ * a client sends without waiting for their responses are all answered in a
+ * row and their responses sent together. A client is only read again once
+ * it has taken the responses sent to it.
+ */
+class ModbusTCPServerClass
+{
+public:
+  /**
+   * @param server server whose tables are served, which must outlive this one
+   */
+  ModbusTCPServerClass(ModbusRTUServerClass &server);
+  ~ModbusTCPServerClass();
+
+  /**
+   * Start listening for clients.
+   *
+   * The response cache size of the RTU server at this point is used here too.
+   *
+   * @param port TCP port
+   * @param ip IPv4 address to listen on, NULL for all
+   * @param nb_connection largest number of clients connected at once
+   *
+   * @return 1 on success, 0 on failure
+   */
+  int begin(int port = MODBUS_TCP_DEFAULT_PORT, const char *ip = NULL, int nb_connection = 256);
+  void end();
+
+  /**
+   * Poll interface for requests
+   *
+   * Accepts the clients waiting and answers their requests, waiting up to
+   * `timeout_ms` for the first one.
+   *
+   * @param timeout_ms longest wait, in milliseconds, 0 to return at once
+   *
+   * Return the number of requests answered
+   */
+  int poll(unsigned long timeout_ms = 0);
+
+private:
+  ModbusRTUServerClass &server_;
+  modbus_t *mb_;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright © 2022 Darryl Noakes <darryl.noakes@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#ifndef MODBUS_CRC_H
+#define MODBUS_CRC_H
+
+#include <stddef.h>
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Implementations of the CRC-16/MODBUS (reflected 0x8005, initial value
+ * 0xFFFF, low byte sent first), for MODBUS_CRC16_KERNEL */
+/* Two tables of 256 bytes, one byte at a time (libmodbus) */
+#define MODBUS_CRC16_TABLE_PAIR  0
+/* One table of 256 words, one byte at a time */
+#define MODBUS_CRC16_TABLE16     1
+/* Four tables of 256 words, four bytes at a time */
+#define MODBUS_CRC16_SLICE4      2
+/* Eight tables of 256 words, eight bytes at a time */
+#define MODBUS_CRC16_SLICE8      3
+/* Carry-less multiplication (PCLMULQDQ or PMULL), 16 bytes at a time */
+#define MODBUS_CRC16_CLMUL       4
+
+/* The carry-less multiplication needs the instructions to be enabled for
+ * the build, e.g. -mpclmul on x86 or -march=armv8-a+crypto on AArch64 */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__PCLMUL__) && defined(__SSE2__)
+#  define MODBUS_CRC16_HAVE_CLMUL 1
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#  define MODBUS_CRC16_HAVE_CLMUL 1
+#else
+#  define MODBUS_CRC16_HAVE_CLMUL 0
+#endif
+
+/* Kernel used by modbus_crc16(). The defaults keep the 512 bytes of tables
+ * on microcontrollers, flash being scarcer than cycles there. */
+#ifndef MODBUS_CRC16_KERNEL
+#  if defined(__AVR__)
+#    define MODBUS_CRC16_KERNEL MODBUS_CRC16_TABLE_PAIR
+#  elif defined(__linux__) || defined(_WIN32) || defined(__APPLE__)
+#    define MODBUS_CRC16_KERNEL MODBUS_CRC16_SLICE8
+#  else
+#    define MODBUS_CRC16_KERNEL MODBUS_CRC16_TABLE16
+#  endif
+#endif
+
+/* Continue the CRC crc (0xFFFF to start) over length more bytes of buffer.
+ * The kernels give the same results, the linker only keeps the tables of
+ * those called. */
+MODBUS_API uint16_t modbus_crc16(uint16_t crc, const uint8_t *buffer, size_t length);
+MODBUS_API uint16_t modbus_crc16_table_pair(uint16_t crc, const uint8_t *buffer, size_t length);
+MODBUS_API uint16_t modbus_crc16_table16(uint16_t crc, const uint8_t *buffer, size_t length);
+MODBUS_API uint16_t modbus_crc16_slice4(uint16_t crc, const uint8_t *buffer, size_t length);
+MODBUS_API uint16_t modbus_crc16_slice8(uint16_t crc, const uint8_t *buffer, size_t length);
+#if MODBUS_CRC16_HAVE_CLMUL
+MODBUS_API uint16_t modbus_crc16_clmul(uint16_t crc, const uint8_t *buffer, size_t length);
+#endif
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_CRC_H */
@@ -40,6 +40,14 @@
 #  define bswap_16 _byteswap_ushort
 #endif
 
+#if !defined(bswap_16)
+
+static inline uint16_t bswap_16(uint16_t x)
+{
+    return (uint16_t)((x >> 8) | (x << 8));
+}
+#endif
+
 #if !defined(bswap_32)
 
 static inline uint32_t bswap_32(uint32_t x)
@@ -96,6 +104,109 @@ uint8_t modbus_get_byte_from_bits(const uint8_t *src, int idx,
     return value;
 }
 
+/* Sets many bits of a packed bit table from a table of bytes (only the bits
+   between idx and idx + nb_bits are set). Each source byte is merged with at
+   most two masked byte stores. */
+void modbus_set_packed_bits_from_bytes(uint8_t *dest, int idx, unsigned int nb_bits,
+                                       const uint8_t *tab_byte)
+{
+    uint8_t *p = dest + (idx >> 3);
+    int shift = idx & 7;
+
+    while (nb_bits > 0) {
+        unsigned int n = (nb_bits < 8) ? nb_bits : 8;
+        unsigned int mask = ((1U << n) - 1) << shift;
+        unsigned int value = ((unsigned int)*tab_byte++ << shift) & mask;
+
+        p[0] = (p[0] & ~mask) | (value & 0xFF);
+        if (shift + n > 8) {
+            p[1] = (p[1] & ~(mask >> 8)) | (value >> 8);
+        }
+
+        p++;
+        nb_bits -= n;
+    }
+}
+
+/* Copies nb_bits bits of a packed bit table, starting at idx, to dest in the
+   layout of a read bits response (first bit in the LSB of dest[0], padding
+   bits cleared). Whole bytes are copied when idx is byte aligned, otherwise
+   each output byte is merged from two shifted source bytes.
+   Returns the number of bytes written. */
+int modbus_get_bytes_from_packed_bits(uint8_t *dest, const uint8_t *src, int idx,
+                                      unsigned int nb_bits)
+{
+    const uint8_t *p = src + (idx >> 3);
+    int shift = idx & 7;
+    int nb_bytes = (nb_bits + 7) >> 3;
+    int i;
+
+    if (shift == 0) {
+        memcpy(dest, p, nb_bytes);
+    } else {
+        /* Number of source bytes spanned by the bits */
+        int nb_src = (shift + nb_bits + 7) >> 3;
+
+        for (i = 0; i < nb_bytes; i++) {
+            uint8_t value = p[i] >> shift;
+
+            /* Don't read past the end of the table */
+            if (i + 1 < nb_src) {
+                value |= p[i + 1] << (8 - shift);
+            }
+            dest[i] = value;
+        }
+    }
+
+    if (nb_bits & 7) {
+        dest[nb_bytes - 1] &= (1 << (nb_bits & 7)) - 1;
+    }
+
+    return nb_bytes;
+}
+
+/* Gets a 32 bit value from 2 registers, A being its most significant byte
+   and order (MODBUS_ORDER_*) the order of the bytes in the registers */
+uint32_t modbus_get_uint32(const uint16_t *src, int order)
+{
+    switch (order) {
+    case MODBUS_ORDER_DCBA:
+        return ((uint32_t)bswap_16(src[1]) << 16) | bswap_16(src[0]);
+    case MODBUS_ORDER_BADC:
+        return ((uint32_t)bswap_16(src[0]) << 16) | bswap_16(src[1]);
+    case MODBUS_ORDER_CDAB:
+        return ((uint32_t)src[1] << 16) | src[0];
+    default:
+        return ((uint32_t)src[0] << 16) | src[1];
+    }
+}
+
+/* Sets a 32 bit value to 2 registers, see modbus_get_uint32() */
+void modbus_set_uint32(uint32_t value, uint16_t *dest, int order)
+{
+    uint16_t high = (uint16_t)(value >> 16);
+    uint16_t low = (uint16_t)value;
+
+    switch (order) {
+    case MODBUS_ORDER_DCBA:
+        dest[0] = bswap_16(low);
+        dest[1] = bswap_16(high);
+        break;
+    case MODBUS_ORDER_BADC:
+        dest[0] = bswap_16(high);
+        dest[1] = bswap_16(low);
+        break;
+    case MODBUS_ORDER_CDAB:
+        dest[0] = low;
+        dest[1] = high;
+        break;
+    default:
+        dest[0] = high;
+        dest[1] = low;
+        break;
+    }
+}
+
 /* Get a float from 4 bytes (Modbus) without any conversion (ABCD) */
 float modbus_get_float_abcd(const uint16_t *src)
 {
@@ -0,0 +1,74 @@
+/*
+ * Copyright © 2022 Darryl Noakes <darryl.noakes@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#ifndef MODBUS_GATEWAY_PRIVATE_H
+#define MODBUS_GATEWAY_PRIVATE_H
+
+/* Highest unit identifier of a serial slave, the others aren't forwarded */
+#define _MODBUS_GATEWAY_MAX_UNIT        247
+
+/* Default for how long a request may wait in its queue */
+#define _MODBUS_GATEWAY_TIMEOUT_MS     1000
+
+/* Request received from a TCP client, waiting for the serial line */
+typedef struct _modbus_gateway_request {
+    /* Next request of the queue, or free */
+    struct _modbus_gateway_request *next;
+    /* Read requests for the same values received while this one was
+       queued, answered with its response */
+    struct _modbus_gateway_request *followers;
+    /* Connection to answer, see _modbus_tcp_find_connection() */
+    unsigned long conn_id;
+    unsigned long received_ms;
+    int length;
+    uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+} _modbus_gateway_request_t;
+
+/* Requests to one unit, in the order received, without their followers */
+typedef struct {
+    _modbus_gateway_request_t *head;
+    _modbus_gateway_request_t *tail;
+    int nb;
+    /* Requests other than reads among them, no response is cached meanwhile */
+    int nb_writes;
+} _modbus_gateway_queue_t;
+
+/* Response of a slave to a read request (function codes 1 to 4) */
+typedef struct {
+    /* Unit, function, address and quantity of the request */
+    uint8_t key[6];
+    unsigned long stored_ms;
+    /* 0 for an unused entry */
+    int length;
+    /* Unit, function and data of the response, without the CRC */
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH + 1];
+} _modbus_gateway_cached_t;
+
+struct _modbus_gateway {
+    modbus_t *tcp;
+    modbus_t *rtu;
+    /* All the requests, those not queued are linked from free */
+    _modbus_gateway_request_t *requests;
+    _modbus_gateway_request_t *free;
+    int nb_requests;
+    int nb_queued;
+    _modbus_gateway_queue_t queues[_MODBUS_GATEWAY_MAX_UNIT + 1];
+    int max_per_unit;
+    unsigned long timeout_ms;
+    /* Unit forwarded last, the units are taken in turn */
+    int last_unit;
+    /* Request whose response is being received, NULL while the serial line
+       is free, and when it was sent */
+    _modbus_gateway_request_t *forwarded;
+    unsigned long forwarded_ms;
+    /* 0 when there is no read cache */
+    unsigned long cache_ttl_ms;
+    /* Entry replaced by the next response stored */
+    int cache_next;
+    _modbus_gateway_cached_t cache[MODBUS_GATEWAY_CACHE_ENTRIES];
+};
+
+#endif /* MODBUS_GATEWAY_PRIVATE_H */
@@ -0,0 +1,589 @@
+/*
+ * Copyright © 2022 Darryl Noakes <darryl.noakes@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#include "modbus-gateway.h"
+
+#if MODBUS_TCP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <Arduino.h>
+
+#ifndef DEBUG
+#define printf(...) {}
+#define fprintf(...) {}
+#endif
+
+#include "modbus-private.h"
+
+#include "modbus-tcp-private.h"
+#include "modbus-gateway-private.h"
+
+/* TRUE for the requests whose responses are cached, function codes 1 to 4 */
+static int _modbus_gateway_is_read(const uint8_t *req, int req_length)
+{
+    int function = req[_MODBUS_TCP_HEADER_LENGTH];
+
+    return req_length == _MODBUS_TCP_PRESET_REQ_LENGTH &&
+           function >= MODBUS_FC_READ_COILS && function <= MODBUS_FC_READ_INPUT_REGISTERS;
+}
+
+/* Returns the response kept for req, NULL if there is none younger than the
+   time to live */
+static _modbus_gateway_cached_t *_modbus_gateway_cached(modbus_gateway_t *gw,
+                                                        const uint8_t *req, int req_length)
+{
+    const uint8_t *key = req + _MODBUS_TCP_HEADER_LENGTH - 1;
+    unsigned long now = millis();
+    int i;
+
+    if (gw->cache_ttl_ms == 0 || !_modbus_gateway_is_read(req, req_length)) {
+        return NULL;
+    }
+
+    for (i = 0; i < MODBUS_GATEWAY_CACHE_ENTRIES; i++) {
+        _modbus_gateway_cached_t *cached = &gw->cache[i];
+
+        if (cached->length > 0 && memcmp(cached->key, key, sizeof(cached->key)) == 0 &&
+            (now - cached->stored_ms) < gw->cache_ttl_ms) {
+            return cached;
+        }
+    }
+
+    return NULL;
+}
+
+/* Forgets the responses of unit, whose values a request may have written */
+static void _modbus_gateway_forget(modbus_gateway_t *gw, int unit)
+{
+    int i;
+
+    for (i = 0; i < MODBUS_GATEWAY_CACHE_ENTRIES; i++) {
+        if (gw->cache[i].key[0] == unit) {
+            gw->cache[i].length = 0;
+        }
+    }
+}
+
+/* Keeps the response of the slave to req, a read request */
+static void _modbus_gateway_cache(modbus_gateway_t *gw, const uint8_t *req,
+                                  const uint8_t *rsp, int rsp_length)
+{
+    const uint8_t *key = req + _MODBUS_TCP_HEADER_LENGTH - 1;
+    _modbus_gateway_cached_t *cached = NULL;
+    int i;
+
+    /* Exception responses are not kept */
+    if (rsp[1] & 0x80) {
+        return;
+    }
+
+    /* The expired response to the same request is replaced first */
+    for (i = 0; i < MODBUS_GATEWAY_CACHE_ENTRIES; i++) {
+        if (gw->cache[i].length > 0 &&
+            memcmp(gw->cache[i].key, key, sizeof(gw->cache[i].key)) == 0) {
+            cached = &gw->cache[i];
+            break;
+        }
+    }
+    if (cached == NULL) {
+        cached = &gw->cache[gw->cache_next];
+        gw->cache_next = (gw->cache_next + 1) % MODBUS_GATEWAY_CACHE_ENTRIES;
+    }
+
+    memcpy(cached->key, key, sizeof(cached->key));
+    memcpy(cached->rsp, rsp, rsp_length);
+    cached->length = rsp_length;
+    cached->stored_ms = millis();
+}
+
+/* Sends rsp, unit, function and data from a slave, to the client of req */
+static int _modbus_gateway_respond(modbus_t *tcp, const uint8_t *req,
+                                   const uint8_t *rsp, int rsp_length)
+{
+    uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+    int adu_length;
+
+    /* Transaction and protocol identifiers of the request, the length is set
+       by send_msg_pre */
+    memcpy(adu, req, 4);
+    memcpy(adu + _MODBUS_TCP_HEADER_LENGTH - 1, rsp, rsp_length);
+    adu_length = tcp->backend->send_msg_pre(adu, _MODBUS_TCP_HEADER_LENGTH - 1 + rsp_length);
+
+    return tcp->backend->send(tcp, adu, adu_length);
+}
+
+/* Returns the read request queued for the same values as req, which can
+   share its response, NULL if there is none or no read cache */
+static _modbus_gateway_request_t *_modbus_gateway_queued(modbus_gateway_t *gw,
+                                                         const uint8_t *req, int req_length)
+{
+    const int offset = _MODBUS_TCP_HEADER_LENGTH - 1;
+    _modbus_gateway_request_t *request;
+    _modbus_gateway_request_t *leader;
+
+    if (gw->cache_ttl_ms == 0 || !_modbus_gateway_is_read(req, req_length)) {
+        return NULL;
+    }
+
+    /* Only the reads queued after the last write of the unit read the values
+       req would, the one forwarded coming first */
+    leader = NULL;
+    if (gw->forwarded != NULL &&
+        _modbus_gateway_is_read(gw->forwarded->req, gw->forwarded->length) &&
+        memcmp(gw->forwarded->req + offset, req + offset, 6) == 0) {
+        leader = gw->forwarded;
+    }
+    for (request = gw->queues[req[offset]].head; request != NULL; request = request->next) {
+        if (!_modbus_gateway_is_read(request->req, request->length)) {
+            leader = NULL;
+        } else if (leader == NULL && memcmp(request->req + offset, req + offset, 6) == 0) {
+            leader = request;
+        }
+    }
+
+    return leader;
+}
+
+/* Copies req of conn into a free request */
+static _modbus_gateway_request_t *_modbus_gateway_take(modbus_gateway_t *gw,
+                                                       const _modbus_tcp_connection_t *conn,
+                                                       const uint8_t *req, int req_length)
+{
+    _modbus_gateway_request_t *request = gw->free;
+
+    gw->free = request->next;
+    request->next = NULL;
+    request->followers = NULL;
+    request->conn_id = conn->id;
+    request->received_ms = millis();
+    request->length = req_length;
+    memcpy(request->req, req, req_length);
+
+    return request;
+}
+
+/* Called by _modbus_tcp_poll() for each request received: answered at once
+   from the read cache or with an exception, queued for its unit otherwise */
+static int _modbus_gateway_receive(modbus_t *ctx, const _modbus_tcp_connection_t *conn,
+                                   const uint8_t *req, int req_length, void *arg)
+{
+    modbus_gateway_t *gw = (modbus_gateway_t *)arg;
+    int unit = req[_MODBUS_TCP_HEADER_LENGTH - 1];
+    const _modbus_gateway_cached_t *cached;
+    _modbus_gateway_request_t *leader;
+    int rc;
+
+    if (unit < 1 || unit > _MODBUS_GATEWAY_MAX_UNIT) {
+        /* Broadcasts and TCP only unit identifiers have no slave to reach */
+        rc = modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_GATEWAY_PATH);
+    } else if ((cached = _modbus_gateway_cached(gw, req, req_length)) != NULL) {
+        if (ctx->debug) {
+            printf("Answered from the read cache\n");
+        }
+        rc = _modbus_gateway_respond(ctx, req, cached->rsp, cached->length);
+    } else if (gw->free != NULL &&
+               (leader = _modbus_gateway_queued(gw, req, req_length)) != NULL) {
+        /* Answered with the request queued for the same values */
+        _modbus_gateway_request_t *request = _modbus_gateway_take(gw, conn, req, req_length);
+
+        request->followers = leader->followers;
+        leader->followers = request;
+
+        return 0;
+    } else if (gw->free == NULL || gw->queues[unit].nb >= gw->max_per_unit) {
+        if (ctx->debug) {
+            fprintf(stderr, "Queue of unit %d full\n", unit);
+        }
+        rc = modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+    } else {
+        _modbus_gateway_queue_t *queue = &gw->queues[unit];
+        _modbus_gateway_request_t *request = _modbus_gateway_take(gw, conn, req, req_length);
+
+        if (queue->tail == NULL) {
+            queue->head = request;
+        } else {
+            queue->tail->next = request;
+        }
+        queue->tail = request;
+        queue->nb++;
+        gw->nb_queued++;
+
+        if (!_modbus_gateway_is_read(req, req_length)) {
+            /* The reads received from now on are answered after it */
+            queue->nb_writes++;
+            _modbus_gateway_forget(gw, unit);
+        }
+
+        return 0;
+    }
+
+    if (rc == -1 && (errno == EPIPE || errno == ECONNRESET)) {
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Takes the oldest request of the unit after the one forwarded last, so a
+   slave slow to answer doesn't hold up the others */
+static _modbus_gateway_request_t *_modbus_gateway_next(modbus_gateway_t *gw)
+{
+    int i;
+
+    if (gw->nb_queued == 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < _MODBUS_GATEWAY_MAX_UNIT; i++) {
+        int unit = (gw->last_unit + i) % _MODBUS_GATEWAY_MAX_UNIT + 1;
+        _modbus_gateway_queue_t *queue = &gw->queues[unit];
+        _modbus_gateway_request_t *request = queue->head;
+
+        if (request != NULL) {
+            queue->head = request->next;
+            if (queue->head == NULL) {
+                queue->tail = NULL;
+            }
+            queue->nb--;
+            gw->nb_queued--;
+            if (!_modbus_gateway_is_read(request->req, request->length)) {
+                queue->nb_writes--;
+            }
+            gw->last_unit = unit;
+
+            return request;
+        }
+    }
+
+    return NULL;
+}
+
+/* Response timeout of the serial context, in milliseconds */
+static unsigned long _modbus_gateway_response_timeout(modbus_gateway_t *gw)
+{
+    return gw->rtu->response_timeout.tv_sec * 1000UL +
+           gw->rtu->response_timeout.tv_usec / 1000;
+}
+
+/* Waits up to timeout_ms (-1 for ever), and no longer than the response
+   timeout of the request forwarded, for its response or for the TCP side:
+   both the serial line and the epoll instance of the TCP context are polled */
+static void _modbus_gateway_wait(modbus_gateway_t *gw, int timeout_ms)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)gw->tcp->backend_data;
+    unsigned long elapsed = millis() - gw->forwarded_ms;
+    unsigned long left = _modbus_gateway_response_timeout(gw);
+    struct pollfd fds[2];
+
+    left = (elapsed < left) ? left - elapsed : 0;
+    if (timeout_ms < 0 || (unsigned long)timeout_ms > left) {
+        timeout_ms = (int)left;
+    }
+    if (gw->rtu->s == -1 && timeout_ms > 1) {
+        /* A serial port without a file descriptor is polled */
+        timeout_ms = 1;
+    }
+
+    /* poll() skips a negative descriptor */
+    fds[0].fd = ctx_tcp->efd;
+    fds[0].events = POLLIN;
+    fds[1].fd = gw->rtu->s;
+    fds[1].events = POLLIN;
+    poll(fds, 2, timeout_ms);
+}
+
+/* Sends the responses of a slave, or the exception when not 0, to the
+   clients of request and of its followers, and frees them. A client gone is
+   skipped. Returns the number of requests answered. */
+static int _modbus_gateway_answer(modbus_gateway_t *gw, _modbus_gateway_request_t *request,
+                                  const uint8_t *rsp, int rsp_length, int exception)
+{
+    modbus_t *tcp = gw->tcp;
+    int answered = 0;
+
+    while (request != NULL) {
+        _modbus_gateway_request_t *follower = request->followers;
+        _modbus_tcp_connection_t *conn = _modbus_tcp_find_connection(tcp, request->conn_id);
+
+        if (conn != NULL) {
+            int rc;
+
+            /* Queued behind the responses not sent yet, never waited for, in
+               the room kept for it */
+            conn->pending--;
+            _modbus_tcp_batch(tcp, conn);
+            if (exception != 0) {
+                rc = modbus_reply_exception(tcp, request->req, exception);
+            } else {
+                rc = _modbus_gateway_respond(tcp, request->req, rsp, rsp_length);
+            }
+            if (_modbus_tcp_send_batch(tcp) == -1 || rc == -1) {
+                _modbus_tcp_close_connection(tcp, conn);
+            }
+            answered++;
+        }
+
+        request->next = gw->free;
+        gw->free = request;
+        request = follower;
+    }
+
+    return answered;
+}
+
+/* Ends the transaction of the request forwarded on a failure, errno set:
+   the clients get a gateway target exception. Returns the number of
+   requests answered. */
+static int _modbus_gateway_fail(modbus_gateway_t *gw)
+{
+    _modbus_gateway_request_t *request = gw->forwarded;
+
+    if (gw->tcp->debug) {
+        fprintf(stderr, "Unit %d failed to respond (%s)\n",
+                request->req[_MODBUS_TCP_HEADER_LENGTH - 1], modbus_strerror(errno));
+    }
+
+    /* What arrives late would be taken for the next response */
+    modbus_flush(gw->rtu);
+
+    gw->forwarded = NULL;
+    return _modbus_gateway_answer(gw, request, NULL, 0, MODBUS_EXCEPTION_GATEWAY_TARGET);
+}
+
+/* Takes the next request queued: answered at once when nobody waits for it
+   any more, when it waited too long or from the read cache, forwarded to
+   its slave otherwise, whose response is then received by
+   _modbus_gateway_complete(). Returns the number of requests answered. */
+static int _modbus_gateway_forward(modbus_gateway_t *gw)
+{
+    modbus_t *rtu = gw->rtu;
+    const int offset = _MODBUS_TCP_HEADER_LENGTH - 1;
+    _modbus_gateway_request_t *request;
+    _modbus_gateway_request_t *r;
+    const _modbus_gateway_cached_t *cached;
+
+    request = _modbus_gateway_next(gw);
+    if (request == NULL) {
+        return 0;
+    }
+
+    /* Nobody is waiting for the response of clients gone */
+    for (r = request; r != NULL; r = r->followers) {
+        if (_modbus_tcp_find_connection(gw->tcp, r->conn_id) != NULL) {
+            break;
+        }
+    }
+    if (r == NULL) {
+        /* None of the connections is found */
+        return _modbus_gateway_answer(gw, request, NULL, 0, 0);
+    }
+
+    if (gw->timeout_ms > 0 && (millis() - request->received_ms) >= gw->timeout_ms) {
+        /* The client has likely given up already */
+        return _modbus_gateway_answer(gw, request, NULL, 0,
+                                      MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+    }
+
+    if ((cached = _modbus_gateway_cached(gw, request->req, request->length)) != NULL) {
+        /* Answered to an earlier request for the same values */
+        return _modbus_gateway_answer(gw, request, cached->rsp, cached->length, 0);
+    }
+
+    if (!_modbus_gateway_is_read(request->req, request->length)) {
+        /* Even when it fails, the request may have reached the slave */
+        _modbus_gateway_forget(gw, request->req[offset]);
+    }
+
+    /* Set straight, modbus_set_slave() would prepare the responses of a
+       server; the slave answering is checked against it */
+    rtu->slave = request->req[offset];
+
+    gw->forwarded = request;
+    gw->forwarded_ms = millis();
+    if (modbus_send_raw_request(rtu, request->req + offset, request->length - offset) == -1) {
+        return _modbus_gateway_fail(gw);
+    }
+
+    return 0;
+}
+
+/* Receives what has arrived of the response to the request forwarded, and
+   sends it to the clients once complete. Returns the number of requests
+   answered. */
+static int _modbus_gateway_complete(modbus_gateway_t *gw)
+{
+    modbus_t *rtu = gw->rtu;
+    const int offset = _MODBUS_TCP_HEADER_LENGTH - 1;
+    _modbus_gateway_request_t *request = gw->forwarded;
+    uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+    int rc;
+
+    rc = _modbus_rtu_receive_confirmation(rtu, rsp);
+    if (rc == 0) {
+        if ((millis() - gw->forwarded_ms) < _modbus_gateway_response_timeout(gw)) {
+            return 0;
+        }
+        errno = ETIMEDOUT;
+        return _modbus_gateway_fail(gw);
+    }
+    if (rc == -1) {
+        return _modbus_gateway_fail(gw);
+    }
+
+    if (rc <= (int)rtu->backend->checksum_length + 1 || rsp[0] != request->req[offset] ||
+        (rsp[1] & 0x7F) != request->req[offset + 1]) {
+        /* Response of another slave or to another function */
+        errno = EMBBADDATA;
+        return _modbus_gateway_fail(gw);
+    }
+    rc -= rtu->backend->checksum_length;
+
+    if (_modbus_gateway_is_read(request->req, request->length) && gw->cache_ttl_ms > 0 &&
+        gw->queues[request->req[offset]].nb_writes == 0) {
+        /* Values about to be written aren't kept */
+        _modbus_gateway_cache(gw, request->req, rsp, rc);
+    }
+
+    gw->forwarded = NULL;
+    return _modbus_gateway_answer(gw, request, rsp, rc, 0);
+}
+
+/* Creates a gateway forwarding the requests received by tcp_ctx, listening
+   (modbus_tcp_listen()), to the serial slaves reached through rtu_ctx,
+   connected. Up to nb_requests requests wait for the serial line at once.
+   The contexts remain owned by the caller. */
+modbus_gateway_t* modbus_gateway_new(modbus_t *tcp_ctx, modbus_t *rtu_ctx, int nb_requests)
+{
+    modbus_gateway_t *gw;
+    int i;
+
+    if (tcp_ctx == NULL || tcp_ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP ||
+        rtu_ctx == NULL || rtu_ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU ||
+        nb_requests < 1 || nb_requests > MODBUS_GATEWAY_MAX_REQUESTS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    gw = (modbus_gateway_t *)calloc(1, sizeof(modbus_gateway_t));
+    if (gw == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    gw->requests = (_modbus_gateway_request_t *)malloc(
+        nb_requests * sizeof(_modbus_gateway_request_t));
+    if (gw->requests == NULL) {
+        free(gw);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (i = 0; i < nb_requests; i++) {
+        gw->requests[i].next = (i + 1 < nb_requests) ? &gw->requests[i + 1] : NULL;
+    }
+    gw->free = gw->requests;
+    gw->nb_requests = nb_requests;
+
+    gw->tcp = tcp_ctx;
+    gw->rtu = rtu_ctx;
+    gw->max_per_unit = nb_requests;
+    gw->timeout_ms = _MODBUS_GATEWAY_TIMEOUT_MS;
+
+    return gw;
+}
+
+/* Bounds the requests queued for one unit to max_per_unit, further ones
+   being answered with a busy exception, and the time a request may wait to
+   timeout_ms (0 for no limit), a busy exception being sent instead of
+   forwarding it later */
+int modbus_gateway_set_queue_limits(modbus_gateway_t *gw, int max_per_unit,
+                                    unsigned long timeout_ms)
+{
+    if (gw == NULL || max_per_unit < 1 || max_per_unit > gw->nb_requests) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    gw->max_per_unit = max_per_unit;
+    gw->timeout_ms = timeout_ms;
+
+    return 0;
+}
+
+/* Answers read requests (function codes 1 to 4) from the response of the
+   slave to the same request for ttl_ms milliseconds, 0 to forward them all.
+   A read request for the values of one queued is answered with it, without
+   counting against the limit of its unit. Any other request to a unit drops
+   the responses kept for it. */
+int modbus_gateway_set_read_cache(modbus_gateway_t *gw, unsigned long ttl_ms)
+{
+    if (gw == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(gw->cache, 0, sizeof(gw->cache));
+    gw->cache_next = 0;
+    gw->cache_ttl_ms = ttl_ms;
+
+    return 0;
+}
+
+/* Waits up to timeout_ms (-1 for ever) for TCP clients and requests, queues
+   the requests received and forwards the next one queued, the units taking
+   turns. A serial transaction spans calls: the TCP clients keep being served
+   while the response of the slave arrives, which is waited for up to the
+   response timeout of the RTU context. Returns the number of requests
+   answered, or -1 with errno set. */
+int modbus_gateway_poll(modbus_gateway_t *gw, int timeout_ms)
+{
+    int nb;
+
+    if (gw == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (gw->forwarded != NULL) {
+        /* Whichever of the slave and the clients comes first */
+        _modbus_gateway_wait(gw, timeout_ms);
+        timeout_ms = 0;
+    } else if (gw->nb_queued > 0) {
+        /* Requests already waiting aren't held up by the wait */
+        timeout_ms = 0;
+    }
+
+    nb = _modbus_tcp_poll(gw->tcp, _modbus_gateway_receive, gw, timeout_ms);
+    if (nb == -1) {
+        return -1;
+    }
+
+    if (gw->forwarded != NULL) {
+        nb += _modbus_gateway_complete(gw);
+    }
+    if (gw->forwarded == NULL) {
+        nb += _modbus_gateway_forward(gw);
+    }
+
+    return nb;
+}
+
+void modbus_gateway_free(modbus_gateway_t *gw)
+{
+    if (gw == NULL) {
+        return;
+    }
+
+    free(gw->requests);
+    free(gw);
+}
+
+#endif /* MODBUS_TCP */
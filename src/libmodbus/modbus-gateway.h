@@ -0,0 +1,40 @@
+/*
+ * Copyright © 2022 Darryl Noakes <darryl.noakes@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#ifndef MODBUS_GATEWAY_H
+#define MODBUS_GATEWAY_H
+
+#include "modbus.h"
+#include "modbus-tcp.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Largest number of requests a gateway can queue, see modbus_gateway_new() */
+#ifndef MODBUS_GATEWAY_MAX_REQUESTS
+#define MODBUS_GATEWAY_MAX_REQUESTS 1024
+#endif
+
+/* Number of read responses kept by the read cache of a gateway, see
+ * modbus_gateway_set_read_cache() */
+#ifndef MODBUS_GATEWAY_CACHE_ENTRIES
+#define MODBUS_GATEWAY_CACHE_ENTRIES 16
+#endif
+
+#if MODBUS_TCP
+typedef struct _modbus_gateway modbus_gateway_t;
+
+MODBUS_API modbus_gateway_t* modbus_gateway_new(modbus_t *tcp_ctx, modbus_t *rtu_ctx,
+                                                int nb_requests);
+MODBUS_API int modbus_gateway_set_queue_limits(modbus_gateway_t *gw, int max_per_unit,
+                                               unsigned long timeout_ms);
+MODBUS_API int modbus_gateway_set_read_cache(modbus_gateway_t *gw, unsigned long ttl_ms);
+MODBUS_API int modbus_gateway_poll(modbus_gateway_t *gw, int timeout_ms);
+MODBUS_API void modbus_gateway_free(modbus_gateway_t *gw);
+#endif
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_GATEWAY_H */
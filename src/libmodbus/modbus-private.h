@@ -47,6 +47,20 @@ MODBUS_BEGIN_DECLS
 
 #define _MODBUS_EXCEPTION_RSP_LENGTH 5
 
+/* Retries of a read racing a mapping update before answering busy */
+#ifndef MODBUS_SEQLOCK_MAX_RETRIES
+#define MODBUS_SEQLOCK_MAX_RETRIES 8
+#endif
+
+/* Orders the accesses to the tables around the sequence count of the
+ * mapping. A compiler barrier is enough against an ISR on a single core
+ * AVR, other targets may run the producer on another core. */
+#if defined(__AVR__)
+#define _MODBUS_SEQ_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+#define _MODBUS_SEQ_BARRIER() __sync_synchronize()
+#endif
+
 /* Timeouts in microsecond (0.5 s) */
 #define _RESPONSE_TIMEOUT    500000
 #define _BYTE_TIMEOUT        500000
@@ -68,6 +82,16 @@ typedef enum {
     MSG_CONFIRMATION
 } msg_type_t;
 
+/* Internal use */
+#define MSG_LENGTH_UNDEFINED -1
+
+/* 3 steps are used to parse the query */
+typedef enum {
+    _STEP_FUNCTION,
+    _STEP_META,
+    _STEP_DATA
+} _step_t;
+
 /* This structure reduces the number of params in functions and so
  * optimizes the speed of execution (~ 37%). */
 typedef struct _sft {
@@ -87,7 +111,15 @@ typedef struct _modbus_backend {
     int (*build_response_basis) (sft_t *sft, uint8_t *rsp);
     int (*prepare_response_tid) (const uint8_t *req, int *req_length);
     int (*send_msg_pre) (uint8_t *req, int req_length);
-    ssize_t (*send) (modbus_t *ctx, const uint8_t *req, int req_length);
+    /* Also fills the checksum space reserved by send_msg_pre */
+    ssize_t (*send) (modbus_t *ctx, uint8_t *req, int req_length);
+    /* Sends a frame whose checksum is already in place as the response to
+     * req, whose transaction identifier (TCP) replaces the one of msg */
+    ssize_t (*send_frame) (modbus_t *ctx, const uint8_t *req,
+                           const uint8_t *msg, int msg_length);
+    /* Appends the checksum to a frame kept for send_frame, returns its
+     * length */
+    int (*complete_frame) (uint8_t *msg, int msg_length);
     int (*receive) (modbus_t *ctx, uint8_t *req);
     ssize_t (*recv) (modbus_t *ctx, uint8_t *rsp, int rsp_length);
     int (*check_integrity) (modbus_t *ctx, uint8_t *msg,
@@ -97,10 +129,85 @@ typedef struct _modbus_backend {
     int (*connect) (modbus_t *ctx);
     void (*close) (modbus_t *ctx);
     int (*flush) (modbus_t *ctx);
+    /* Discards the input until the end of the frame being received, NULL if
+     * the backend can't tell */
+    int (*drain) (modbus_t *ctx, const struct timeval *tv);
     int (*select) (modbus_t *ctx, fd_set *rset, struct timeval *tv, int msg_length);
     void (*free) (modbus_t *ctx);
 } modbus_backend_t;
 
+/* Number of user defined function codes, see MODBUS_IS_USER_FUNCTION() */
+#define _MODBUS_USER_FUNCTIONS 19
+
+#define _MODBUS_SERVER_HAS(function) (((MODBUS_SERVER_FUNCTIONS) >> (function)) & 1)
+
+typedef struct {
+    modbus_function_handler_t handler;
+    void *data;
+    /* Framing of the requests, see modbus_register_function() */
+    uint8_t meta_length;
+    uint8_t byte_count;
+} _modbus_user_function_t;
+
+/* Units answered besides the slave address of the context */
+typedef struct {
+    /* Position in mappings plus one of each slave address, 0 if not served */
+    uint8_t index[256];
+    int nb;
+    modbus_mapping_t *mappings[MODBUS_MAX_UNITS];
+} _modbus_units_t;
+
+/* Last response sent to a write, replayed for a byte-identical request
+   received within the window, see modbus_set_retry_window() */
+typedef struct {
+    uint32_t window_ms;
+    /* Socket of the client of the request, the TCP connection */
+    int s;
+    /* Request answered, or being answered */
+    uint32_t req_hash;
+    int req_length;
+    /* Frame sent in response, checksum included, 0 if none */
+    int rsp_length;
+    uint32_t rsp_ms;
+    uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+} _modbus_retry_t;
+
+/* Response to a read request, see modbus_set_response_cache() */
+typedef struct {
+    const modbus_mapping_t *mapping;
+    /* Of the mapping when the values were read */
+    uint32_t generation;
+    uint8_t slave;
+    uint8_t function;
+    uint16_t address;
+    uint16_t nb;
+    /* Frame sent, checksum included, 0 if the entry is free */
+    int rsp_length;
+    uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+} _modbus_cached_response_t;
+
+#if MODBUS_FIXED_RESPONSES
+/* Exception responses kept, to the function codes up to write and read
+   registers with the exception codes up to server failure */
+#define _MODBUS_FIXED_FUNCTIONS  (MODBUS_FC_WRITE_AND_READ_REGISTERS + 1)
+#define _MODBUS_FIXED_EXCEPTIONS MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE
+#define _MODBUS_FIXED_CHECKSUM_LENGTH 2
+
+/* Responses that only depend on the slave address of the context, built
+   with their checksum by modbus_set_slave(), see MODBUS_FIXED_RESPONSES */
+typedef struct {
+    /* Slave address of the frames, -1 if none are built */
+    int slave;
+    uint8_t exception_checksums[_MODBUS_FIXED_FUNCTIONS][_MODBUS_FIXED_EXCEPTIONS]
+                               [_MODBUS_FIXED_CHECKSUM_LENGTH];
+    /* Report slave ID response, 0 if the function isn't answered */
+    int report_slave_id_length;
+    /* Slave, function, byte count, ID, run indicator, "LMB" + version */
+    uint8_t report_slave_id[5 + sizeof("LMB" LIBMODBUS_VERSION_STRING) - 1 +
+                            _MODBUS_FIXED_CHECKSUM_LENGTH];
+} _modbus_fixed_t;
+#endif
+
 struct _modbus {
     /* Slave address */
     int slave;
@@ -108,15 +215,51 @@ struct _modbus {
     int s;
     int debug;
     int error_recovery;
+    int flush_mode;
     struct timeval response_timeout;
     struct timeval byte_timeout;
     const modbus_backend_t *backend;
     void *backend_data;
+    /* Allocated on the first modbus_register_function() call */
+    _modbus_user_function_t *user_functions;
+    /* Allocated on the first modbus_add_unit() call */
+    _modbus_units_t *units;
+    /* Allocated by modbus_set_retry_window() */
+    _modbus_retry_t *retry;
+    /* Allocated by modbus_set_response_cache() */
+    _modbus_cached_response_t *responses;
+    int nb_responses;
+    int next_response;
+#if MODBUS_FIXED_RESPONSES
+    _modbus_fixed_t fixed;
+#endif
 };
 
+/* TRUE if the requests to slave are answered: those to the address of the
+ * context, broadcasts and those to the units added with modbus_add_unit() */
+static inline int _modbus_serves(const modbus_t *ctx, int slave)
+{
+    return slave == ctx->slave || slave == MODBUS_BROADCAST_ADDRESS ||
+           (ctx->units != NULL && ctx->units->index[slave & 0xFF] != 0);
+}
+
+/* TRUE if a request to slave is a broadcast, which is never answered. In TCP
+ * the unit identifier 0 is an ordinary address. */
+static inline int _modbus_is_broadcast(const modbus_t *ctx, int slave)
+{
+    return slave == MODBUS_BROADCAST_ADDRESS &&
+           ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU;
+}
+
 void _modbus_init_common(modbus_t *ctx);
 void _error_print(modbus_t *ctx, const char *context);
 int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type);
+uint8_t _modbus_compute_meta_length_after_function(modbus_t *ctx, int function,
+                                                   msg_type_t msg_type);
+int _modbus_compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg,
+                                           msg_type_t msg_type);
+int _modbus_compute_response_length_from_request(modbus_t *ctx, const uint8_t *req);
+int _modbus_rtu_receive_confirmation(modbus_t *ctx, uint8_t *rsp);
 
 #ifndef HAVE_STRLCPY
 size_t strlcpy(char *dest, const char *src, size_t dest_size);
@@ -17,22 +17,105 @@
 
 #include "RS485Class/RS485Class.h"
 
+#if MODBUS_RTU_TTY
+#include <termios.h>
+#include <sys/ioctl.h>
+
+#ifndef HAVE_DECL_TIOCSRS485
+#  ifdef TIOCSRS485
+#    define HAVE_DECL_TIOCSRS485 1
+#  else
+#    define HAVE_DECL_TIOCSRS485 0
+#  endif
+#endif
+
+#ifndef HAVE_DECL_TIOCM_RTS
+#  ifdef TIOCM_RTS
+#    define HAVE_DECL_TIOCM_RTS 1
+#  else
+#    define HAVE_DECL_TIOCM_RTS 0
+#  endif
+#endif
+
+#if HAVE_DECL_TIOCSRS485
+#include <linux/serial.h>
+#endif
+#endif
+
 #define _MODBUS_RTU_HEADER_LENGTH      1
 #define _MODBUS_RTU_PRESET_REQ_LENGTH  6
 #define _MODBUS_RTU_PRESET_RSP_LENGTH  2
 
 #define _MODBUS_RTU_CHECKSUM_LENGTH    2
 
+/* Bytes handed to the UART between two steps of the transmit CRC */
+#define _MODBUS_RTU_SEND_CHUNK         16
+
+/* Number of RTU contexts allocated statically by modbus_new_rtu before it
+ * falls back to malloc (0 to always use the heap) */
+#ifndef MODBUS_RTU_STATIC_CONTEXTS
+#define MODBUS_RTU_STATIC_CONTEXTS     1
+#endif
+
+/* State of the listen only mode, see modbus_rtu_set_listen_only() */
+typedef struct {
+    modbus_transaction_callback_t cb;
+    void *data;
+    /* Request waiting for its response, without its CRC */
+    uint8_t req[MODBUS_RTU_MAX_ADU_LENGTH];
+    int req_length;
+    /* Time the request was received */
+    unsigned long req_us;
+} _modbus_rtu_listener_t;
+
 typedef struct _modbus_rtu {
 
+    /* NULL when the port is a tty, see modbus_new_rtu_tty() */
     RS485Class *rs485;
 
+#if MODBUS_RTU_TTY
+    /* Path of the tty, its framing and the settings restored on close */
+    char *device;
+    char parity;
+    uint8_t data_bit;
+    uint8_t stop_bit;
+    struct termios old_tios;
+#if HAVE_DECL_TIOCSRS485
+    struct serial_rs485 old_rs485;
+#endif
+    /* TRUE if the kernel drives the transmitter (TIOCSRS485), RTS is
+     * raised during transmissions otherwise */
+    uint8_t tty_rs485;
+#endif
+
     unsigned long baud;
     uint16_t config;
 
+    /* Silent interval ending a frame (3.5 characters, at least
+     * MODBUS_RTU_TTY_FRAME_GAP_US on a USB adapter's tty), in microseconds */
+    unsigned long t35_us;
+
     /* To handle many slaves on the same link */
     int confirmation_to_ignore;
-    
+
+    /* Frame being received by modbus_receive(), kept between calls so each
+     * call only consumes the bytes available */
+    uint8_t rx_msg[MODBUS_RTU_MAX_ADU_LENGTH];
+    int rx_length;
+    int rx_to_read;
+    uint8_t rx_step;
+    uint8_t rx_msg_type;
+    /* CRC of the bytes received so far, only computed (rx_check TRUE) for
+     * the requests to an address served */
+    uint16_t rx_crc;
+    uint8_t rx_check;
+    /* Time of the last bytes read */
+    unsigned long rx_last_us;
+    /* FALSE after a framing error, until the line is silent for T3.5 */
+    uint8_t rx_sync;
+
+    /* Allocated in listen only mode */
+    _modbus_rtu_listener_t *listener;
 } modbus_rtu_t;
 
 #endif /* MODBUS_RTU_PRIVATE_H */
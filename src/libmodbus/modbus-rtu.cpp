@@ -25,6 +25,7 @@
 
 #include "modbus-rtu.h"
 #include "modbus-rtu-private.h"
+#include "modbus-crc.h"
 
 #if HAVE_DECL_TIOCSRS485 || HAVE_DECL_TIOCM_RTS
 #include <sys/ioctl.h>
@@ -35,8 +36,6 @@
 #endif
 
 #if defined(__AVR__)
-#include <avr/pgmspace.h>
-
 #undef EIO
 #define EIO 5
 
@@ -56,74 +55,165 @@
 #define ENOTSUP 134
 #endif
 
-/* Table of CRC values for high-order byte */
-#if defined(__AVR__)
-static PROGMEM const uint8_t table_crc_hi[] = {
-#else
-static const uint8_t table_crc_hi[] = {
-#endif
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40
-};
+/* The port is either an RS485Class or, with rs485 NULL, the tty opened by
+ * modbus_new_rtu_tty() whose file descriptor is ctx->s. The functions below
+ * hide the difference from the rest of the backend. */
 
-/* Table of CRC values for low-order byte */
-#if defined(__AVR__)
-#include <avr/pgmspace.h>
-static PROGMEM const uint8_t table_crc_lo[] = {
+/* Returns the number of bytes that can be read without waiting */
+static int _modbus_rtu_port_available(modbus_t *ctx)
+{
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+
+#if MODBUS_RTU_TTY
+    if (ctx_rtu->rs485 == NULL) {
+        int available;
+
+        if (ctx->s == -1 || ioctl(ctx->s, FIONREAD, &available) == -1) {
+            return 0;
+        }
+        return available;
+    }
+#endif
+
+    return ctx_rtu->rs485->available();
+}
+
+/* Reads up to length bytes already received, returns the number read */
+static int _modbus_rtu_port_read(modbus_t *ctx, uint8_t *msg, int length)
+{
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+
+#if MODBUS_RTU_TTY
+    if (ctx_rtu->rs485 == NULL) {
+        ssize_t rc = read(ctx->s, msg, length);
+
+        return (rc < 0) ? 0 : (int)rc;
+    }
+#endif
+
+    return ctx_rtu->rs485->readBytes(msg, length);
+}
+
+/* Discards length bytes already received */
+static void _modbus_rtu_port_skip(modbus_t *ctx, int length)
+{
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+
+#if MODBUS_RTU_TTY
+    if (ctx_rtu->rs485 == NULL) {
+        uint8_t buf[64];
+
+        while (length > 0) {
+            int rc = _modbus_rtu_port_read(ctx, buf, (length < (int)sizeof(buf)) ? length : (int)sizeof(buf));
+
+            if (rc <= 0) {
+                break;
+            }
+            length -= rc;
+        }
+        return;
+    }
+#endif
+
+    while (length-- > 0) {
+        ctx_rtu->rs485->read();
+    }
+}
+
+/* Waits at most timeout_us for bytes to read. Only a tty can be waited on,
+ * an RS485Class returns at once and is polled by the caller. */
+static void _modbus_rtu_port_wait(modbus_t *ctx, unsigned long timeout_us)
+{
+#if MODBUS_RTU_TTY
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+
+    if (ctx_rtu->rs485 == NULL && ctx->s != -1) {
+        fd_set rset;
+        struct timeval tv;
+
+        FD_ZERO(&rset);
+        FD_SET(ctx->s, &rset);
+        tv.tv_sec = timeout_us / 1000000UL;
+        tv.tv_usec = timeout_us % 1000000UL;
+        select(ctx->s + 1, &rset, NULL, NULL, &tv);
+    }
 #else
-static const uint8_t table_crc_lo[] = {
-#endif
-    0x00, 0xC0, 0xC1, 0x01, 0xC3, 0x03, 0x02, 0xC2, 0xC6, 0x06,
-    0x07, 0xC7, 0x05, 0xC5, 0xC4, 0x04, 0xCC, 0x0C, 0x0D, 0xCD,
-    0x0F, 0xCF, 0xCE, 0x0E, 0x0A, 0xCA, 0xCB, 0x0B, 0xC9, 0x09,
-    0x08, 0xC8, 0xD8, 0x18, 0x19, 0xD9, 0x1B, 0xDB, 0xDA, 0x1A,
-    0x1E, 0xDE, 0xDF, 0x1F, 0xDD, 0x1D, 0x1C, 0xDC, 0x14, 0xD4,
-    0xD5, 0x15, 0xD7, 0x17, 0x16, 0xD6, 0xD2, 0x12, 0x13, 0xD3,
-    0x11, 0xD1, 0xD0, 0x10, 0xF0, 0x30, 0x31, 0xF1, 0x33, 0xF3,
-    0xF2, 0x32, 0x36, 0xF6, 0xF7, 0x37, 0xF5, 0x35, 0x34, 0xF4,
-    0x3C, 0xFC, 0xFD, 0x3D, 0xFF, 0x3F, 0x3E, 0xFE, 0xFA, 0x3A,
-    0x3B, 0xFB, 0x39, 0xF9, 0xF8, 0x38, 0x28, 0xE8, 0xE9, 0x29,
-    0xEB, 0x2B, 0x2A, 0xEA, 0xEE, 0x2E, 0x2F, 0xEF, 0x2D, 0xED,
-    0xEC, 0x2C, 0xE4, 0x24, 0x25, 0xE5, 0x27, 0xE7, 0xE6, 0x26,
-    0x22, 0xE2, 0xE3, 0x23, 0xE1, 0x21, 0x20, 0xE0, 0xA0, 0x60,
-    0x61, 0xA1, 0x63, 0xA3, 0xA2, 0x62, 0x66, 0xA6, 0xA7, 0x67,
-    0xA5, 0x65, 0x64, 0xA4, 0x6C, 0xAC, 0xAD, 0x6D, 0xAF, 0x6F,
-    0x6E, 0xAE, 0xAA, 0x6A, 0x6B, 0xAB, 0x69, 0xA9, 0xA8, 0x68,
-    0x78, 0xB8, 0xB9, 0x79, 0xBB, 0x7B, 0x7A, 0xBA, 0xBE, 0x7E,
-    0x7F, 0xBF, 0x7D, 0xBD, 0xBC, 0x7C, 0xB4, 0x74, 0x75, 0xB5,
-    0x77, 0xB7, 0xB6, 0x76, 0x72, 0xB2, 0xB3, 0x73, 0xB1, 0x71,
-    0x70, 0xB0, 0x50, 0x90, 0x91, 0x51, 0x93, 0x53, 0x52, 0x92,
-    0x96, 0x56, 0x57, 0x97, 0x55, 0x95, 0x94, 0x54, 0x9C, 0x5C,
-    0x5D, 0x9D, 0x5F, 0x9F, 0x9E, 0x5E, 0x5A, 0x9A, 0x9B, 0x5B,
-    0x99, 0x59, 0x58, 0x98, 0x88, 0x48, 0x49, 0x89, 0x4B, 0x8B,
-    0x8A, 0x4A, 0x4E, 0x8E, 0x8F, 0x4F, 0x8D, 0x4D, 0x4C, 0x8C,
-    0x44, 0x84, 0x85, 0x45, 0x87, 0x47, 0x46, 0x86, 0x82, 0x42,
-    0x43, 0x83, 0x41, 0x81, 0x80, 0x40
-};
+    (void)ctx;
+    (void)timeout_us;
+#endif
+}
+
+#if HAVE_DECL_TIOCM_RTS
+static void _modbus_rtu_ioctl_rts(modbus_t *ctx, int on);
+#endif
+
+/* Switches the line to transmission */
+static void _modbus_rtu_port_begin_transmission(modbus_t *ctx)
+{
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+
+#if MODBUS_RTU_TTY
+    if (ctx_rtu->rs485 == NULL) {
+#if HAVE_DECL_TIOCM_RTS
+        if (!ctx_rtu->tty_rs485) {
+            _modbus_rtu_ioctl_rts(ctx, TRUE);
+        }
+#endif
+        return;
+    }
+#endif
+
+    ctx_rtu->rs485->noReceive();
+    ctx_rtu->rs485->beginTransmission();
+}
+
+/* Writes length bytes, returns the number written */
+static ssize_t _modbus_rtu_port_write(modbus_t *ctx, const uint8_t *msg, int length)
+{
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+
+#if MODBUS_RTU_TTY
+    if (ctx_rtu->rs485 == NULL) {
+        ssize_t size = 0;
+
+        while (size < length) {
+            ssize_t rc = write(ctx->s, msg + size, length - size);
+
+            if (rc == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            size += rc;
+        }
+        return size;
+    }
+#endif
+
+    return ctx_rtu->rs485->write(msg, length);
+}
+
+/* Switches the line back to reception once the bytes written are out */
+static void _modbus_rtu_port_end_transmission(modbus_t *ctx)
+{
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+
+#if MODBUS_RTU_TTY
+    if (ctx_rtu->rs485 == NULL) {
+#if HAVE_DECL_TIOCM_RTS
+        if (!ctx_rtu->tty_rs485) {
+            tcdrain(ctx->s);
+            _modbus_rtu_ioctl_rts(ctx, FALSE);
+        }
+#endif
+        return;
+    }
+#endif
+
+    ctx_rtu->rs485->endTransmission();
+    ctx_rtu->rs485->receive();
+}
 
 /* Define the slave ID of the remote device to talk in master mode or set the
  * internal slave ID in slave mode */
@@ -168,27 +258,6 @@ static int _modbus_rtu_build_response_basis(sft_t *sft, uint8_t *rsp)
     return _MODBUS_RTU_PRESET_RSP_LENGTH;
 }
 
-static uint16_t crc16(uint8_t *buffer, uint16_t buffer_length)
-{
-    uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
-    uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
-    unsigned int i; /* will index into CRC lookup */
-
-    /* pass through message buffer */
-    while (buffer_length--) {
-        i = crc_hi ^ *buffer++; /* calculate the CRC  */
-#if defined(__AVR__)
-        crc_hi = crc_lo ^ pgm_read_byte_near(table_crc_hi + i);
-        crc_lo = pgm_read_byte_near(table_crc_lo + i);
-#else
-        crc_hi = crc_lo ^ table_crc_hi[i];
-        crc_lo = table_crc_lo[i];
-#endif
-    }
-
-    return (crc_hi << 8 | crc_lo);
-}
-
 static int _modbus_rtu_prepare_response_tid(const uint8_t *req, int *req_length)
 {
 
@@ -198,13 +267,13 @@ static int _modbus_rtu_prepare_response_tid(const uint8_t *req, int *req_length)
     return 0;
 }
 
+/* The CRC is appended by _modbus_rtu_send() while the frame goes out, in the
+   space reserved here */
 static int _modbus_rtu_send_msg_pre(uint8_t *req, int req_length)
 {
-    uint16_t crc = crc16(req, req_length);
-    req[req_length++] = crc >> 8;
-    req[req_length++] = crc & 0x00FF;
+    (void)req;
 
-    return req_length;
+    return req_length + _MODBUS_RTU_CHECKSUM_LENGTH;
 }
 
 #if HAVE_DECL_TIOCM_RTS
@@ -223,30 +292,367 @@ static void _modbus_rtu_ioctl_rts(modbus_t *ctx, int on)
 }
 #endif
 
-static ssize_t _modbus_rtu_send(modbus_t *ctx, const uint8_t *req, int req_length)
+static ssize_t _modbus_rtu_send(modbus_t *ctx, uint8_t *req, int req_length)
 {
+    ssize_t size = 0;
+    uint16_t crc = 0xFFFF;
+    int length = req_length - _MODBUS_RTU_CHECKSUM_LENGTH;
+    int i;
+
+    _modbus_rtu_port_begin_transmission(ctx);
+    /* Each chunk is handed to the UART before its CRC is computed, so the
+       first byte goes out at once and the CRC is done while it is shifted
+       out */
+    for (i = 0; i < length; i += _MODBUS_RTU_SEND_CHUNK) {
+        int n = (length - i < _MODBUS_RTU_SEND_CHUNK) ? length - i : _MODBUS_RTU_SEND_CHUNK;
+
+        size += _modbus_rtu_port_write(ctx, req + i, n);
+        crc = modbus_crc16(crc, req + i, n);
+    }
+    req[length] = crc & 0x00FF;
+    req[length + 1] = crc >> 8;
+    size += _modbus_rtu_port_write(ctx, req + length, _MODBUS_RTU_CHECKSUM_LENGTH);
+    _modbus_rtu_port_end_transmission(ctx);
 
-    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+    return size;
+}
 
+static ssize_t _modbus_rtu_send_frame(modbus_t *ctx, const uint8_t *req,
+                                      const uint8_t *msg, int msg_length)
+{
     ssize_t size;
 
-    ctx_rtu->rs485->noReceive();
-    ctx_rtu->rs485->beginTransmission();
-    size = ctx_rtu->rs485->write(req, req_length);
-    ctx_rtu->rs485->endTransmission();
-    ctx_rtu->rs485->receive();
+    (void)req;
+
+    _modbus_rtu_port_begin_transmission(ctx);
+    size = _modbus_rtu_port_write(ctx, msg, msg_length);
+    _modbus_rtu_port_end_transmission(ctx);
 
     return size;
 }
 
+static int _modbus_rtu_complete_frame(uint8_t *msg, int msg_length)
+{
+    uint16_t crc = modbus_crc16(0xFFFF, msg, msg_length);
+
+    msg[msg_length++] = crc & 0x00FF;
+    msg[msg_length++] = crc >> 8;
+
+    return msg_length;
+}
+
+static int _modbus_rtu_check_frame(modbus_t *ctx, uint8_t *msg,
+                                   const int msg_length, int crc_residue);
+
+/* Consumes the bytes available of the frame being received, with the steps of
+   _modbus_receive_msg() but without waiting for the missing ones. Returns the
+   frame length once it is complete, 0 while it isn't, or -1 with errno set
+   to EMBBADDATA when the frame is abandoned: too long, or still incomplete
+   after a T3.5 silence. A frame starting is taken for a msg_type.
+
+   Frames are delimited by a T3.5 silence, the length given by the function
+   code being checked against it. The UART buffers the bytes, so a silence is
+   only known for sure when nothing is available: no byte arrived since the
+   last one read. */
+static int _modbus_rtu_receive_available(modbus_t *ctx, msg_type_t msg_type)
+{
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+    int available = _modbus_rtu_port_available(ctx);
+    unsigned long now = micros();
+    int msg_length;
+
+    if (available <= 0) {
+        if ((now - ctx_rtu->rx_last_us) >= ctx_rtu->t35_us) {
+            ctx_rtu->rx_sync = TRUE;
+            if (ctx_rtu->rx_length > 0) {
+                if (ctx->debug) {
+                    fprintf(stderr, "Frame shorter than its function code requires (%d bytes)\n",
+                            ctx_rtu->rx_length);
+                }
+                ctx_rtu->rx_length = 0;
+                errno = EMBBADDATA;
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    ctx_rtu->rx_last_us = now;
+
+    if (!ctx_rtu->rx_sync) {
+        /* Skip the rest of a damaged frame, until the line is silent */
+        _modbus_rtu_port_skip(ctx, available);
+        return 0;
+    }
+
+    if (ctx_rtu->rx_length == 0) {
+        /* Start of a frame, reach the function code first */
+        ctx_rtu->rx_crc = 0xFFFF;
+        ctx_rtu->rx_step = _STEP_FUNCTION;
+        ctx_rtu->rx_to_read = _MODBUS_RTU_HEADER_LENGTH + 1;
+        ctx_rtu->rx_msg_type = msg_type;
+    }
+
+    while (available > 0 && ctx_rtu->rx_to_read > 0) {
+        int length = (available < ctx_rtu->rx_to_read) ? available : ctx_rtu->rx_to_read;
+
+        /* The bytes are there, readBytes() doesn't wait */
+        length = _modbus_rtu_port_read(ctx, ctx_rtu->rx_msg + ctx_rtu->rx_length, length);
+        if (length <= 0) {
+            break;
+        }
+
+        if (ctx->debug) {
+            int i;
+            for (i = 0; i < length; i++)
+                printf("<%.2X>", ctx_rtu->rx_msg[ctx_rtu->rx_length + i]);
+        }
+
+        if (ctx_rtu->rx_length == 0) {
+            /* The address comes first: the frames to other units and the
+               responses to ignore are only framed, not checked */
+            ctx_rtu->rx_check = ctx_rtu->rx_msg_type == MSG_INDICATION &&
+                                _modbus_serves(ctx, ctx_rtu->rx_msg[0]);
+        }
+
+        /* The CRC follows the bytes, only a compare is left at the end */
+        if (ctx_rtu->rx_check) {
+            ctx_rtu->rx_crc = modbus_crc16(ctx_rtu->rx_crc, ctx_rtu->rx_msg + ctx_rtu->rx_length, length);
+        }
+        ctx_rtu->rx_length += length;
+        ctx_rtu->rx_to_read -= length;
+        available -= length;
+
+        if (ctx_rtu->rx_to_read == 0) {
+            switch (ctx_rtu->rx_step) {
+            case _STEP_FUNCTION:
+                ctx_rtu->rx_to_read = _modbus_compute_meta_length_after_function(
+                    ctx, ctx_rtu->rx_msg[_MODBUS_RTU_HEADER_LENGTH],
+                    (msg_type_t)ctx_rtu->rx_msg_type);
+                if (ctx_rtu->rx_to_read != 0) {
+                    ctx_rtu->rx_step = _STEP_META;
+                    break;
+                }
+                /* else switches straight to the next step */
+                /* fall through */
+            case _STEP_META:
+                ctx_rtu->rx_to_read = _modbus_compute_data_length_after_meta(
+                    ctx, ctx_rtu->rx_msg, (msg_type_t)ctx_rtu->rx_msg_type);
+                if ((ctx_rtu->rx_length + ctx_rtu->rx_to_read) > MODBUS_RTU_MAX_ADU_LENGTH) {
+                    ctx_rtu->rx_length = 0;
+                    ctx_rtu->rx_sync = FALSE;
+                    errno = EMBBADDATA;
+                    _error_print(ctx, "too many data");
+                    return -1;
+                }
+                ctx_rtu->rx_step = _STEP_DATA;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    if (ctx_rtu->rx_to_read > 0) {
+        return 0;
+    }
+
+    if (ctx->debug)
+        printf("\n");
+
+    msg_length = ctx_rtu->rx_length;
+    ctx_rtu->rx_length = 0;
+
+    return msg_length;
+}
+
+/* Returns the length of the response to req at the start of msg, 0 while
+   too few bytes are there to tell, MSG_LENGTH_UNDEFINED if only the silence
+   after it tells (user defined function codes) or -1 if msg doesn't start
+   with a response to req. */
+static int _modbus_rtu_listen_response_length(modbus_t *ctx, const uint8_t *req,
+                                              const uint8_t *msg, int length)
+{
+    int rc;
+
+    if (length < _MODBUS_RTU_HEADER_LENGTH + 1) {
+        return 0;
+    }
+    if (msg[0] != req[0]) {
+        return -1;
+    }
+    if (msg[1] == (req[1] | 0x80)) {
+        /* Exception code */
+        return _MODBUS_RTU_HEADER_LENGTH + 2 + _MODBUS_RTU_CHECKSUM_LENGTH;
+    }
+    if (msg[1] != req[1]) {
+        return -1;
+    }
+    if (MODBUS_IS_USER_FUNCTION(req[1])) {
+        return MSG_LENGTH_UNDEFINED;
+    }
+
+    rc = _modbus_compute_response_length_from_request(ctx, req);
+    if (rc == MSG_LENGTH_UNDEFINED) {
+        /* The byte count follows the function code */
+        if (length < _MODBUS_RTU_HEADER_LENGTH + 2) {
+            return 0;
+        }
+        rc = _MODBUS_RTU_HEADER_LENGTH + 2 + msg[2] + _MODBUS_RTU_CHECKSUM_LENGTH;
+    }
+
+    return rc;
+}
+
+/* Returns the length of the request at the start of msg, 0 while too few
+   bytes are there to tell */
+static int _modbus_rtu_listen_request_length(modbus_t *ctx, uint8_t *msg, int length)
+{
+    int n = _MODBUS_RTU_HEADER_LENGTH + 1;
+
+    if (length < n) {
+        return 0;
+    }
+    n += _modbus_compute_meta_length_after_function(ctx, msg[_MODBUS_RTU_HEADER_LENGTH],
+                                                    MSG_INDICATION);
+    if (length < n) {
+        return 0;
+    }
+
+    return n + _modbus_compute_data_length_after_meta(ctx, msg, MSG_INDICATION);
+}
+
+/* TRUE if the first length bytes of msg are a whole frame (its CRC checks) */
+static int _modbus_rtu_listen_frame(const uint8_t *msg, int length, int received)
+{
+    return length > _MODBUS_RTU_CHECKSUM_LENGTH && length <= received &&
+           modbus_crc16(0xFFFF, msg, length) == 0;
+}
+
+/* Consumes the bytes available in listen only mode and hands each request,
+   with the response that follows it, to the callback. Nothing is ever sent.
+
+   Requests and responses are framed like in _modbus_rtu_receive_available(),
+   but every address is followed and the kind of a frame is only known once
+   its CRC checks: a response to the pending request is tried first, whose
+   length comes from the request, then a new request. Bytes that fit neither
+   are skipped until the next T3.5 silence. */
+static void _modbus_rtu_listen(modbus_t *ctx)
+{
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+    _modbus_rtu_listener_t *listener = ctx_rtu->listener;
+    unsigned long timeout_us = (ctx->response_timeout.tv_sec * 1000000UL) +
+                               ctx->response_timeout.tv_usec;
+    unsigned long now;
+
+    for (;;) {
+        int available = _modbus_rtu_port_available(ctx);
+        int silent;
+        int rsp_length = -1;
+        int req_length;
+        int length;
+
+        now = micros();
+        if (available > 0) {
+            ctx_rtu->rx_last_us = now;
+            if (!ctx_rtu->rx_sync) {
+                _modbus_rtu_port_skip(ctx, available);
+                continue;
+            }
+
+            length = MODBUS_RTU_MAX_ADU_LENGTH - ctx_rtu->rx_length;
+            if (length > available) {
+                length = available;
+            }
+            length = _modbus_rtu_port_read(ctx, ctx_rtu->rx_msg + ctx_rtu->rx_length, length);
+            if (length > 0) {
+                ctx_rtu->rx_length += length;
+                available -= length;
+            }
+        }
+
+        silent = available <= 0 && (now - ctx_rtu->rx_last_us) >= ctx_rtu->t35_us;
+        if (silent) {
+            ctx_rtu->rx_sync = TRUE;
+        }
+        if (ctx_rtu->rx_length == 0) {
+            break;
+        }
+
+        if (listener->req_length > 0) {
+            rsp_length = _modbus_rtu_listen_response_length(
+                ctx, listener->req, ctx_rtu->rx_msg, ctx_rtu->rx_length);
+            if (rsp_length == MSG_LENGTH_UNDEFINED && silent) {
+                rsp_length = ctx_rtu->rx_length;
+            }
+        }
+        req_length = _modbus_rtu_listen_request_length(ctx, ctx_rtu->rx_msg, ctx_rtu->rx_length);
+
+        if (_modbus_rtu_listen_frame(ctx_rtu->rx_msg, rsp_length, ctx_rtu->rx_length)) {
+            listener->cb(listener->data, listener->req, listener->req_length,
+                         ctx_rtu->rx_msg, rsp_length - _MODBUS_RTU_CHECKSUM_LENGTH);
+            listener->req_length = 0;
+            length = rsp_length;
+        } else if (_modbus_rtu_listen_frame(ctx_rtu->rx_msg, req_length, ctx_rtu->rx_length)) {
+            if (listener->req_length > 0) {
+                /* The previous request was left unanswered */
+                listener->cb(listener->data, listener->req, listener->req_length, NULL, 0);
+                listener->req_length = 0;
+            }
+            length = req_length - _MODBUS_RTU_CHECKSUM_LENGTH;
+            if (ctx_rtu->rx_msg[0] == MODBUS_BROADCAST_ADDRESS) {
+                listener->cb(listener->data, ctx_rtu->rx_msg, length, NULL, 0);
+            } else {
+                memcpy(listener->req, ctx_rtu->rx_msg, length);
+                listener->req_length = length;
+                listener->req_us = now;
+            }
+            length = req_length;
+        } else if (!silent && ctx_rtu->rx_length < MODBUS_RTU_MAX_ADU_LENGTH &&
+                   (rsp_length == 0 || rsp_length == MSG_LENGTH_UNDEFINED ||
+                    rsp_length > ctx_rtu->rx_length || req_length == 0 ||
+                    req_length > ctx_rtu->rx_length)) {
+            /* Wait for the rest of the frame */
+            break;
+        } else {
+            if (ctx->debug) {
+                fprintf(stderr, "Listen only: %d bytes skipped\n", ctx_rtu->rx_length);
+            }
+            ctx_rtu->rx_length = 0;
+            ctx_rtu->rx_sync = silent;
+            continue;
+        }
+
+        ctx_rtu->rx_length -= length;
+        memmove(ctx_rtu->rx_msg, ctx_rtu->rx_msg + length, ctx_rtu->rx_length);
+    }
+
+    if (listener->req_length > 0 && (now - listener->req_us) >= timeout_us) {
+        listener->cb(listener->data, listener->req, listener->req_length, NULL, 0);
+        listener->req_length = 0;
+    }
+}
+
+/* Never waits: returns 0 until a whole frame has been received over calls,
+   see _modbus_rtu_receive_available(). */
 static int _modbus_rtu_receive(modbus_t *ctx, uint8_t *req)
 {
     int rc;
 
     modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
 
-    if (ctx_rtu->confirmation_to_ignore) {
-        _modbus_receive_msg(ctx, req, MSG_CONFIRMATION);
+    if (ctx_rtu->listener != NULL) {
+        _modbus_rtu_listen(ctx);
+        return 0;
+    }
+
+    rc = _modbus_rtu_receive_available(
+        ctx, ctx_rtu->confirmation_to_ignore ? MSG_CONFIRMATION : MSG_INDICATION);
+    if (rc <= 0) {
+        return rc;
+    }
+
+    if (ctx_rtu->rx_msg_type == MSG_CONFIRMATION) {
         /* Ignore errors and reset the flag */
         ctx_rtu->confirmation_to_ignore = FALSE;
         rc = 0;
@@ -254,8 +660,13 @@ static int _modbus_rtu_receive(modbus_t *ctx, uint8_t *req)
             printf("Confirmation to ignore\n");
         }
     } else {
-        rc = _modbus_receive_msg(ctx, req, MSG_INDICATION);
-        if (rc == 0) {
+        memcpy(req, ctx_rtu->rx_msg, rc);
+        rc = _modbus_rtu_check_frame(ctx, req, rc, ctx_rtu->rx_crc);
+        if (rc == -1) {
+            /* A damaged byte may have misled the length, resume at the next
+               silence */
+            ctx_rtu->rx_sync = FALSE;
+        } else if (rc == 0) {
             /* The next expected message is a confirmation to ignore */
             ctx_rtu->confirmation_to_ignore = TRUE;
         }
@@ -263,10 +674,37 @@ static int _modbus_rtu_receive(modbus_t *ctx, uint8_t *req)
     return rc;
 }
 
-static ssize_t _modbus_rtu_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+/* Receives the response to the request sent last like modbus_receive() a
+   request, without waiting: returns its length in rsp, CRC included, once it
+   is complete and its CRC checks, 0 while it isn't, or -1 with errno set.
+   The response timeout and the check of the slave are left to the caller. */
+int _modbus_rtu_receive_confirmation(modbus_t *ctx, uint8_t *rsp)
 {
     modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
-    return ctx_rtu->rs485->readBytes(rsp, rsp_length);
+    int rc;
+
+    rc = _modbus_rtu_receive_available(ctx, MSG_CONFIRMATION);
+    if (rc <= 0) {
+        return rc;
+    }
+
+    memcpy(rsp, ctx_rtu->rx_msg, rc);
+    if (modbus_crc16(0xFFFF, rsp, rc) != 0) {
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR CRC of the response from slave %d\n", rsp[0]);
+        }
+        /* A damaged byte may have misled the length, resume at the next
+           silence */
+        ctx_rtu->rx_sync = FALSE;
+        errno = EMBBADCRC;
+        return -1;
+    }
+    return rc;
+}
+
+static ssize_t _modbus_rtu_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    return _modbus_rtu_port_read(ctx, rsp, rsp_length);
 }
 
 static int _modbus_rtu_flush(modbus_t *);
@@ -292,34 +730,36 @@ static int _modbus_rtu_pre_check_confirmation(modbus_t *ctx, const uint8_t *req,
 
 /* The check_crc16 function shall return 0 is the message is ignored and the
    message length if the CRC is valid. Otherwise it shall return -1 and set
-   errno to EMBADCRC. */
-static int _modbus_rtu_check_integrity(modbus_t *ctx, uint8_t *msg,
-                                       const int msg_length)
+   errno to EMBADCRC.
+   crc_residue is the CRC of the whole message, its CRC included, when it was
+   computed as the bytes arrived, -1 otherwise. */
+static int _modbus_rtu_check_frame(modbus_t *ctx, uint8_t *msg,
+                                   const int msg_length, int crc_residue)
 {
-    uint16_t crc_calculated;
-    uint16_t crc_received;
     int slave = msg[0];
 
     /* Filter on the Modbus unit identifier (slave) in RTU mode to avoid useless
      * CRC computing. */
-    if (slave != ctx->slave && slave != MODBUS_BROADCAST_ADDRESS) {
+    if (!_modbus_serves(ctx, slave)) {
         if (ctx->debug) {
-            printf("Request for slave %d ignored (not %d)\n", slave, ctx->slave);
+            printf("Request for slave %d ignored (not served)\n", slave);
         }
         /* Following call to check_confirmation handles this error */
         return 0;
     }
 
-    crc_calculated = crc16(msg, msg_length - 2);
-    crc_received = (msg[msg_length - 2] << 8) | msg[msg_length - 1];
+    if (crc_residue == -1) {
+        crc_residue = modbus_crc16(0xFFFF, msg, msg_length);
+    }
 
     /* Check CRC of msg */
-    if (crc_calculated == crc_received) {
+    if (crc_residue == 0) {
         return msg_length;
     } else {
         if (ctx->debug) {
             fprintf(stderr, "ERROR CRC received 0x%0X != CRC calculated 0x%0X\n",
-                    crc_received, crc_calculated);
+                    msg[msg_length - 2] | (msg[msg_length - 1] << 8),
+                    modbus_crc16(0xFFFF, msg, msg_length - 2));
         }
 
         if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
@@ -330,13 +770,215 @@ static int _modbus_rtu_check_integrity(modbus_t *ctx, uint8_t *msg,
     }
 }
 
+static int _modbus_rtu_check_integrity(modbus_t *ctx, uint8_t *msg,
+                                       const int msg_length)
+{
+    return _modbus_rtu_check_frame(ctx, msg, msg_length, -1);
+}
+
+#if MODBUS_RTU_TTY
+/* Returns TRUE if the tty at device belongs to a USB serial adapter, i.e. if
+   its device in sysfs (/sys/class/tty/<name>/device) sits under a USB bus.
+   ttyUSB and ttyACM ports do, the UARTs of the board and the pseudo-terminals
+   don't. */
+static int _modbus_rtu_tty_is_usb(const char *device)
+{
+    char *path;
+    char *sys;
+    const char *name;
+    int usb = FALSE;
+
+    path = realpath(device, NULL);
+    if (path == NULL) {
+        return FALSE;
+    }
+    name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+
+    sys = (char*)malloc(strlen(name) + sizeof("/sys/class/tty//device"));
+    if (sys != NULL) {
+        char *link;
+
+        sprintf(sys, "/sys/class/tty/%s/device", name);
+        link = realpath(sys, NULL);
+        if (link != NULL) {
+            usb = strstr(link, "/usb") != NULL;
+            free(link);
+        }
+        free(sys);
+    }
+    free(path);
+
+    return usb;
+}
+
+/* Opens the tty in raw mode with the framing of the context, and hands the
+   direction of an RS-485 transceiver to the kernel when its driver can */
+static int _modbus_rtu_tty_open(modbus_t *ctx)
+{
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+    struct termios tios;
+    speed_t speed;
+
+    switch (ctx_rtu->baud) {
+    case 1200: speed = B1200; break;
+    case 2400: speed = B2400; break;
+    case 4800: speed = B4800; break;
+    case 9600: speed = B9600; break;
+    case 19200: speed = B19200; break;
+    case 38400: speed = B38400; break;
+    case 57600: speed = B57600; break;
+    case 115200: speed = B115200; break;
+    case 230400: speed = B230400; break;
+#ifdef B460800
+    case 460800: speed = B460800; break;
+#endif
+#ifdef B921600
+    case 921600: speed = B921600; break;
+#endif
+    default:
+        if (ctx->debug) {
+            fprintf(stderr, "Unsupported baud rate %lu for %s\n", ctx_rtu->baud, ctx_rtu->device);
+        }
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* O_NONBLOCK so the open doesn't wait for the carrier, the reads never
+       wait anyway (VMIN and VTIME 0) */
+    ctx->s = open(ctx_rtu->device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (ctx->s == -1) {
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR Can't open the device %s (%s)\n",
+                    ctx_rtu->device, strerror(errno));
+        }
+        return -1;
+    }
+    /* O_EXCL means nothing to a tty, TIOCEXCL makes the next opens fail with
+       EBUSY (except for root) until the port is closed */
+    if (ioctl(ctx->s, TIOCEXCL) == -1) {
+        int saved_errno = errno;
+
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR Can't lock the device %s (%s)\n",
+                    ctx_rtu->device, strerror(errno));
+        }
+        close(ctx->s);
+        ctx->s = -1;
+        errno = saved_errno;
+        return -1;
+    }
+    fcntl(ctx->s, F_SETFL, fcntl(ctx->s, F_GETFL) & ~O_NONBLOCK);
+
+    /* 3.5 characters of 11 bits, fixed to 1750 us above 19200 bauds
+       (Modbus over serial line V1.02, 2.5.1.1). A USB adapter passes the
+       bytes on in bursts up to its latency timer apart, the silences being
+       measured between reads the frame gap must outlast them. */
+    ctx_rtu->t35_us = (ctx_rtu->baud > 19200) ? 1750 : 38500000UL / ctx_rtu->baud;
+    if (ctx_rtu->t35_us < MODBUS_RTU_TTY_FRAME_GAP_US &&
+        _modbus_rtu_tty_is_usb(ctx_rtu->device)) {
+        ctx_rtu->t35_us = MODBUS_RTU_TTY_FRAME_GAP_US;
+    }
+
+    tcgetattr(ctx->s, &ctx_rtu->old_tios);
+    memset(&tios, 0, sizeof(struct termios));
+    cfsetispeed(&tios, speed);
+    cfsetospeed(&tios, speed);
+
+    tios.c_cflag |= (CREAD | CLOCAL);
+    tios.c_cflag &= ~CSIZE;
+    switch (ctx_rtu->data_bit) {
+    case 5: tios.c_cflag |= CS5; break;
+    case 6: tios.c_cflag |= CS6; break;
+    case 7: tios.c_cflag |= CS7; break;
+    default: tios.c_cflag |= CS8; break;
+    }
+    if (ctx_rtu->stop_bit == 2) {
+        tios.c_cflag |= CSTOPB;
+    }
+    if (ctx_rtu->parity == 'E') {
+        tios.c_cflag |= PARENB;
+        tios.c_iflag |= INPCK;
+    } else if (ctx_rtu->parity == 'O') {
+        tios.c_cflag |= PARENB | PARODD;
+        tios.c_iflag |= INPCK;
+    }
+    /* Raw input and output, no flow control */
+    tios.c_cc[VMIN] = 0;
+    tios.c_cc[VTIME] = 0;
+
+    if (tcsetattr(ctx->s, TCSANOW, &tios) == -1) {
+        ioctl(ctx->s, TIOCNXCL);
+        close(ctx->s);
+        ctx->s = -1;
+        return -1;
+    }
+
+    ctx_rtu->tty_rs485 = FALSE;
+#if HAVE_DECL_TIOCSRS485
+    if (ioctl(ctx->s, TIOCGRS485, &ctx_rtu->old_rs485) == 0) {
+        struct serial_rs485 rs485conf = ctx_rtu->old_rs485;
+
+        /* The driver raises RTS for the transmission and drops it as soon
+           as the last stop bit is out */
+        rs485conf.flags |= SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+        rs485conf.flags &= ~SER_RS485_RTS_AFTER_SEND;
+        rs485conf.delay_rts_before_send = 0;
+        rs485conf.delay_rts_after_send = 0;
+        ctx_rtu->tty_rs485 = ioctl(ctx->s, TIOCSRS485, &rs485conf) == 0;
+    }
+#endif
+#if HAVE_DECL_TIOCM_RTS
+    if (!ctx_rtu->tty_rs485) {
+        _modbus_rtu_ioctl_rts(ctx, FALSE);
+    }
+#endif
+
+    tcflush(ctx->s, TCIOFLUSH);
+
+    return 0;
+}
+
+static void _modbus_rtu_tty_close(modbus_t *ctx)
+{
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+
+    if (ctx->s == -1) {
+        return;
+    }
+
+#if HAVE_DECL_TIOCSRS485
+    if (ctx_rtu->tty_rs485) {
+        ioctl(ctx->s, TIOCSRS485, &ctx_rtu->old_rs485);
+    }
+#endif
+    tcsetattr(ctx->s, TCSANOW, &ctx_rtu->old_tios);
+    ioctl(ctx->s, TIOCNXCL);
+    close(ctx->s);
+    ctx->s = -1;
+}
+#endif
+
 /* Sets up a serial port for RTU communications */
 static int _modbus_rtu_connect(modbus_t *ctx)
 {
     modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
 
-    ctx_rtu->rs485->begin(ctx_rtu->baud, ctx_rtu->config);
-    ctx_rtu->rs485->receive();
+#if MODBUS_RTU_TTY
+    if (ctx_rtu->rs485 == NULL) {
+        _modbus_rtu_tty_close(ctx);
+        if (_modbus_rtu_tty_open(ctx) == -1) {
+            return -1;
+        }
+    } else
+#endif
+    {
+        ctx_rtu->rs485->begin(ctx_rtu->baud, ctx_rtu->config);
+        ctx_rtu->rs485->receive();
+    }
+    ctx_rtu->rx_length = 0;
+    ctx_rtu->rx_sync = TRUE;
+    ctx_rtu->rx_last_us = micros();
 
     return 0;
 }
@@ -346,6 +988,13 @@ static void _modbus_rtu_close(modbus_t *ctx)
     /* Restore line settings and close file descriptor in RTU mode */
     modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
 
+#if MODBUS_RTU_TTY
+    if (ctx_rtu->rs485 == NULL) {
+        _modbus_rtu_tty_close(ctx);
+        return;
+    }
+#endif
+
     ctx_rtu->rs485->noReceive();
     ctx_rtu->rs485->end();
 }
@@ -355,6 +1004,12 @@ static int _modbus_rtu_flush(modbus_t *ctx)
 
     modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
 
+    ctx_rtu->rx_length = 0;
+#if MODBUS_RTU_TTY
+    if (ctx_rtu->rs485 == NULL) {
+        return tcflush(ctx->s, TCIFLUSH);
+    }
+#endif
     while (ctx_rtu->rs485->available()) {
         ctx_rtu->rs485->read();
     }
@@ -362,24 +1017,75 @@ static int _modbus_rtu_flush(modbus_t *ctx)
     return 0;
 }
 
+/* Reads until the line has been silent for T3.5, so the frame being received
+   is over, or until tv has elapsed. Returns the number of bytes discarded. */
+static int _modbus_rtu_drain(modbus_t *ctx, const struct timeval *tv)
+{
+    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+    unsigned long max_us = (tv->tv_sec * 1000000UL) + tv->tv_usec;
+    unsigned long start = micros();
+    unsigned long last = start;
+    int nb = 0;
+
+    for (;;) {
+        unsigned long now;
+        unsigned long wait_us;
+        int available = _modbus_rtu_port_available(ctx);
+
+        if (available > 0) {
+            _modbus_rtu_port_skip(ctx, available);
+            nb += available;
+            last = micros();
+            continue;
+        }
+
+        now = micros();
+        if ((now - last) >= ctx_rtu->t35_us) {
+            ctx_rtu->rx_sync = TRUE;
+            break;
+        }
+        if ((now - start) >= max_us) {
+            break;
+        }
+
+        /* Until the silence is long enough or the time is up */
+        wait_us = ctx_rtu->t35_us - (now - last);
+        if (wait_us > max_us - (now - start)) {
+            wait_us = max_us - (now - start);
+        }
+        _modbus_rtu_port_wait(ctx, wait_us);
+    }
+
+    ctx_rtu->rx_length = 0;
+    ctx_rtu->rx_last_us = last;
+
+    return nb;
+}
+
 static int _modbus_rtu_select(modbus_t *ctx, fd_set *rset,
                               struct timeval *tv, int length_to_read)
 {
     int s_rc;
 
-    modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
-
     (void)rset;
 
     unsigned long wait_time_millis = (tv == NULL) ? 0 : (tv->tv_sec * 1000) + (tv->tv_usec / 1000);
     unsigned long start = millis();
 
     do {
-        s_rc = ctx_rtu->rs485->available();
+        unsigned long elapsed;
+
+        s_rc = _modbus_rtu_port_available(ctx);
 
         if (s_rc >= length_to_read) {
             break;
         }
+
+        /* A tty is waited on rather than polled */
+        elapsed = millis() - start;
+        if (elapsed < wait_time_millis) {
+            _modbus_rtu_port_wait(ctx, (wait_time_millis - elapsed) * 1000UL);
+        }
     } while ((millis() - start) < wait_time_millis);
 
     if (s_rc == 0) {
@@ -391,7 +1097,34 @@ static int _modbus_rtu_select(modbus_t *ctx, fd_set *rset,
     return s_rc;
 }
 
+#if MODBUS_RTU_STATIC_CONTEXTS > 0
+/* Contexts handed out by modbus_new_rtu before falling back to the heap, so a
+ * single server needs no dynamic allocation */
+static struct {
+    modbus_t ctx;
+    modbus_rtu_t ctx_rtu;
+    int used;
+} _modbus_rtu_static[MODBUS_RTU_STATIC_CONTEXTS];
+#endif
+
 static void _modbus_rtu_free(modbus_t *ctx) {
+#if MODBUS_RTU_STATIC_CONTEXTS > 0
+    int i;
+#endif
+
+    free(((modbus_rtu_t*)ctx->backend_data)->listener);
+#if MODBUS_RTU_TTY
+    free(((modbus_rtu_t*)ctx->backend_data)->device);
+#endif
+
+#if MODBUS_RTU_STATIC_CONTEXTS > 0
+    for (i = 0; i < MODBUS_RTU_STATIC_CONTEXTS; i++) {
+        if (ctx == &_modbus_rtu_static[i].ctx) {
+            _modbus_rtu_static[i].used = FALSE;
+            return;
+        }
+    }
+#endif
     free(ctx->backend_data);
     free(ctx);
 }
@@ -407,6 +1140,8 @@ const modbus_backend_t _modbus_rtu_backend = {
     _modbus_rtu_prepare_response_tid,
     _modbus_rtu_send_msg_pre,
     _modbus_rtu_send,
+    _modbus_rtu_send_frame,
+    _modbus_rtu_complete_frame,
     _modbus_rtu_receive,
     _modbus_rtu_recv,
     _modbus_rtu_check_integrity,
@@ -414,31 +1149,209 @@ const modbus_backend_t _modbus_rtu_backend = {
     _modbus_rtu_connect,
     _modbus_rtu_close,
     _modbus_rtu_flush,
+    _modbus_rtu_drain,
     _modbus_rtu_select,
     _modbus_rtu_free
 };
 
-modbus_t* modbus_new_rtu(RS485Class &rs485, unsigned long baud, uint16_t config)
+/* Allocates a context, from the static ones first, with the port left to
+   the caller */
+static modbus_t* _modbus_rtu_new(unsigned long baud)
 {
-    modbus_t *ctx;
-    modbus_rtu_t *ctx_rtu;
+    modbus_t *ctx = NULL;
+    modbus_rtu_t *ctx_rtu = NULL;
+
+#if MODBUS_RTU_STATIC_CONTEXTS > 0
+    int i;
+
+    for (i = 0; i < MODBUS_RTU_STATIC_CONTEXTS; i++) {
+        if (!_modbus_rtu_static[i].used) {
+            _modbus_rtu_static[i].used = TRUE;
+            ctx = &_modbus_rtu_static[i].ctx;
+            ctx_rtu = &_modbus_rtu_static[i].ctx_rtu;
+            break;
+        }
+    }
+#endif
+
+    if (ctx == NULL) {
+        ctx = (modbus_t *)malloc(sizeof(modbus_t));
+        ctx_rtu = (modbus_rtu_t *)malloc(sizeof(modbus_rtu_t));
+        if (ctx == NULL || ctx_rtu == NULL) {
+            free(ctx);
+            free(ctx_rtu);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
 
-    ctx = (modbus_t *)malloc(sizeof(modbus_t));
     _modbus_init_common(ctx);
     ctx->backend = &_modbus_rtu_backend;
-    ctx->backend_data = (modbus_rtu_t *)malloc(sizeof(modbus_rtu_t));
-    ctx_rtu = (modbus_rtu_t *)ctx->backend_data;
+    ctx->backend_data = ctx_rtu;
     ctx_rtu->baud = baud;
+    ctx_rtu->config = 0;
+    ctx_rtu->rs485 = NULL;
+#if MODBUS_RTU_TTY
+    ctx_rtu->device = NULL;
+    ctx_rtu->tty_rs485 = FALSE;
+#endif
+
+    /* 3.5 characters of 11 bits, fixed to 1750 us above 19200 bauds
+       (Modbus over serial line V1.02, 2.5.1.1) */
+    ctx_rtu->t35_us = (baud > 19200) ? 1750 : 38500000UL / baud;
+
+    ctx_rtu->confirmation_to_ignore = FALSE;
+    ctx_rtu->rx_length = 0;
+    ctx_rtu->rx_sync = TRUE;
+    ctx_rtu->rx_last_us = 0;
+    ctx_rtu->listener = NULL;
+
+    return ctx;
+}
+
+modbus_t* modbus_new_rtu(RS485Class &rs485, unsigned long baud, uint16_t config)
+{
+    modbus_t *ctx = _modbus_rtu_new(baud);
+    modbus_rtu_t *ctx_rtu;
+
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
     ctx_rtu->config = config;
     ctx_rtu->rs485 = &rs485;
 
-    ctx_rtu->confirmation_to_ignore = FALSE;
+    return ctx;
+}
+
+#if MODBUS_RTU_TTY
+/* Creates a context on the tty at device (e.g. "/dev/ttyUSB0"), opened by
+   modbus_connect(). parity is 'N', 'E' or 'O', data_bit 5 to 8 and stop_bit
+   1 or 2. Where the serial driver supports it (TIOCSRS485), the kernel
+   switches the RS-485 transceiver around each transmission, RTS is raised
+   for the transmissions otherwise. The tty is held exclusively (TIOCEXCL)
+   while connected, and frames from a USB adapter end after a silence of
+   MODBUS_RTU_TTY_FRAME_GAP_US at least. */
+modbus_t* modbus_new_rtu_tty(const char *device, unsigned long baud, char parity,
+                             int data_bit, int stop_bit)
+{
+    modbus_t *ctx;
+    modbus_rtu_t *ctx_rtu;
+
+    if (device == NULL || *device == 0 || baud == 0 ||
+        (parity != 'N' && parity != 'E' && parity != 'O') ||
+        data_bit < 5 || data_bit > 8 || stop_bit < 1 || stop_bit > 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = _modbus_rtu_new(baud);
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+    ctx_rtu->device = strdup(device);
+    if (ctx_rtu->device == NULL) {
+        modbus_free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+    ctx_rtu->parity = parity;
+    ctx_rtu->data_bit = data_bit;
+    ctx_rtu->stop_bit = stop_bit;
 
     return ctx;
 }
+#endif
+
+/* Waits until bytes are received or timeout_us has elapsed. Returns the
+   number of bytes that can be read, 0 on timeout, -1 with errno set on
+   error. A tty is waited on with select(), an RS485Class is polled. While a
+   frame is partly received, the wait ends with 0 at the silence that drops
+   it. */
+int modbus_rtu_wait(modbus_t *ctx, unsigned long timeout_us)
+{
+    modbus_rtu_t *ctx_rtu;
+    unsigned long start;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+    start = micros();
+    for (;;) {
+        int available = _modbus_rtu_port_available(ctx);
+        unsigned long now;
+        unsigned long wait_us;
+
+        if (available > 0) {
+            return available;
+        }
+        now = micros();
+        if ((now - start) >= timeout_us) {
+            return 0;
+        }
+        wait_us = timeout_us - (now - start);
+
+        /* The silence ending a frame partly received, or a damaged one, is
+           noticed by the next modbus_receive() */
+        if (ctx_rtu->rx_length > 0 || !ctx_rtu->rx_sync) {
+            if ((now - ctx_rtu->rx_last_us) >= ctx_rtu->t35_us) {
+                return 0;
+            }
+            if (wait_us > ctx_rtu->t35_us - (now - ctx_rtu->rx_last_us)) {
+                wait_us = ctx_rtu->t35_us - (now - ctx_rtu->rx_last_us);
+            }
+        }
+        _modbus_rtu_port_wait(ctx, wait_us);
+    }
+}
+
+/* Decodes the traffic between other devices instead of answering requests,
+   cb NULL to leave the mode. modbus_receive() then hands each transaction to
+   cb and always returns 0. */
+int modbus_rtu_set_listen_only(modbus_t *ctx, modbus_transaction_callback_t cb, void *data)
+{
+    modbus_rtu_t *ctx_rtu;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+    if (cb == NULL) {
+        free(ctx_rtu->listener);
+        ctx_rtu->listener = NULL;
+    } else {
+        if (ctx_rtu->listener == NULL) {
+            ctx_rtu->listener = (_modbus_rtu_listener_t *)malloc(sizeof(_modbus_rtu_listener_t));
+            if (ctx_rtu->listener == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        ctx_rtu->listener->cb = cb;
+        ctx_rtu->listener->data = data;
+        ctx_rtu->listener->req_length = 0;
+    }
+
+    /* Either way, start with the next frame */
+    ctx_rtu->rx_length = 0;
+    ctx_rtu->rx_sync = FALSE;
+    ctx_rtu->confirmation_to_ignore = FALSE;
+
+    return 0;
+}
 
 void modbus_set_rs485_pins(modbus_t *ctx, int tx_pin, int de_pin, int re_pin)
 {
   modbus_rtu_t *ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
-  ctx_rtu->rs485->setPins(tx_pin, de_pin, re_pin);
+  if (ctx_rtu->rs485 != NULL) {
+    ctx_rtu->rs485->setPins(tx_pin, de_pin, re_pin);
+  }
 }
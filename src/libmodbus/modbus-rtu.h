@@ -20,7 +20,42 @@ MODBUS_BEGIN_DECLS
  */
 #define MODBUS_RTU_MAX_ADU_LENGTH  256
 
+/* Serial ports opened by device path with modbus_new_rtu_tty(), available on
+ * Linux where the port is a tty driven through termios */
+#ifndef MODBUS_RTU_TTY
+#  if defined(__linux__)
+#    define MODBUS_RTU_TTY 1
+#  else
+#    define MODBUS_RTU_TTY 0
+#  endif
+#endif
+
+/* Shortest silence ending a frame received from a USB serial adapter's tty
+ * (found through sysfs when connecting), in microseconds. The adapters pass
+ * the bytes on in bursts up to their latency timer apart (16 ms by default on
+ * FTDI chips), which must not split a frame. The price is that each request
+ * is answered that much later and that frames closer together are merged.
+ * Lower it with the latency timer of the adapter (latency_timer in
+ * /sys/bus/usb-serial/devices/<tty>/), 0 keeps T3.5. Other ttys use T3.5. */
+#ifndef MODBUS_RTU_TTY_FRAME_GAP_US
+#define MODBUS_RTU_TTY_FRAME_GAP_US 20000UL
+#endif
+
+/* Called for each transaction seen in listen only mode with the request and
+ * its response, both without their CRC. rsp is NULL and rsp_length 0 for
+ * broadcasts and for requests left unanswered. */
+typedef void (*modbus_transaction_callback_t)(void *data, const uint8_t *req, int req_length,
+                                              const uint8_t *rsp, int rsp_length);
+
 MODBUS_API modbus_t* modbus_new_rtu(RS485Class &rs485, unsigned long baud, uint16_t config);
+#if MODBUS_RTU_TTY
+MODBUS_API modbus_t* modbus_new_rtu_tty(const char *device, unsigned long baud, char parity,
+                                        int data_bit, int stop_bit);
+#endif
+
+MODBUS_API int modbus_rtu_wait(modbus_t *ctx, unsigned long timeout_us);
+
+MODBUS_API int modbus_rtu_set_listen_only(modbus_t *ctx, modbus_transaction_callback_t cb, void *data);
 
 MODBUS_API void modbus_set_rs485_pins(modbus_t *ctx, int tx_pin, int de_pin, int re_pin);
 
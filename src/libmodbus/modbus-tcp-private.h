@@ -0,0 +1,85 @@
+/*
+ * Copyright © 2001-2011 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ * Copyright © 2022 Darryl Noakes <darryl.noakes@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#ifndef MODBUS_TCP_PRIVATE_H
+#define MODBUS_TCP_PRIVATE_H
+
+#define _MODBUS_TCP_HEADER_LENGTH      7
+#define _MODBUS_TCP_PRESET_REQ_LENGTH 12
+#define _MODBUS_TCP_PRESET_RSP_LENGTH  8
+
+#define _MODBUS_TCP_CHECKSUM_LENGTH    0
+
+/* Events handled by each epoll_wait() of modbus_tcp_poll() */
+#define _MODBUS_TCP_EVENTS            32
+
+/* Size of the receive and send buffers of a connection, room for a few
+ * dozen pipelined requests */
+#define _MODBUS_TCP_BUFFER_LENGTH     (4 * MODBUS_TCP_MAX_ADU_LENGTH)
+
+/* Client connected to a server, with the bytes received of the requests not
+ * answered yet and the responses not sent yet */
+typedef struct {
+    int s;
+    /* Unique to the connection, unlike the socket which is reused */
+    unsigned long id;
+    /* Position in modbus_tcp_t.connections */
+    int index;
+    int length;
+    int out_length;
+    /* Requests taken by the handler and not answered yet, room is kept in
+     * out for their responses */
+    int pending;
+    /* TRUE while complete requests wait in buf for room in out */
+    int held;
+    /* Events epoll waits for: EPOLLOUT while responses wait for room in the
+     * socket buffer, EPOLLIN while nothing is waiting */
+    uint32_t events;
+    uint8_t buf[_MODBUS_TCP_BUFFER_LENGTH];
+    uint8_t out[_MODBUS_TCP_BUFFER_LENGTH];
+} _modbus_tcp_connection_t;
+
+typedef struct _modbus_tcp {
+    /* Extract from MODBUS Messaging on TCP/IP Implementation Guide V1.0b
+       (page 23/46):
+       The transaction identifier is used to associate the future response
+       with the request. This identifier is unique on each TCP connection. */
+    uint16_t t_id;
+    /* TCP port */
+    int port;
+    /* IP address, empty for any */
+    char ip[16];
+    /* Socket of modbus_tcp_listen(), -1 before */
+    int s_listen;
+    /* epoll instance of modbus_tcp_poll(), -1 before its first call */
+    int efd;
+    /* Clients accepted by modbus_tcp_poll(), up to max_connections */
+    _modbus_tcp_connection_t **connections;
+    int nb_connections;
+    int max_connections;
+    /* Identifier of the next connection accepted */
+    unsigned long next_id;
+    /* Connection whose responses are gathered in its send buffer, NULL to
+       send them at once */
+    _modbus_tcp_connection_t *batch;
+} modbus_tcp_t;
+
+/* Called by _modbus_tcp_poll() for each complete request of conn, with the
+ * socket of the context set to the one of conn. Returns the number of
+ * requests answered, or -1 with errno set if the connection must be closed.
+ * A request left for later (0) counts in conn->pending, which keeps room for
+ * its response, until the caller answers it and decrements it. */
+typedef int (*_modbus_tcp_handler_t)(modbus_t *ctx, const _modbus_tcp_connection_t *conn,
+                                     const uint8_t *req, int req_length, void *arg);
+
+int _modbus_tcp_poll(modbus_t *ctx, _modbus_tcp_handler_t handler, void *arg, int timeout_ms);
+_modbus_tcp_connection_t *_modbus_tcp_find_connection(modbus_t *ctx, unsigned long id);
+void _modbus_tcp_batch(modbus_t *ctx, _modbus_tcp_connection_t *conn);
+int _modbus_tcp_send_batch(modbus_t *ctx);
+void _modbus_tcp_close_connection(modbus_t *ctx, _modbus_tcp_connection_t *conn);
+
+#endif /* MODBUS_TCP_PRIVATE_H */
@@ -0,0 +1,1021 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ * Copyright © 2022 Darryl Noakes <darryl.noakes@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* For accept4() */
+#define _GNU_SOURCE
+#endif
+
+#include "modbus-tcp.h"
+
+#if MODBUS_TCP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef DEBUG
+#define printf(...) {}
+#define fprintf(...) {}
+#endif
+
+#include "modbus-private.h"
+
+#include "modbus-tcp-private.h"
+
+static int _modbus_set_slave(modbus_t *ctx, int slave)
+{
+    /* Broadcast address is 0 (MODBUS_BROADCAST_ADDRESS) */
+    if (slave >= 0 && slave <= 247) {
+        ctx->slave = slave;
+    } else if (slave == MODBUS_TCP_SLAVE) {
+        /* The special value MODBUS_TCP_SLAVE (0xFF) can be used in TCP mode to
+         * restore the default value. */
+        ctx->slave = slave;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Builds a TCP request header */
+static int _modbus_tcp_build_request_basis(modbus_t *ctx, int function,
+                                           int addr, int nb,
+                                           uint8_t *req)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+
+    /* Increase transaction ID */
+    if (ctx_tcp->t_id < UINT16_MAX)
+        ctx_tcp->t_id++;
+    else
+        ctx_tcp->t_id = 0;
+    req[0] = ctx_tcp->t_id >> 8;
+    req[1] = ctx_tcp->t_id & 0x00ff;
+
+    /* Protocol Modbus */
+    req[2] = 0;
+    req[3] = 0;
+
+    /* Length will be defined later by set_req_length_tcp at offsets 4
+       and 5 */
+
+    req[6] = ctx->slave;
+    req[7] = function;
+    req[8] = addr >> 8;
+    req[9] = addr & 0x00ff;
+    req[10] = nb >> 8;
+    req[11] = nb & 0x00ff;
+
+    return _MODBUS_TCP_PRESET_REQ_LENGTH;
+}
+
+/* Builds a TCP response header */
+static int _modbus_tcp_build_response_basis(sft_t *sft, uint8_t *rsp)
+{
+    /* Extract from MODBUS Messaging on TCP/IP Implementation
+       Guide V1.0b (page 23/46):
+       The transaction identifier is used to associate the future
+       response with the request. */
+    rsp[0] = sft->t_id >> 8;
+    rsp[1] = sft->t_id & 0x00ff;
+
+    /* Protocol Modbus */
+    rsp[2] = 0;
+    rsp[3] = 0;
+
+    /* Length will be set later by send_msg (4 and 5) */
+
+    /* The slave ID is copied from the indication */
+    rsp[6] = sft->slave;
+    rsp[7] = sft->function;
+
+    return _MODBUS_TCP_PRESET_RSP_LENGTH;
+}
+
+static int _modbus_tcp_prepare_response_tid(const uint8_t *req, int *req_length)
+{
+    (void)req_length;
+
+    return (req[0] << 8) + req[1];
+}
+
+static int _modbus_tcp_send_msg_pre(uint8_t *req, int req_length)
+{
+    /* Substract the header length to the message length */
+    int mbap_length = req_length - 6;
+
+    req[4] = mbap_length >> 8;
+    req[5] = mbap_length & 0x00FF;
+
+    return req_length;
+}
+
+/* Sends the iovcnt buffers of iov as one segment when they fit, on the
+   blocking socket of a client. Returns the number of bytes sent, or -1 with
+   errno set. */
+static ssize_t _modbus_tcp_write(modbus_t *ctx, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    ssize_t size = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (msg.msg_iovlen > 0) {
+        /* MSG_NOSIGNAL: a server gone doesn't raise SIGPIPE */
+        ssize_t rc = sendmsg(ctx->s, &msg, MSG_NOSIGNAL);
+
+        if (rc == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        size += rc;
+        /* Skip what was sent of a partial send */
+        while (msg.msg_iovlen > 0 && (size_t)rc >= msg.msg_iov->iov_len) {
+            rc -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + rc;
+            msg.msg_iov->iov_len -= rc;
+        }
+    }
+
+    return size;
+}
+
+/* Has epoll wait for room in the socket buffer of conn while responses are
+   left, for nothing while requests wait for the responses pending, and for
+   requests otherwise: a client is only read once it has taken what it was
+   sent. Returns 0, or -1 with errno set. */
+static int _modbus_tcp_watch(modbus_t *ctx, _modbus_tcp_connection_t *conn)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+    struct epoll_event ev;
+
+    if (conn->out_length > 0) {
+        ev.events = EPOLLOUT;
+    } else if (conn->held) {
+        ev.events = 0;
+    } else {
+        ev.events = EPOLLIN;
+    }
+    if (ev.events == conn->events) {
+        return 0;
+    }
+
+    ev.data.ptr = conn;
+    if (epoll_ctl(ctx_tcp->efd, EPOLL_CTL_MOD, conn->s, &ev) == -1) {
+        return -1;
+    }
+    conn->events = ev.events;
+
+    return 0;
+}
+
+/* Sends what the socket buffer takes of the responses of conn without
+   waiting: the rest stays in its send buffer and goes out when epoll reports
+   room (EPOLLOUT), so a client not reading its responses holds up nobody.
+   Returns 0, or -1 with errno set if the connection must be closed. */
+static int _modbus_tcp_send_out(modbus_t *ctx, _modbus_tcp_connection_t *conn)
+{
+    while (conn->out_length > 0) {
+        /* MSG_NOSIGNAL: a client gone doesn't raise SIGPIPE */
+        ssize_t rc = send(conn->s, conn->out, conn->out_length, MSG_NOSIGNAL);
+
+        if (rc == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            break;
+        }
+
+        conn->out_length -= rc;
+        memmove(conn->out, conn->out + rc, conn->out_length);
+    }
+
+    return _modbus_tcp_watch(ctx, conn);
+}
+
+/* TRUE if the send buffer of conn has room for the response to one more
+   request, besides the room kept for the responses pending */
+static int _modbus_tcp_has_room(const _modbus_tcp_connection_t *conn)
+{
+    return (int)sizeof(conn->out) - conn->out_length >=
+           (conn->pending + 1) * MODBUS_TCP_MAX_ADU_LENGTH;
+}
+
+/* Gathers the frames sent through the context in the send buffer of conn,
+   until _modbus_tcp_send_batch() */
+void _modbus_tcp_batch(modbus_t *ctx, _modbus_tcp_connection_t *conn)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+
+    ctx->s = conn->s;
+    ctx_tcp->batch = conn;
+}
+
+/* Sends the responses gathered since _modbus_tcp_batch(), as far as the
+   socket takes them. Returns 0, or -1 with errno set if the connection must
+   be closed. */
+int _modbus_tcp_send_batch(modbus_t *ctx)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+    _modbus_tcp_connection_t *conn = ctx_tcp->batch;
+
+    ctx_tcp->batch = NULL;
+    ctx->s = -1;
+
+    return _modbus_tcp_send_out(ctx, conn);
+}
+
+/* Sends a frame, or appends it to the responses of the connection being
+   served, which go out together once its pipelined requests are answered */
+static ssize_t _modbus_tcp_sendv(modbus_t *ctx, struct iovec *iov, int iovcnt)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+    _modbus_tcp_connection_t *conn = ctx_tcp->batch;
+    size_t length = 0;
+    int i;
+
+    if (conn == NULL) {
+        return _modbus_tcp_write(ctx, iov, iovcnt);
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        length += iov[i].iov_len;
+    }
+
+    if (conn->out_length + length > sizeof(conn->out)) {
+        if (_modbus_tcp_send_out(ctx, conn) == -1) {
+            return -1;
+        }
+        if (conn->out_length + length > sizeof(conn->out)) {
+            /* Not for a response, whose room is checked before reading its
+               request */
+            errno = ENOBUFS;
+            return -1;
+        }
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(conn->out + conn->out_length, iov[i].iov_base, iov[i].iov_len);
+        conn->out_length += iov[i].iov_len;
+    }
+
+    return length;
+}
+
+/* The MBAP header is built in front of the PDU, the frame goes out in one
+   send */
+static ssize_t _modbus_tcp_send(modbus_t *ctx, uint8_t *req, int req_length)
+{
+    struct iovec iov;
+
+    iov.iov_base = req;
+    iov.iov_len = req_length;
+
+    return _modbus_tcp_sendv(ctx, &iov, 1);
+}
+
+/* A frame kept from a previous response is sent with the transaction
+   identifier of req gathered in front of it, instead of being copied to
+   patch its header */
+static ssize_t _modbus_tcp_send_frame(modbus_t *ctx, const uint8_t *req,
+                                      const uint8_t *msg, int msg_length)
+{
+    struct iovec iov[2];
+
+    iov[0].iov_base = (void *)req;
+    iov[0].iov_len = 2;
+    iov[1].iov_base = (void *)(msg + 2);
+    iov[1].iov_len = msg_length - 2;
+
+    return _modbus_tcp_sendv(ctx, iov, 2);
+}
+
+static int _modbus_tcp_receive(modbus_t *ctx, uint8_t *req)
+{
+    return _modbus_receive_msg(ctx, req, MSG_INDICATION);
+}
+
+static ssize_t _modbus_tcp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    return recv(ctx->s, (char *)rsp, rsp_length, 0);
+}
+
+static int _modbus_tcp_check_integrity(modbus_t *ctx, uint8_t *msg, const int msg_length)
+{
+    (void)ctx;
+    (void)msg;
+
+    return msg_length;
+}
+
+static int _modbus_tcp_pre_check_confirmation(modbus_t *ctx, const uint8_t *req,
+                                              const uint8_t *rsp, int rsp_length)
+{
+    (void)rsp_length;
+
+    /* Check transaction ID */
+    if (req[0] != rsp[0] || req[1] != rsp[1]) {
+        if (ctx->debug) {
+            fprintf(stderr, "Invalid transaction ID received 0x%X (not 0x%X)\n",
+                    (rsp[0] << 8) + rsp[1], (req[0] << 8) + req[1]);
+        }
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    /* Check protocol ID */
+    if (rsp[2] != 0x0 && rsp[3] != 0x0) {
+        if (ctx->debug) {
+            fprintf(stderr, "Invalid protocol ID received 0x%X (not 0x0)\n",
+                    (rsp[2] << 8) + rsp[3]);
+        }
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _modbus_tcp_set_ipv4_options(int s)
+{
+    int option;
+
+    /* Set the TCP no delay flag */
+    /* SOL_TCP = IPPROTO_TCP */
+    option = 1;
+    return setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const void *)&option, sizeof(int));
+}
+
+/* Fills addr with the address and port of the context */
+static int _modbus_tcp_address(modbus_tcp_t *ctx_tcp, struct sockaddr_in *addr)
+{
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(ctx_tcp->port);
+    if (ctx_tcp->ip[0] == 0) {
+        addr->sin_addr.s_addr = htonl(INADDR_ANY);
+    } else if (inet_pton(AF_INET, ctx_tcp->ip, &addr->sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Establishes a modbus TCP connection with a Modbus server. */
+static int _modbus_tcp_connect(modbus_t *ctx)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+    struct sockaddr_in addr;
+
+    if (_modbus_tcp_address(ctx_tcp, &addr) == -1) {
+        return -1;
+    }
+
+    ctx->s = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ctx->s == -1) {
+        return -1;
+    }
+
+    if (_modbus_tcp_set_ipv4_options(ctx->s) == -1 ||
+        connect(ctx->s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(ctx->s);
+        ctx->s = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Closes the connection of a client, its responses not sent yet are lost */
+void _modbus_tcp_close_connection(modbus_t *ctx, _modbus_tcp_connection_t *conn)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+    _modbus_tcp_connection_t *last;
+
+    /* A later connection may get the same socket, not the retries of this one */
+    if (ctx->retry != NULL && ctx->retry->s == conn->s) {
+        ctx->retry->rsp_length = 0;
+    }
+
+    /* Closing the socket takes it out of the epoll set */
+    close(conn->s);
+
+    last = ctx_tcp->connections[--ctx_tcp->nb_connections];
+    last->index = conn->index;
+    ctx_tcp->connections[conn->index] = last;
+    free(conn);
+}
+
+/* Closes the connection, and the clients and listening socket of a server */
+static void _modbus_tcp_close(modbus_t *ctx)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+
+    while (ctx_tcp->nb_connections > 0) {
+        _modbus_tcp_close_connection(ctx, ctx_tcp->connections[0]);
+    }
+
+    if (ctx_tcp->efd != -1) {
+        close(ctx_tcp->efd);
+        ctx_tcp->efd = -1;
+    }
+
+    if (ctx_tcp->s_listen != -1) {
+        close(ctx_tcp->s_listen);
+        ctx_tcp->s_listen = -1;
+    }
+
+    if (ctx->s != -1) {
+        shutdown(ctx->s, SHUT_RDWR);
+        close(ctx->s);
+        ctx->s = -1;
+    }
+}
+
+static int _modbus_tcp_flush(modbus_t *ctx)
+{
+    int rc;
+    int rc_sum = 0;
+
+    do {
+        /* Extract the garbage from the socket */
+        char devnull[MODBUS_TCP_MAX_ADU_LENGTH];
+
+        rc = recv(ctx->s, devnull, MODBUS_TCP_MAX_ADU_LENGTH, MSG_DONTWAIT);
+        if (rc > 0) {
+            rc_sum += rc;
+        }
+    } while (rc == MODBUS_TCP_MAX_ADU_LENGTH);
+
+    return rc_sum;
+}
+
+/* The MBAP header gives the length of every frame, a malformed request
+   leaves nothing to discard */
+static int _modbus_tcp_drain(modbus_t *ctx, const struct timeval *tv)
+{
+    (void)ctx;
+    (void)tv;
+
+    return 0;
+}
+
+static int _modbus_tcp_select(modbus_t *ctx, fd_set *rset,
+                              struct timeval *tv, int length_to_read)
+{
+    int s_rc;
+
+    (void)length_to_read;
+
+    FD_ZERO(rset);
+    FD_SET(ctx->s, rset);
+    while ((s_rc = select(ctx->s + 1, rset, NULL, NULL, tv)) == -1) {
+        if (errno == EINTR) {
+            if (ctx->debug) {
+                fprintf(stderr, "A non blocked signal was caught\n");
+            }
+            /* Necessary after an error */
+            FD_ZERO(rset);
+            FD_SET(ctx->s, rset);
+        } else {
+            return -1;
+        }
+    }
+
+    if (s_rc == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    return s_rc;
+}
+
+static void _modbus_tcp_free(modbus_t *ctx)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+
+    /* The sockets belong to the context */
+    _modbus_tcp_close(ctx);
+    free(ctx_tcp->connections);
+    free(ctx->backend_data);
+    free(ctx);
+}
+
+const modbus_backend_t _modbus_tcp_backend = {
+    _MODBUS_BACKEND_TYPE_TCP,
+    _MODBUS_TCP_HEADER_LENGTH,
+    _MODBUS_TCP_CHECKSUM_LENGTH,
+    MODBUS_TCP_MAX_ADU_LENGTH,
+    _modbus_set_slave,
+    _modbus_tcp_build_request_basis,
+    _modbus_tcp_build_response_basis,
+    _modbus_tcp_prepare_response_tid,
+    _modbus_tcp_send_msg_pre,
+    _modbus_tcp_send,
+    _modbus_tcp_send_frame,
+    NULL,
+    _modbus_tcp_receive,
+    _modbus_tcp_recv,
+    _modbus_tcp_check_integrity,
+    _modbus_tcp_pre_check_confirmation,
+    _modbus_tcp_connect,
+    _modbus_tcp_close,
+    _modbus_tcp_flush,
+    _modbus_tcp_drain,
+    _modbus_tcp_select,
+    _modbus_tcp_free
+};
+
+/* Creates a context for a client connecting to ip_address (dotted IPv4) and
+   port, or for a server listening there, ip_address NULL for any */
+modbus_t* modbus_new_tcp(const char *ip_address, int port)
+{
+    modbus_t *ctx;
+    modbus_tcp_t *ctx_tcp;
+
+    if (port < 0 || port > 0xFFFF ||
+        (ip_address != NULL && strlen(ip_address) >= sizeof(ctx_tcp->ip))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = (modbus_t *)malloc(sizeof(modbus_t));
+    if (ctx == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    _modbus_init_common(ctx);
+
+    /* Could be changed after to reach a remote serial Modbus device */
+    ctx->slave = MODBUS_TCP_SLAVE;
+
+    ctx->backend = &_modbus_tcp_backend;
+
+    ctx->backend_data = (modbus_tcp_t *)malloc(sizeof(modbus_tcp_t));
+    if (ctx->backend_data == NULL) {
+        free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+    ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+
+    ctx_tcp->ip[0] = 0;
+    if (ip_address != NULL) {
+        strcpy(ctx_tcp->ip, ip_address);
+    }
+    ctx_tcp->port = port;
+    ctx_tcp->t_id = 0;
+    ctx_tcp->s_listen = -1;
+    ctx_tcp->efd = -1;
+    ctx_tcp->connections = NULL;
+    ctx_tcp->nb_connections = 0;
+    ctx_tcp->max_connections = 0;
+    ctx_tcp->next_id = 0;
+    ctx_tcp->batch = NULL;
+
+    return ctx;
+}
+
+/* Listens on the address and port of the context for up to nb_connection
+   clients at once, served by modbus_tcp_poll(). Returns the listening
+   socket, or -1 with errno set. */
+int modbus_tcp_listen(modbus_t *ctx, int nb_connection)
+{
+    modbus_tcp_t *ctx_tcp;
+    _modbus_tcp_connection_t **connections;
+    struct sockaddr_in addr;
+    int enable;
+    int new_s;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP ||
+        nb_connection < 1 || nb_connection > MODBUS_TCP_MAX_CONNECTIONS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+    if (_modbus_tcp_address(ctx_tcp, &addr) == -1) {
+        return -1;
+    }
+
+    connections = (_modbus_tcp_connection_t **)calloc(
+        nb_connection, sizeof(_modbus_tcp_connection_t *));
+    if (connections == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Non blocking, the accepts are driven by epoll */
+    new_s = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (new_s == -1) {
+        free(connections);
+        return -1;
+    }
+
+    enable = 1;
+    if (setsockopt(new_s, SOL_SOCKET, SO_REUSEADDR, (char *)&enable, sizeof(enable)) == -1 ||
+        bind(new_s, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(new_s, nb_connection) == -1) {
+        close(new_s);
+        free(connections);
+        return -1;
+    }
+
+    /* Starts again without any client */
+    _modbus_tcp_close(ctx);
+    free(ctx_tcp->connections);
+    ctx_tcp->connections = connections;
+    ctx_tcp->max_connections = nb_connection;
+    ctx_tcp->s_listen = new_s;
+
+    return new_s;
+}
+
+/* Waits for a client on the listening socket s, whose connection becomes the
+   socket of the context for modbus_receive() and modbus_reply() */
+int modbus_tcp_accept(modbus_t *ctx, int *s)
+{
+    struct pollfd pfd;
+
+    if (ctx == NULL || s == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pfd.fd = *s;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, -1) == -1) {
+        return -1;
+    }
+
+    ctx->s = accept4(*s, NULL, NULL, SOCK_CLOEXEC);
+    if (ctx->s == -1) {
+        return -1;
+    }
+
+    if (ctx->debug) {
+        printf("The client connection is accepted\n");
+    }
+
+    return ctx->s;
+}
+
+/* Accepts the clients waiting, those over the limit are closed at once */
+static void _modbus_tcp_accept_connections(modbus_t *ctx)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+
+    for (;;) {
+        _modbus_tcp_connection_t *conn;
+        struct epoll_event ev;
+        int s = accept4(ctx_tcp->s_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (s == -1) {
+            /* EAGAIN once they are all accepted */
+            return;
+        }
+
+        if (ctx_tcp->nb_connections == ctx_tcp->max_connections) {
+            if (ctx->debug) {
+                fprintf(stderr, "Connection refused, %d clients already\n",
+                        ctx_tcp->nb_connections);
+            }
+            close(s);
+            continue;
+        }
+
+        conn = (_modbus_tcp_connection_t *)malloc(sizeof(_modbus_tcp_connection_t));
+        if (conn == NULL) {
+            close(s);
+            continue;
+        }
+        conn->s = s;
+        conn->id = ctx_tcp->next_id++;
+        conn->length = 0;
+        conn->out_length = 0;
+        conn->pending = 0;
+        conn->held = FALSE;
+        conn->events = EPOLLIN;
+
+        _modbus_tcp_set_ipv4_options(s);
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(ctx_tcp->efd, EPOLL_CTL_ADD, s, &ev) == -1) {
+            close(s);
+            free(conn);
+            continue;
+        }
+
+        conn->index = ctx_tcp->nb_connections++;
+        ctx_tcp->connections[conn->index] = conn;
+    }
+}
+
+/* Returns the length of the request at the start of msg, 0 while it isn't
+   all received, or -1 if msg doesn't start with a valid request */
+static int _modbus_tcp_request_length(modbus_t *ctx, uint8_t *msg, int length)
+{
+    int adu_length;
+    int expected;
+
+    if (length < _MODBUS_TCP_HEADER_LENGTH + 1) {
+        return 0;
+    }
+
+    /* Protocol identifier 0 and room for the unit and function at least */
+    adu_length = 6 + ((msg[4] << 8) | msg[5]);
+    if (msg[2] != 0 || msg[3] != 0 || adu_length < _MODBUS_TCP_HEADER_LENGTH + 1 ||
+        adu_length > MODBUS_TCP_MAX_ADU_LENGTH) {
+        return -1;
+    }
+
+    if (length < adu_length) {
+        return 0;
+    }
+
+    /* The counts of the request, trusted by the handlers, must stay within
+       the length announced by the header */
+    expected = _MODBUS_TCP_HEADER_LENGTH + 1 + _modbus_compute_meta_length_after_function(
+        ctx, msg[_MODBUS_TCP_HEADER_LENGTH], MSG_INDICATION);
+    if (expected <= adu_length) {
+        expected += _modbus_compute_data_length_after_meta(ctx, msg, MSG_INDICATION);
+    }
+
+    return (expected <= adu_length) ? adu_length : -1;
+}
+
+/* Answers the complete requests received from the client, all those
+   received at once when it pipelines them: their responses, each with the
+   transaction identifier of its request, are gathered and sent together.
+   Once the send buffer has no room for one more response, the requests left
+   are held in the receive buffer and the client isn't read until the
+   responses are sent. Returns the number of requests answered, or -1 if the
+   connection must be closed. */
+static int _modbus_tcp_serve_requests(modbus_t *ctx, _modbus_tcp_connection_t *conn,
+                                      _modbus_tcp_handler_t handler, void *arg)
+{
+    int offset = 0;
+    int nb = 0;
+
+    conn->held = FALSE;
+    _modbus_tcp_batch(ctx, conn);
+    for (;;) {
+        int rc;
+        int adu_length = _modbus_tcp_request_length(ctx, conn->buf + offset, conn->length - offset);
+
+        if (adu_length == -1) {
+            if (ctx->debug) {
+                fprintf(stderr, "Invalid request, connection closed\n");
+            }
+            nb = -1;
+            break;
+        }
+        if (adu_length == 0) {
+            break;
+        }
+
+        if (!_modbus_tcp_has_room(conn)) {
+            /* What the socket takes of the responses makes room */
+            if (_modbus_tcp_send_out(ctx, conn) == -1) {
+                nb = -1;
+                break;
+            }
+            if (!_modbus_tcp_has_room(conn)) {
+                conn->held = TRUE;
+                break;
+            }
+        }
+
+        rc = handler(ctx, conn, conn->buf + offset, adu_length, arg);
+        if (rc == -1) {
+            nb = -1;
+            break;
+        }
+        if (rc == 0) {
+            conn->pending++;
+        }
+        nb += rc;
+
+        offset += adu_length;
+    }
+
+    /* The responses to the requests before an invalid one are sent too */
+    if (_modbus_tcp_send_batch(ctx) == -1) {
+        nb = -1;
+    }
+
+    /* The start of a request still to come is kept */
+    conn->length -= offset;
+    memmove(conn->buf, conn->buf + offset, conn->length);
+
+    return nb;
+}
+
+/* Reads what the client sent and answers its complete requests. Returns the
+   number of requests answered, or -1 if the connection must be closed. */
+static int _modbus_tcp_serve_connection(modbus_t *ctx, _modbus_tcp_connection_t *conn,
+                                        _modbus_tcp_handler_t handler, void *arg)
+{
+    ssize_t rc;
+
+    rc = recv(conn->s, conn->buf + conn->length, sizeof(conn->buf) - conn->length, 0);
+    if (rc == 0) {
+        /* Closed by the client */
+        return -1;
+    }
+    if (rc == -1) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    conn->length += rc;
+
+    return _modbus_tcp_serve_requests(ctx, conn, handler, arg);
+}
+
+/* Answers the requests held for room in the send buffer, which the responses
+   sent since have made. Returns the number of requests answered. */
+static int _modbus_tcp_serve_held(modbus_t *ctx, _modbus_tcp_handler_t handler, void *arg)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+    int nb = 0;
+    int i;
+
+    /* Backwards, a connection closed is replaced by the last one */
+    for (i = ctx_tcp->nb_connections - 1; i >= 0; i--) {
+        _modbus_tcp_connection_t *conn = ctx_tcp->connections[i];
+        int rc;
+
+        if (!conn->held || !_modbus_tcp_has_room(conn)) {
+            continue;
+        }
+
+        rc = _modbus_tcp_serve_requests(ctx, conn, handler, arg);
+        if (rc == -1) {
+            _modbus_tcp_close_connection(ctx, conn);
+        } else {
+            nb += rc;
+        }
+    }
+
+    return nb;
+}
+
+/* Waits up to timeout_ms (-1 for ever) for clients and requests on the socket
+   of modbus_tcp_listen(), accepts the clients and passes every complete
+   request to handler. A single thread serves all the clients, each with its
+   own receive buffer; the responses to the requests a client pipelines go
+   out in one send. Returns the number of requests answered, or -1 with
+   errno set. */
+int _modbus_tcp_poll(modbus_t *ctx, _modbus_tcp_handler_t handler, void *arg, int timeout_ms)
+{
+    modbus_tcp_t *ctx_tcp;
+    struct epoll_event events[_MODBUS_TCP_EVENTS];
+    int nb = 0;
+    int nfds;
+    int i;
+
+    ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+    if (ctx_tcp->s_listen == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx_tcp->efd == -1) {
+        struct epoll_event ev;
+
+        ctx_tcp->efd = epoll_create1(EPOLL_CLOEXEC);
+        if (ctx_tcp->efd == -1) {
+            return -1;
+        }
+
+        /* The listening socket is told apart by its NULL connection */
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(ctx_tcp->efd, EPOLL_CTL_ADD, ctx_tcp->s_listen, &ev) == -1) {
+            close(ctx_tcp->efd);
+            ctx_tcp->efd = -1;
+            return -1;
+        }
+    }
+
+    /* Those answered mustn't wait for new events */
+    nb = _modbus_tcp_serve_held(ctx, handler, arg);
+    nfds = epoll_wait(ctx_tcp->efd, events, _MODBUS_TCP_EVENTS, nb > 0 ? 0 : timeout_ms);
+    if (nfds == -1) {
+        return (errno == EINTR) ? nb : -1;
+    }
+
+    for (i = 0; i < nfds; i++) {
+        _modbus_tcp_connection_t *conn = (_modbus_tcp_connection_t *)events[i].data.ptr;
+        int rc;
+
+        if (conn == NULL) {
+            _modbus_tcp_accept_connections(ctx);
+            continue;
+        }
+
+        /* The rest of the responses first, there is room for it */
+        if (events[i].events & EPOLLOUT) {
+            if (_modbus_tcp_send_out(ctx, conn) == -1) {
+                _modbus_tcp_close_connection(ctx, conn);
+                continue;
+            }
+            /* Then the requests held for the room */
+            if (conn->held && _modbus_tcp_has_room(conn)) {
+                rc = _modbus_tcp_serve_requests(ctx, conn, handler, arg);
+                if (rc == -1) {
+                    _modbus_tcp_close_connection(ctx, conn);
+                    continue;
+                }
+                nb += rc;
+            }
+        }
+        if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+            continue;
+        }
+
+        rc = _modbus_tcp_serve_connection(ctx, conn, handler, arg);
+        if (rc == -1) {
+            _modbus_tcp_close_connection(ctx, conn);
+        } else {
+            nb += rc;
+        }
+    }
+
+    return nb;
+}
+
+/* Returns the connection identified by id, NULL once it is closed */
+_modbus_tcp_connection_t *_modbus_tcp_find_connection(modbus_t *ctx, unsigned long id)
+{
+    modbus_tcp_t *ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
+    int i;
+
+    for (i = 0; i < ctx_tcp->nb_connections; i++) {
+        if (ctx_tcp->connections[i]->id == id) {
+            return ctx_tcp->connections[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int _modbus_tcp_reply(modbus_t *ctx, const _modbus_tcp_connection_t *conn,
+                             const uint8_t *req, int req_length, void *arg)
+{
+    (void)conn;
+
+    if (modbus_reply(ctx, req, req_length, (modbus_mapping_t *)arg) == -1 &&
+        (errno == EPIPE || errno == ECONNRESET)) {
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Waits up to timeout_ms (-1 for ever) for clients and requests on the socket
+   of modbus_tcp_listen(), accepts the clients and answers every complete
+   request from mb_mapping, which may be shared with an RTU context. Returns
+   the number of requests answered, or -1 with errno set. */
+int modbus_tcp_poll(modbus_t *ctx, modbus_mapping_t *mb_mapping, int timeout_ms)
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP ||
+        mb_mapping == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return _modbus_tcp_poll(ctx, _modbus_tcp_reply, mb_mapping, timeout_ms);
+}
+
+#endif /* MODBUS_TCP */
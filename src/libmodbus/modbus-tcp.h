@@ -0,0 +1,48 @@
+/*
+ * Copyright © 2001-2010 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ * Copyright © 2022 Darryl Noakes <darryl.noakes@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#ifndef MODBUS_TCP_H
+#define MODBUS_TCP_H
+
+#include "modbus.h"
+
+/* Modbus TCP, available on Linux where the server waits on its sockets with
+ * epoll */
+#ifndef MODBUS_TCP
+#  if defined(__linux__)
+#    define MODBUS_TCP 1
+#  else
+#    define MODBUS_TCP 0
+#  endif
+#endif
+
+MODBUS_BEGIN_DECLS
+
+#define MODBUS_TCP_DEFAULT_PORT   502
+#define MODBUS_TCP_SLAVE         0xFF
+
+/* Modbus_Application_Protocol_V1_1b.pdf Chapter 4 Section 1 Page 5
+ * TCP MODBUS ADU = 253 bytes + MBAP (7 bytes) = 260 bytes
+ */
+#define MODBUS_TCP_MAX_ADU_LENGTH  260
+
+/* Largest number of clients a server can have connected at once, see
+ * modbus_tcp_listen() */
+#ifndef MODBUS_TCP_MAX_CONNECTIONS
+#define MODBUS_TCP_MAX_CONNECTIONS 1024
+#endif
+
+#if MODBUS_TCP
+MODBUS_API modbus_t* modbus_new_tcp(const char *ip_address, int port);
+MODBUS_API int modbus_tcp_listen(modbus_t *ctx, int nb_connection);
+MODBUS_API int modbus_tcp_accept(modbus_t *ctx, int *s);
+MODBUS_API int modbus_tcp_poll(modbus_t *ctx, modbus_mapping_t *mb_mapping, int timeout_ms);
+#endif
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_TCP_H */
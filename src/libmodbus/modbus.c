@@ -39,9 +39,11 @@
 
 #include "modbus.h"
 #include "modbus-private.h"
+#include "modbus-tcp.h"
 
-/* Internal use */
-#define MSG_LENGTH_UNDEFINED -1
+#if !defined(PROGMEM)
+#define PROGMEM
+#endif
 
 /* Exported version */
 const unsigned int libmodbus_version_major = LIBMODBUS_VERSION_MAJOR;
@@ -49,14 +51,11 @@ const unsigned int libmodbus_version_minor = LIBMODBUS_VERSION_MINOR;
 const unsigned int libmodbus_version_micro = LIBMODBUS_VERSION_MICRO;
 
 /* Max between RTU and TCP max adu length (so TCP) */
+#if MODBUS_TCP
+#define MAX_MESSAGE_LENGTH MODBUS_TCP_MAX_ADU_LENGTH
+#else
 #define MAX_MESSAGE_LENGTH 256
-
-/* 3 steps are used to parse the query */
-typedef enum {
-    _STEP_FUNCTION,
-    _STEP_META,
-    _STEP_DATA
-} _step_t;
+#endif
 
 #if defined(__AVR__)
 
@@ -140,6 +139,22 @@ static void _sleep_response_timeout(modbus_t *ctx)
     delayMicroseconds(ctx->response_timeout.tv_usec);
 }
 
+/* Discards the rest of a malformed message, see modbus_set_flush_mode() */
+static void _flush_input(modbus_t *ctx)
+{
+    int rc;
+
+    if (ctx->flush_mode == MODBUS_FLUSH_T35 && ctx->backend->drain != NULL) {
+        rc = ctx->backend->drain(ctx, &ctx->response_timeout);
+        if (rc != -1 && ctx->debug) {
+            printf("Bytes drained (%d)\n", rc);
+        }
+    } else {
+        _sleep_response_timeout(ctx);
+        modbus_flush(ctx);
+    }
+}
+
 int modbus_flush(modbus_t *ctx)
 {
     int rc;
@@ -157,8 +172,9 @@ int modbus_flush(modbus_t *ctx)
     return rc;
 }
 
-/* Computes the length of the expected response */
-static unsigned int compute_response_length_from_request(modbus_t *ctx, uint8_t *req)
+/* Computes the length of the expected response, MSG_LENGTH_UNDEFINED when the
+   response gives it */
+int _modbus_compute_response_length_from_request(modbus_t *ctx, const uint8_t *req)
 {
     int length;
     const int offset = ctx->backend->header_length;
@@ -222,8 +238,7 @@ static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
                     _sleep_response_timeout(ctx);
                     modbus_connect(ctx);
                 } else {
-                    _sleep_response_timeout(ctx);
-                    modbus_flush(ctx);
+                    _flush_input(ctx);
                 }
                 errno = saved_errno;
             }
@@ -239,6 +254,27 @@ static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
     return rc;
 }
 
+/* Sends a response, with the checksum kept by modbus_set_slave() when it is
+   one of its exception responses */
+static int send_response(modbus_t *ctx, const uint8_t *req, uint8_t *rsp, int rsp_length)
+{
+#if MODBUS_FIXED_RESPONSES
+    const _modbus_fixed_t *fixed = &ctx->fixed;
+    const int offset = ctx->backend->header_length;
+
+    if (rsp_length == offset + 2 && rsp[offset - 1] == fixed->slave &&
+        (rsp[offset] & 0x80) && (rsp[offset] & 0x7F) < _MODBUS_FIXED_FUNCTIONS &&
+        rsp[offset + 1] >= 1 && rsp[offset + 1] <= _MODBUS_FIXED_EXCEPTIONS) {
+        memcpy(rsp + rsp_length,
+               fixed->exception_checksums[rsp[offset] & 0x7F][rsp[offset + 1] - 1],
+               _MODBUS_FIXED_CHECKSUM_LENGTH);
+        return ctx->backend->send_frame(ctx, req, rsp, rsp_length + _MODBUS_FIXED_CHECKSUM_LENGTH);
+    }
+#endif
+
+    return send_msg(ctx, rsp, rsp_length);
+}
+
 int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length)
 {
     sft_t sft;
@@ -280,14 +316,19 @@ int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length)
  *  ---------- Confirmation  Response ----------
  */
 
+static const _modbus_user_function_t *user_function(modbus_t *ctx, int function);
+
 /* Computes the length to read after the function received */
-static uint8_t compute_meta_length_after_function(int function,
-                                                  msg_type_t msg_type)
+uint8_t _modbus_compute_meta_length_after_function(modbus_t *ctx, int function,
+                                                   msg_type_t msg_type)
 {
+    const _modbus_user_function_t *user;
     int length;
 
     if (msg_type == MSG_INDICATION) {
-        if (function <= MODBUS_FC_WRITE_SINGLE_REGISTER) {
+        if ((user = user_function(ctx, function)) != NULL) {
+            length = user->meta_length;
+        } else if (function <= MODBUS_FC_WRITE_SINGLE_REGISTER) {
             length = 4;
         } else if (function == MODBUS_FC_WRITE_MULTIPLE_COILS ||
                    function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS) {
@@ -321,13 +362,18 @@ static uint8_t compute_meta_length_after_function(int function,
 }
 
 /* Computes the length to read after the meta information (address, count, etc) */
-static int compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg,
-                                          msg_type_t msg_type)
+int _modbus_compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg,
+                                           msg_type_t msg_type)
 {
     int function = msg[ctx->backend->header_length];
+    const _modbus_user_function_t *user;
     int length;
 
-    if (msg_type == MSG_INDICATION) {
+    if (msg_type == MSG_INDICATION &&
+        (user = user_function(ctx, function)) != NULL) {
+        /* The last meta byte of the request counts the data bytes */
+        length = user->byte_count ? msg[ctx->backend->header_length + user->meta_length] : 0;
+    } else if (msg_type == MSG_INDICATION) {
         switch (function) {
         case MODBUS_FC_WRITE_MULTIPLE_COILS:
         case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
@@ -411,8 +457,7 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
                 int saved_errno = errno;
 
                 if (errno == ETIMEDOUT) {
-                    _sleep_response_timeout(ctx);
-                    modbus_flush(ctx);
+                    _flush_input(ctx);
                 } else if (errno == EBADF) {
                     modbus_close(ctx);
                     modbus_connect(ctx);
@@ -458,15 +503,17 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
             switch (step) {
             case _STEP_FUNCTION:
                 /* Function code position */
-                length_to_read = compute_meta_length_after_function(
+                length_to_read = _modbus_compute_meta_length_after_function(ctx,
                     msg[ctx->backend->header_length],
                     msg_type);
                 if (length_to_read != 0) {
                     step = _STEP_META;
                     break;
-                } /* else switches straight to the next step */
+                }
+                /* else switches straight to the next step */
+                /* fall through */
             case _STEP_META:
-                length_to_read = compute_data_length_after_meta(
+                length_to_read = _modbus_compute_data_length_after_meta(
                     ctx, msg, msg_type);
                 if ((msg_length + length_to_read) > (int)ctx->backend->max_adu_length) {
                     errno = EMBBADDATA;
@@ -540,14 +587,13 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req,
         rc = ctx->backend->pre_check_confirmation(ctx, req, rsp, rsp_length);
         if (rc == -1) {
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-                _sleep_response_timeout(ctx);
-                modbus_flush(ctx);
+                _flush_input(ctx);
             }
             return -1;
         }
     }
 
-    rsp_length_computed = compute_response_length_from_request(ctx, req);
+    rsp_length_computed = _modbus_compute_response_length_from_request(ctx, req);
 
     /* Exception code */
     if (function >= 0x80) {
@@ -585,8 +631,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req,
                         function, req[offset]);
             }
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-                _sleep_response_timeout(ctx);
-                modbus_flush(ctx);
+                _flush_input(ctx);
             }
             errno = EMBBADDATA;
             return -1;
@@ -635,8 +680,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req,
             }
 
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-                _sleep_response_timeout(ctx);
-                modbus_flush(ctx);
+                _flush_input(ctx);
             }
 
             errno = EMBBADDATA;
@@ -649,8 +693,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req,
                     rsp_length, rsp_length_computed);
         }
         if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-            _sleep_response_timeout(ctx);
-            modbus_flush(ctx);
+            _flush_input(ctx);
         }
         errno = EMBBADDATA;
         rc = -1;
@@ -659,6 +702,16 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req,
     return rc;
 }
 
+/* Functions reading the tables, the helpers below are only built for them */
+#define _MODBUS_SERVER_READS_BITS \
+    (_MODBUS_SERVER_HAS(MODBUS_FC_READ_COILS) || \
+     _MODBUS_SERVER_HAS(MODBUS_FC_READ_DISCRETE_INPUTS))
+#define _MODBUS_SERVER_READS_REGISTERS \
+    (_MODBUS_SERVER_HAS(MODBUS_FC_READ_HOLDING_REGISTERS) || \
+     _MODBUS_SERVER_HAS(MODBUS_FC_READ_INPUT_REGISTERS) || \
+     _MODBUS_SERVER_HAS(MODBUS_FC_WRITE_AND_READ_REGISTERS))
+
+#if _MODBUS_SERVER_READS_BITS
 static int response_io_status(uint8_t *tab_io_status,
                               int address, int nb,
                               uint8_t *rsp, int offset)
@@ -684,6 +737,7 @@ static int response_io_status(uint8_t *tab_io_status,
 
     return offset;
 }
+#endif
 
 /* Build the exception response */
 static int response_exception(modbus_t *ctx, sft_t *sft,
@@ -704,8 +758,7 @@ static int response_exception(modbus_t *ctx, sft_t *sft,
 
     /* Flush if required */
     if (to_flush) {
-        _sleep_response_timeout(ctx);
-        modbus_flush(ctx);
+        _flush_input(ctx);
     }
 
     /* Build exception response */
@@ -716,344 +769,1213 @@ static int response_exception(modbus_t *ctx, sft_t *sft,
     return rsp_length;
 }
 
-/* Send a response to the received request.
-   Analyses the request and constructs a response.
+#if _MODBUS_SERVER_READS_BITS || _MODBUS_SERVER_READS_REGISTERS
+/* Start of a read of the tables that must not see a partial update */
+static modbus_seq_t mapping_read_begin(const modbus_mapping_t *mb_mapping)
+{
+    modbus_seq_t seq = mb_mapping->seq;
 
-   If an error occurs, this function construct the response
-   accordingly.
-*/
-int modbus_reply(modbus_t *ctx, const uint8_t *req,
-                 int req_length, modbus_mapping_t *mb_mapping)
+    _MODBUS_SEQ_BARRIER();
+    return seq;
+}
+
+/* Tells whether the values read since mapping_read_begin() may mix old and
+   new values of an update, and must be read again */
+static int mapping_read_retry(const modbus_mapping_t *mb_mapping, modbus_seq_t seq)
 {
-    int offset;
-    int slave;
-    int function;
-    uint16_t address;
-    uint8_t rsp[MAX_MESSAGE_LENGTH];
-    int rsp_length = 0;
-    sft_t sft;
+    _MODBUS_SEQ_BARRIER();
+    return (seq & 1) || mb_mapping->seq != seq;
+}
+#endif
 
-    if (ctx == NULL) {
-        errno = EINVAL;
-        return -1;
+#if _MODBUS_SERVER_READS_REGISTERS
+/* Copies nb registers of tab from index on to rsp, returns the new length */
+static int response_registers(const uint16_t *tab, int index, int nb, int wire,
+                              uint8_t *rsp, int offset)
+{
+    int i;
+
+    if (wire) {
+        memcpy(rsp + offset, tab + index, nb << 1);
+        offset += nb << 1;
+    } else {
+        for (i = index; i < index + nb; i++) {
+            rsp[offset++] = tab[i] >> 8;
+            rsp[offset++] = tab[i] & 0xFF;
+        }
     }
 
-    offset = ctx->backend->header_length;
-    slave = req[offset - 1];
-    function = req[offset];
-    address = (req[offset + 1] << 8) + req[offset + 2];
+    return offset;
+}
+#endif
 
-    sft.slave = slave;
-    sft.function = function;
-    sft.t_id = ctx->backend->prepare_response_tid(req, &req_length);
+#if _MODBUS_SERVER_READS_BITS || _MODBUS_SERVER_READS_REGISTERS
+/* Runs the read handlers overlapping nb values of table from address on, so
+   the tables hold fresh values before they are copied in the response.
+   Returns -1 if a handler failed. */
+static int mapping_read(modbus_mapping_t *mb_mapping, int table, int address, int nb)
+{
+    int i;
 
-    /* Data are flushed on illegal number of values errors. */
-    switch (function) {
-    case MODBUS_FC_READ_COILS:
-    case MODBUS_FC_READ_DISCRETE_INPUTS: {
-        unsigned int is_input = (function == MODBUS_FC_READ_DISCRETE_INPUTS);
-        int start_bits = is_input ? mb_mapping->start_input_bits : mb_mapping->start_bits;
-        int nb_bits = is_input ? mb_mapping->nb_input_bits : mb_mapping->nb_bits;
-        uint8_t *tab_bits = is_input ? mb_mapping->tab_input_bits : mb_mapping->tab_bits;
-        const char * const name = is_input ? "read_input_bits" : "read_bits";
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        /* The mapping can be shifted to reduce memory consumption and it
-           doesn't always start at address zero. */
-        int mapping_address = address - start_bits;
-
-        if (nb < 1 || MODBUS_MAX_READ_BITS < nb) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
-                "Illegal nb of values %d in %s (max %d)\n",
-                nb, name, MODBUS_MAX_READ_BITS);
-        } else if (mapping_address < 0 || (mapping_address + nb) > nb_bits) {
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in %s\n",
-                mapping_address < 0 ? address : address + nb, name);
+    for (i = 0; i < mb_mapping->nb_read_handlers; i++) {
+        modbus_read_handler_t *handler = &mb_mapping->read_handlers[i];
+        int first;
+        int last;
+
+        if (handler->table != table ||
+            address >= handler->start + handler->nb ||
+            handler->start >= address + nb) {
+            continue;
+        }
+
+        if (handler->ttl_ms > 0) {
+            /* Cached: the whole range of the handler is refreshed at once */
+            uint32_t now = millis();
+
+            if (handler->valid && (uint32_t)(now - handler->last_ms) < handler->ttl_ms) {
+                continue;
+            }
+            if (handler->cb(handler->data, table, handler->start, handler->nb) != 0) {
+                handler->valid = FALSE;
+                return -1;
+            }
+            handler->last_ms = now;
+            handler->valid = TRUE;
         } else {
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            rsp[rsp_length++] = (nb / 8) + ((nb % 8) ? 1 : 0);
-            rsp_length = response_io_status(tab_bits, mapping_address, nb,
-                                            rsp, rsp_length);
+            /* Only the requested window */
+            first = address > handler->start ? address : handler->start;
+            last = address + nb < handler->start + handler->nb ?
+                address + nb : handler->start + handler->nb;
+            if (handler->cb(handler->data, table, first, last - first) != 0) {
+                return -1;
+            }
         }
     }
-        break;
-    case MODBUS_FC_READ_HOLDING_REGISTERS:
-    case MODBUS_FC_READ_INPUT_REGISTERS: {
-        unsigned int is_input = (function == MODBUS_FC_READ_INPUT_REGISTERS);
-        int start_registers = is_input ? mb_mapping->start_input_registers : mb_mapping->start_registers;
-        int nb_registers = is_input ? mb_mapping->nb_input_registers : mb_mapping->nb_registers;
-        uint16_t *tab_registers = is_input ? mb_mapping->tab_input_registers : mb_mapping->tab_registers;
-        const char * const name = is_input ? "read_input_registers" : "read_registers";
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        /* The mapping can be shifted to reduce memory consumption and it
-           doesn't always start at address zero. */
-        int mapping_address = address - start_registers;
-
-        if (nb < 1 || MODBUS_MAX_READ_REGISTERS < nb) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
-                "Illegal nb of values %d in %s (max %d)\n",
-                nb, name, MODBUS_MAX_READ_REGISTERS);
-        } else if (mapping_address < 0 || (mapping_address + nb) > nb_registers) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in %s\n",
-                mapping_address < 0 ? address : address + nb, name);
-        } else {
-            int i;
 
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            rsp[rsp_length++] = nb << 1;
-            for (i = mapping_address; i < mapping_address + nb; i++) {
-                rsp[rsp_length++] = tab_registers[i] >> 8;
-                rsp[rsp_length++] = tab_registers[i] & 0xFF;
+    return 0;
+}
+#endif
+
+/* State of the request being answered, shared by the function handlers */
+typedef struct {
+    modbus_t *ctx;
+    const uint8_t *req;
+    int req_length;
+    int offset;
+    uint16_t address;
+    modbus_mapping_t *mb_mapping;
+    sft_t sft;
+    uint8_t *rsp;
+    /* Range written by the request, reported to the write callback */
+    int write_table;
+    int write_address;
+    int write_nb;
+    /* TRUE if rsp holds a whole frame, checksum included */
+    int complete;
+} _reply_t;
+
+/* Builds the response to the request in r->rsp and returns its length, or
+   returns -1 and sets errno if no response can be sent */
+typedef int (*_reply_handler_t)(_reply_t *r);
+
+#if _MODBUS_SERVER_HAS(MODBUS_FC_READ_COILS) || \
+    _MODBUS_SERVER_HAS(MODBUS_FC_READ_DISCRETE_INPUTS)
+/* Read coils (0x01) and read discrete inputs (0x02) */
+static int reply_read_bits(_reply_t *r)
+{
+    modbus_t *ctx = r->ctx;
+    const uint8_t *req = r->req;
+    int offset = r->offset;
+    int function = r->sft.function;
+    uint16_t address = r->address;
+    modbus_mapping_t *mb_mapping = r->mb_mapping;
+    uint8_t *rsp = r->rsp;
+    int rsp_length;
+    unsigned int is_input = (function == MODBUS_FC_READ_DISCRETE_INPUTS);
+    const char * const name = is_input ? "read_input_bits" : "read_bits";
+    int nb = (req[offset + 3] << 8) + req[offset + 4];
+    /* The mapping can be shifted to reduce memory consumption and it
+       doesn't always start at address zero. */
+    int mapping_address;
+    uint8_t *tab_bits = (uint8_t *)modbus_mapping_lookup(
+        mb_mapping, is_input ? MODBUS_TABLE_INPUT_BITS : MODBUS_TABLE_BITS,
+        address, nb, &mapping_address);
+
+    if (nb < 1 || MODBUS_MAX_READ_BITS < nb) {
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
+            "Illegal nb of values %d in %s (max %d)\n",
+            nb, name, MODBUS_MAX_READ_BITS);
+    } else if (tab_bits == NULL) {
+        rsp_length = response_exception(
+            ctx, &r->sft,
+            MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
+            "Illegal data address 0x%0X (nb %d) in %s\n",
+            address, nb, name);
+    } else if (mapping_read(mb_mapping, is_input ? MODBUS_TABLE_INPUT_BITS : MODBUS_TABLE_BITS,
+                            address, nb) == -1) {
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE, rsp, FALSE,
+            "Read handler failed at address 0x%0X (nb %d) in %s\n",
+            address, nb, name);
+    } else {
+        int is_packed = mb_mapping->flags & (is_input ? MODBUS_MAPPING_PACKED_INPUT_BITS
+                                                      : MODBUS_MAPPING_PACKED_BITS);
+        int basis_length = ctx->backend->build_response_basis(&r->sft, rsp);
+        int tries = 0;
+        modbus_seq_t seq;
+
+        rsp[basis_length++] = (nb / 8) + ((nb % 8) ? 1 : 0);
+        do {
+            seq = mapping_read_begin(mb_mapping);
+            if (is_packed) {
+                rsp_length = basis_length + modbus_get_bytes_from_packed_bits(
+                    rsp + basis_length, tab_bits, mapping_address, nb);
+            } else {
+                rsp_length = response_io_status(tab_bits, mapping_address, nb,
+                                                rsp, basis_length);
             }
+        } while (mapping_read_retry(mb_mapping, seq) &&
+                 ++tries < MODBUS_SEQLOCK_MAX_RETRIES);
+
+        if (tries == MODBUS_SEQLOCK_MAX_RETRIES) {
+            rsp_length = response_exception(
+                ctx, &r->sft, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY, rsp, FALSE,
+                "Update in progress at address 0x%0X (nb %d) in %s\n",
+                address, nb, name);
         }
     }
-        break;
-    case MODBUS_FC_WRITE_SINGLE_COIL: {
-        int mapping_address = address - mb_mapping->start_bits;
 
-        if (mapping_address < 0 || mapping_address >= mb_mapping->nb_bits) {
+    return rsp_length;
+}
+#endif
+
+#if _MODBUS_SERVER_HAS(MODBUS_FC_READ_HOLDING_REGISTERS) || \
+    _MODBUS_SERVER_HAS(MODBUS_FC_READ_INPUT_REGISTERS)
+/* Read holding registers (0x03) and read input registers (0x04) */
+static int reply_read_registers(_reply_t *r)
+{
+    modbus_t *ctx = r->ctx;
+    const uint8_t *req = r->req;
+    int offset = r->offset;
+    int function = r->sft.function;
+    uint16_t address = r->address;
+    modbus_mapping_t *mb_mapping = r->mb_mapping;
+    uint8_t *rsp = r->rsp;
+    int rsp_length;
+    unsigned int is_input = (function == MODBUS_FC_READ_INPUT_REGISTERS);
+    const char * const name = is_input ? "read_input_registers" : "read_registers";
+    int nb = (req[offset + 3] << 8) + req[offset + 4];
+    /* The mapping can be shifted to reduce memory consumption and it
+       doesn't always start at address zero. */
+    int mapping_address;
+    uint16_t *tab_registers = (uint16_t *)modbus_mapping_lookup(
+        mb_mapping, is_input ? MODBUS_TABLE_INPUT_REGISTERS : MODBUS_TABLE_REGISTERS,
+        address, nb, &mapping_address);
+
+    if (nb < 1 || MODBUS_MAX_READ_REGISTERS < nb) {
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
+            "Illegal nb of values %d in %s (max %d)\n",
+            nb, name, MODBUS_MAX_READ_REGISTERS);
+    } else if (tab_registers == NULL) {
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
+            "Illegal data address 0x%0X (nb %d) in %s\n",
+            address, nb, name);
+    } else if (mapping_read(mb_mapping, is_input ? MODBUS_TABLE_INPUT_REGISTERS : MODBUS_TABLE_REGISTERS,
+                            address, nb) == -1) {
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE, rsp, FALSE,
+            "Read handler failed at address 0x%0X (nb %d) in %s\n",
+            address, nb, name);
+    } else {
+        int is_wire = mb_mapping->flags & (is_input ? MODBUS_MAPPING_WIRE_INPUT_REGISTERS
+                                                    : MODBUS_MAPPING_WIRE_REGISTERS);
+        int basis_length = ctx->backend->build_response_basis(&r->sft, rsp);
+        int tries = 0;
+        modbus_seq_t seq;
+
+        rsp[basis_length++] = nb << 1;
+        do {
+            seq = mapping_read_begin(mb_mapping);
+            rsp_length = response_registers(tab_registers, mapping_address, nb,
+                                            is_wire, rsp, basis_length);
+        } while (mapping_read_retry(mb_mapping, seq) &&
+                 ++tries < MODBUS_SEQLOCK_MAX_RETRIES);
+
+        if (tries == MODBUS_SEQLOCK_MAX_RETRIES) {
             rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in write_bit\n",
-                address);
-        } else {
-            int data = (req[offset + 3] << 8) + req[offset + 4];
+                ctx, &r->sft, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY, rsp, FALSE,
+                "Update in progress at address 0x%0X (nb %d) in %s\n",
+                address, nb, name);
+        }
+    }
+
+    return rsp_length;
+}
+#endif
+
+#if _MODBUS_SERVER_HAS(MODBUS_FC_WRITE_SINGLE_COIL)
+/* Write single coil (0x05) */
+static int reply_write_bit(_reply_t *r)
+{
+    modbus_t *ctx = r->ctx;
+    const uint8_t *req = r->req;
+    int req_length = r->req_length;
+    int offset = r->offset;
+    uint16_t address = r->address;
+    modbus_mapping_t *mb_mapping = r->mb_mapping;
+    uint8_t *rsp = r->rsp;
+    int rsp_length;
+    int mapping_address;
+    uint8_t *tab_bits = (uint8_t *)modbus_mapping_lookup(
+        mb_mapping, MODBUS_TABLE_BITS, address, 1, &mapping_address);
+
+    if (tab_bits == NULL) {
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
+            "Illegal data address 0x%0X in write_bit\n",
+            address);
+    } else {
+        int data = (req[offset + 3] << 8) + req[offset + 4];
 
 #if defined(__AVR__)
-            if (data == (int)0xFF00 || data == 0x0) {
+        if (data == (int)0xFF00 || data == 0x0) {
 #else
-            if (data == 0xFF00 || data == 0x0) {
+        if (data == 0xFF00 || data == 0x0) {
 #endif
-                mb_mapping->tab_bits[mapping_address] = data ? ON : OFF;
-                memcpy(rsp, req, req_length);
-                rsp_length = req_length;
+            if (mb_mapping->flags & MODBUS_MAPPING_PACKED_BITS) {
+                uint8_t mask = 1 << (mapping_address & 7);
+
+                if (data) {
+                    tab_bits[mapping_address >> 3] |= mask;
+                } else {
+                    tab_bits[mapping_address >> 3] &= ~mask;
+                }
             } else {
-                rsp_length = response_exception(
-                    ctx, &sft,
-                    MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, FALSE,
-                    "Illegal data value 0x%0X in write_bit request at address %0X\n",
-                    data, address);
+                tab_bits[mapping_address] = data ? ON : OFF;
             }
+            r->write_table = MODBUS_TABLE_BITS;
+            r->write_address = address;
+            r->write_nb = 1;
+            memcpy(rsp, req, req_length);
+            rsp_length = req_length;
+        } else {
+            rsp_length = response_exception(
+                ctx, &r->sft,
+                MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, FALSE,
+                "Illegal data value 0x%0X in write_bit request at address %0X\n",
+                data, address);
         }
     }
-        break;
-    case MODBUS_FC_WRITE_SINGLE_REGISTER: {
-        int mapping_address = address - mb_mapping->start_registers;
 
-        if (mapping_address < 0 || mapping_address >= mb_mapping->nb_registers) {
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in write_register\n",
-                address);
+    return rsp_length;
+}
+#endif
+
+#if _MODBUS_SERVER_HAS(MODBUS_FC_WRITE_SINGLE_REGISTER)
+/* Write single register (0x06) */
+static int reply_write_register(_reply_t *r)
+{
+    modbus_t *ctx = r->ctx;
+    const uint8_t *req = r->req;
+    int req_length = r->req_length;
+    int offset = r->offset;
+    uint16_t address = r->address;
+    modbus_mapping_t *mb_mapping = r->mb_mapping;
+    uint8_t *rsp = r->rsp;
+    int rsp_length;
+    int mapping_address;
+    uint16_t *tab_registers = (uint16_t *)modbus_mapping_lookup(
+        mb_mapping, MODBUS_TABLE_REGISTERS, address, 1, &mapping_address);
+
+    if (tab_registers == NULL) {
+        rsp_length = response_exception(
+            ctx, &r->sft,
+            MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
+            "Illegal data address 0x%0X in write_register\n",
+            address);
+    } else {
+        if (mb_mapping->flags & MODBUS_MAPPING_WIRE_REGISTERS) {
+            memcpy(tab_registers + mapping_address, req + offset + 3, 2);
         } else {
             int data = (req[offset + 3] << 8) + req[offset + 4];
 
-            mb_mapping->tab_registers[mapping_address] = data;
-            memcpy(rsp, req, req_length);
-            rsp_length = req_length;
+            tab_registers[mapping_address] = data;
         }
+        r->write_address = address;
+        r->write_nb = 1;
+        memcpy(rsp, req, req_length);
+        rsp_length = req_length;
     }
-        break;
-    case MODBUS_FC_WRITE_MULTIPLE_COILS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        int mapping_address = address - mb_mapping->start_bits;
-
-        if (nb < 1 || MODBUS_MAX_WRITE_BITS < nb) {
-            /* May be the indication has been truncated on reading because of
-             * invalid address (eg. nb is 0 but the request contains values to
-             * write) so it's necessary to flush. */
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
-                "Illegal number of values %d in write_bits (max %d)\n",
-                nb, MODBUS_MAX_WRITE_BITS);
-        } else if (mapping_address < 0 ||
-                   (mapping_address + nb) > mb_mapping->nb_bits) {
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in write_bits\n",
-                mapping_address < 0 ? address : address + nb);
+
+    return rsp_length;
+}
+#endif
+
+#if _MODBUS_SERVER_HAS(MODBUS_FC_WRITE_MULTIPLE_COILS)
+/* Write multiple coils (0x0F) */
+static int reply_write_bits(_reply_t *r)
+{
+    modbus_t *ctx = r->ctx;
+    const uint8_t *req = r->req;
+    int offset = r->offset;
+    uint16_t address = r->address;
+    modbus_mapping_t *mb_mapping = r->mb_mapping;
+    uint8_t *rsp = r->rsp;
+    int rsp_length;
+    int nb = (req[offset + 3] << 8) + req[offset + 4];
+    int mapping_address;
+    uint8_t *tab_bits = (uint8_t *)modbus_mapping_lookup(
+        mb_mapping, MODBUS_TABLE_BITS, address, nb, &mapping_address);
+
+    if (nb < 1 || MODBUS_MAX_WRITE_BITS < nb) {
+        /* May be the indication has been truncated on reading because of
+         * invalid address (eg. nb is 0 but the request contains values to
+         * write) so it's necessary to flush. */
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
+            "Illegal number of values %d in write_bits (max %d)\n",
+            nb, MODBUS_MAX_WRITE_BITS);
+    } else if (tab_bits == NULL) {
+        rsp_length = response_exception(
+            ctx, &r->sft,
+            MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
+            "Illegal data address 0x%0X (nb %d) in write_bits\n",
+            address, nb);
+    } else {
+        /* 6 = byte count */
+        if (mb_mapping->flags & MODBUS_MAPPING_PACKED_BITS) {
+            modbus_set_packed_bits_from_bytes(tab_bits, mapping_address,
+                                              nb, &req[offset + 6]);
         } else {
-            /* 6 = byte count */
-            modbus_set_bits_from_bytes(mb_mapping->tab_bits, mapping_address, nb,
+            modbus_set_bits_from_bytes(tab_bits, mapping_address, nb,
                                        &req[offset + 6]);
-
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            /* 4 to copy the bit address (2) and the quantity of bits */
-            memcpy(rsp + rsp_length, req + rsp_length, 4);
-            rsp_length += 4;
         }
+        r->write_table = MODBUS_TABLE_BITS;
+        r->write_address = address;
+        r->write_nb = nb;
+
+        rsp_length = ctx->backend->build_response_basis(&r->sft, rsp);
+        /* 4 to copy the bit address (2) and the quantity of bits */
+        memcpy(rsp + rsp_length, req + rsp_length, 4);
+        rsp_length += 4;
     }
-        break;
-    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        int mapping_address = address - mb_mapping->start_registers;
 
-        if (nb < 1 || MODBUS_MAX_WRITE_REGISTERS < nb) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
-                "Illegal number of values %d in write_registers (max %d)\n",
-                nb, MODBUS_MAX_WRITE_REGISTERS);
-        } else if (mapping_address < 0 ||
-                   (mapping_address + nb) > mb_mapping->nb_registers) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in write_registers\n",
-                mapping_address < 0 ? address : address + nb);
-        } else {
-            int i, j;
-            for (i = mapping_address, j = 6; i < mapping_address + nb; i++, j += 2) {
-                /* 6 and 7 = first value */
-                mb_mapping->tab_registers[i] =
-                    (req[offset + j] << 8) + req[offset + j + 1];
-            }
+    return rsp_length;
+}
+#endif
 
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            /* 4 to copy the address (2) and the no. of registers */
-            memcpy(rsp + rsp_length, req + rsp_length, 4);
-            rsp_length += 4;
-        }
-    }
-        break;
-    case MODBUS_FC_REPORT_SLAVE_ID: {
-        int str_len;
-        int byte_count_pos;
-
-        rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-        /* Skip byte count for now */
-        byte_count_pos = rsp_length++;
-        rsp[rsp_length++] = _REPORT_SLAVE_ID;
-        /* Run indicator status to ON */
-        rsp[rsp_length++] = 0xFF;
-        /* LMB + length of LIBMODBUS_VERSION_STRING */
-        str_len = 3 + strlen(LIBMODBUS_VERSION_STRING);
-        memcpy(rsp + rsp_length, "LMB" LIBMODBUS_VERSION_STRING, str_len);
-        rsp_length += str_len;
-        rsp[byte_count_pos] = rsp_length - byte_count_pos - 1;
-    }
-        break;
-    case MODBUS_FC_READ_EXCEPTION_STATUS:
-        if (ctx->debug) {
-            fprintf(stderr, "FIXME Not implemented\n");
-        }
-        errno = ENOPROTOOPT;
-        return -1;
-        break;
-    case MODBUS_FC_MASK_WRITE_REGISTER: {
-        int mapping_address = address - mb_mapping->start_registers;
+#if _MODBUS_SERVER_HAS(MODBUS_FC_WRITE_MULTIPLE_REGISTERS)
+/* Write multiple registers (0x10) */
+static int reply_write_registers(_reply_t *r)
+{
+    modbus_t *ctx = r->ctx;
+    const uint8_t *req = r->req;
+    int offset = r->offset;
+    uint16_t address = r->address;
+    modbus_mapping_t *mb_mapping = r->mb_mapping;
+    uint8_t *rsp = r->rsp;
+    int rsp_length;
+    int nb = (req[offset + 3] << 8) + req[offset + 4];
+    int mapping_address;
+    uint16_t *tab_registers = (uint16_t *)modbus_mapping_lookup(
+        mb_mapping, MODBUS_TABLE_REGISTERS, address, nb, &mapping_address);
 
-        if (mapping_address < 0 || mapping_address >= mb_mapping->nb_registers) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data address 0x%0X in write_register\n",
-                address);
-        } else {
-            uint16_t data = mb_mapping->tab_registers[mapping_address];
-            uint16_t and = (req[offset + 3] << 8) + req[offset + 4];
-            uint16_t or = (req[offset + 5] << 8) + req[offset + 6];
+    if (nb < 1 || MODBUS_MAX_WRITE_REGISTERS < nb) {
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
+            "Illegal number of values %d in write_registers (max %d)\n",
+            nb, MODBUS_MAX_WRITE_REGISTERS);
+    } else if (tab_registers == NULL) {
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
+            "Illegal data address 0x%0X (nb %d) in write_registers\n",
+            address, nb);
+    } else {
+        int i, j;
 
-            data = (data & and) | (or & (~and));
-            mb_mapping->tab_registers[mapping_address] = data;
-            memcpy(rsp, req, req_length);
-            rsp_length = req_length;
-        }
-    }
-        break;
-    case MODBUS_FC_WRITE_AND_READ_REGISTERS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        uint16_t address_write = (req[offset + 5] << 8) + req[offset + 6];
-        int nb_write = (req[offset + 7] << 8) + req[offset + 8];
-        int nb_write_bytes = req[offset + 9];
-        int mapping_address = address - mb_mapping->start_registers;
-        int mapping_address_write = address_write - mb_mapping->start_registers;
-
-        if (nb_write < 1 || MODBUS_MAX_WR_WRITE_REGISTERS < nb_write ||
-            nb < 1 || MODBUS_MAX_WR_READ_REGISTERS < nb ||
-            nb_write_bytes != nb_write * 2) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
-                "Illegal nb of values (W%d, R%d) in write_and_read_registers (max W%d, R%d)\n",
-                nb_write, nb, MODBUS_MAX_WR_WRITE_REGISTERS, MODBUS_MAX_WR_READ_REGISTERS);
-        } else if (mapping_address < 0 ||
-                   (mapping_address + nb) > mb_mapping->nb_registers ||
-                   (mapping_address_write + nb_write) > mb_mapping->nb_registers) {
-            rsp_length = response_exception(
-                ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
-                "Illegal data read address 0x%0X or write address 0x%0X write_and_read_registers\n",
-                mapping_address < 0 ? address : address + nb,
-                mapping_address_write < 0 ? address_write : address_write + nb_write);
+        if (mb_mapping->flags & MODBUS_MAPPING_WIRE_REGISTERS) {
+            memcpy(tab_registers + mapping_address, req + offset + 6, nb << 1);
         } else {
-            int i, j;
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            rsp[rsp_length++] = nb << 1;
-
-            /* Write first.
-               10 and 11 are the offset of the first values to write */
-            for (i = mapping_address_write, j = 10;
-                 i < mapping_address_write + nb_write; i++, j += 2) {
-                mb_mapping->tab_registers[i] =
+            for (i = mapping_address, j = 6; i < mapping_address + nb; i++, j += 2) {
+                /* 6 and 7 = first value */
+                tab_registers[i] =
                     (req[offset + j] << 8) + req[offset + j + 1];
             }
-
-            /* and read the data for the response */
-            for (i = mapping_address; i < mapping_address + nb; i++) {
-                rsp[rsp_length++] = mb_mapping->tab_registers[i] >> 8;
-                rsp[rsp_length++] = mb_mapping->tab_registers[i] & 0xFF;
-            }
         }
-    }
-        break;
+        r->write_address = address;
+        r->write_nb = nb;
 
-    default:
-        rsp_length = response_exception(
-            ctx, &sft, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, rsp, TRUE,
-            "Unknown Modbus function code: 0x%0X\n", function);
-        break;
+        rsp_length = ctx->backend->build_response_basis(&r->sft, rsp);
+        /* 4 to copy the address (2) and the no. of registers */
+        memcpy(rsp + rsp_length, req + rsp_length, 4);
+        rsp_length += 4;
     }
 
-    /* Suppress any responses when the request was a broadcast */
-    return (slave == MODBUS_BROADCAST_ADDRESS) ? 0 : send_msg(ctx, rsp, rsp_length);
+    return rsp_length;
 }
+#endif
 
-int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
-                           unsigned int exception_code)
+#if _MODBUS_SERVER_HAS(MODBUS_FC_REPORT_SLAVE_ID)
+/* Report slave ID (0x11) */
+static int build_report_slave_id(modbus_t *ctx, sft_t *sft, uint8_t *rsp)
 {
-    int offset;
-    int slave;
-    int function;
-    uint8_t rsp[MAX_MESSAGE_LENGTH];
     int rsp_length;
-    int dummy_length = 99;
-    sft_t sft;
+    int str_len;
+    int byte_count_pos;
 
-    if (ctx == NULL) {
-        errno = EINVAL;
-        return -1;
-    }
+    rsp_length = ctx->backend->build_response_basis(sft, rsp);
+    /* Skip byte count for now */
+    byte_count_pos = rsp_length++;
+    rsp[rsp_length++] = _REPORT_SLAVE_ID;
+    /* Run indicator status to ON */
+    rsp[rsp_length++] = 0xFF;
+    /* LMB + length of LIBMODBUS_VERSION_STRING */
+    str_len = 3 + strlen(LIBMODBUS_VERSION_STRING);
+    memcpy(rsp + rsp_length, "LMB" LIBMODBUS_VERSION_STRING, str_len);
+    rsp_length += str_len;
+    rsp[byte_count_pos] = rsp_length - byte_count_pos - 1;
 
-    offset = ctx->backend->header_length;
-    slave = req[offset - 1];
-    function = req[offset];
+    return rsp_length;
+}
 
-    sft.slave = slave;
-    sft.function = function + 0x80;;
-    sft.t_id = ctx->backend->prepare_response_tid(req, &dummy_length);
-    rsp_length = ctx->backend->build_response_basis(&sft, rsp);
+static int reply_report_slave_id(_reply_t *r)
+{
+    modbus_t *ctx = r->ctx;
 
-    /* Positive exception code */
-    if (exception_code < MODBUS_EXCEPTION_MAX) {
-        rsp[rsp_length++] = exception_code;
-        return send_msg(ctx, rsp, rsp_length);
-    } else {
-        errno = EINVAL;
-        return -1;
+#if MODBUS_FIXED_RESPONSES
+    if (r->sft.slave == ctx->fixed.slave) {
+        memcpy(r->rsp, ctx->fixed.report_slave_id, ctx->fixed.report_slave_id_length);
+        r->complete = TRUE;
+        return ctx->fixed.report_slave_id_length;
+    }
+#endif
+
+    return build_report_slave_id(ctx, &r->sft, r->rsp);
+}
+#endif
+
+#if _MODBUS_SERVER_HAS(MODBUS_FC_READ_EXCEPTION_STATUS)
+/* Read exception status (0x07) */
+static int reply_read_exception_status(_reply_t *r)
+{
+    modbus_t *ctx = r->ctx;
+
+    if (ctx->debug) {
+        fprintf(stderr, "FIXME Not implemented\n");
+    }
+    errno = ENOPROTOOPT;
+    return -1;
+}
+#endif
+
+#if _MODBUS_SERVER_HAS(MODBUS_FC_MASK_WRITE_REGISTER)
+/* Mask write register (0x16) */
+static int reply_mask_write_register(_reply_t *r)
+{
+    modbus_t *ctx = r->ctx;
+    const uint8_t *req = r->req;
+    int req_length = r->req_length;
+    int offset = r->offset;
+    uint16_t address = r->address;
+    modbus_mapping_t *mb_mapping = r->mb_mapping;
+    uint8_t *rsp = r->rsp;
+    int rsp_length;
+    int mapping_address;
+    uint16_t *tab_registers = (uint16_t *)modbus_mapping_lookup(
+        mb_mapping, MODBUS_TABLE_REGISTERS, address, 1, &mapping_address);
+
+    if (tab_registers == NULL) {
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
+            "Illegal data address 0x%0X in write_register\n",
+            address);
+    } else {
+        int is_wire = mb_mapping->flags & MODBUS_MAPPING_WIRE_REGISTERS;
+        uint16_t data = is_wire ? MODBUS_GET_WIRE_REGISTER(tab_registers, mapping_address)
+                                : tab_registers[mapping_address];
+        uint16_t and = (req[offset + 3] << 8) + req[offset + 4];
+        uint16_t or = (req[offset + 5] << 8) + req[offset + 6];
+
+        data = (data & and) | (or & (~and));
+        if (is_wire) {
+            MODBUS_SET_WIRE_REGISTER(tab_registers, mapping_address, data);
+        } else {
+            tab_registers[mapping_address] = data;
+        }
+        r->write_address = address;
+        r->write_nb = 1;
+        memcpy(rsp, req, req_length);
+        rsp_length = req_length;
+    }
+
+    return rsp_length;
+}
+#endif
+
+#if _MODBUS_SERVER_HAS(MODBUS_FC_WRITE_AND_READ_REGISTERS)
+/* Write and read registers (0x17) */
+static int reply_write_and_read_registers(_reply_t *r)
+{
+    modbus_t *ctx = r->ctx;
+    const uint8_t *req = r->req;
+    int offset = r->offset;
+    uint16_t address = r->address;
+    modbus_mapping_t *mb_mapping = r->mb_mapping;
+    uint8_t *rsp = r->rsp;
+    int rsp_length;
+    int nb = (req[offset + 3] << 8) + req[offset + 4];
+    uint16_t address_write = (req[offset + 5] << 8) + req[offset + 6];
+    int nb_write = (req[offset + 7] << 8) + req[offset + 8];
+    int nb_write_bytes = req[offset + 9];
+    int mapping_address;
+    int mapping_address_write;
+    uint16_t *tab_registers = (uint16_t *)modbus_mapping_lookup(
+        mb_mapping, MODBUS_TABLE_REGISTERS, address, nb, &mapping_address);
+    uint16_t *tab_registers_write = (uint16_t *)modbus_mapping_lookup(
+        mb_mapping, MODBUS_TABLE_REGISTERS, address_write, nb_write, &mapping_address_write);
+
+    if (nb_write < 1 || MODBUS_MAX_WR_WRITE_REGISTERS < nb_write ||
+        nb < 1 || MODBUS_MAX_WR_READ_REGISTERS < nb ||
+        nb_write_bytes != nb_write * 2) {
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, TRUE,
+            "Illegal nb of values (W%d, R%d) in write_and_read_registers (max W%d, R%d)\n",
+            nb_write, nb, MODBUS_MAX_WR_WRITE_REGISTERS, MODBUS_MAX_WR_READ_REGISTERS);
+    } else if (tab_registers == NULL || tab_registers_write == NULL) {
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, FALSE,
+            "Illegal data read address 0x%0X or write address 0x%0X write_and_read_registers\n",
+            address, address_write);
+    } else if (mapping_read(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb) == -1) {
+        /* The read handlers run before the write, which is only done when
+           the response can be sent */
+        rsp_length = response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE, rsp, FALSE,
+            "Read handler failed at address 0x%0X (nb %d) in write_and_read_registers\n",
+            address, nb);
+    } else {
+        int is_wire = mb_mapping->flags & MODBUS_MAPPING_WIRE_REGISTERS;
+        int basis_length = ctx->backend->build_response_basis(&r->sft, rsp);
+        int tries = 0;
+        modbus_seq_t seq;
+        int i, j;
+
+        /* The values read are copied first, so an update in progress is
+           answered with a busy exception before anything is written */
+        rsp[basis_length++] = nb << 1;
+        do {
+            seq = mapping_read_begin(mb_mapping);
+            rsp_length = response_registers(tab_registers, mapping_address, nb,
+                                            is_wire, rsp, basis_length);
+        } while (mapping_read_retry(mb_mapping, seq) &&
+                 ++tries < MODBUS_SEQLOCK_MAX_RETRIES);
+
+        if (tries == MODBUS_SEQLOCK_MAX_RETRIES) {
+            rsp_length = response_exception(
+                ctx, &r->sft, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY, rsp, FALSE,
+                "Update in progress at address 0x%0X (nb %d) in write_and_read_registers\n",
+                address, nb);
+        } else {
+            /* 10 and 11 are the offset of the first values to write */
+            if (is_wire) {
+                memcpy(tab_registers_write + mapping_address_write, req + offset + 10,
+                       nb_write << 1);
+            } else {
+                for (i = mapping_address_write, j = 10;
+                     i < mapping_address_write + nb_write; i++, j += 2) {
+                    tab_registers_write[i] =
+                        (req[offset + j] << 8) + req[offset + j + 1];
+                }
+            }
+            r->write_address = address_write;
+            r->write_nb = nb_write;
+
+            /* The response reads the values written where the ranges overlap */
+            if (tab_registers == tab_registers_write) {
+                int first = mapping_address > mapping_address_write ?
+                    mapping_address : mapping_address_write;
+                int last = mapping_address + nb < mapping_address_write + nb_write ?
+                    mapping_address + nb : mapping_address_write + nb_write;
+
+                if (first < last) {
+                    memcpy(rsp + basis_length + ((first - mapping_address) << 1),
+                           req + offset + 10 + ((first - mapping_address_write) << 1),
+                           (last - first) << 1);
+                }
+            }
+        }
+    }
+
+    return rsp_length;
+}
+#endif
+
+#if _MODBUS_SERVER_HAS(MODBUS_FC_READ_COILS)
+#define _REPLY_0x01 reply_read_bits
+#else
+#define _REPLY_0x01 NULL
+#endif
+#if _MODBUS_SERVER_HAS(MODBUS_FC_READ_DISCRETE_INPUTS)
+#define _REPLY_0x02 reply_read_bits
+#else
+#define _REPLY_0x02 NULL
+#endif
+#if _MODBUS_SERVER_HAS(MODBUS_FC_READ_HOLDING_REGISTERS)
+#define _REPLY_0x03 reply_read_registers
+#else
+#define _REPLY_0x03 NULL
+#endif
+#if _MODBUS_SERVER_HAS(MODBUS_FC_READ_INPUT_REGISTERS)
+#define _REPLY_0x04 reply_read_registers
+#else
+#define _REPLY_0x04 NULL
+#endif
+#if _MODBUS_SERVER_HAS(MODBUS_FC_WRITE_SINGLE_COIL)
+#define _REPLY_0x05 reply_write_bit
+#else
+#define _REPLY_0x05 NULL
+#endif
+#if _MODBUS_SERVER_HAS(MODBUS_FC_WRITE_SINGLE_REGISTER)
+#define _REPLY_0x06 reply_write_register
+#else
+#define _REPLY_0x06 NULL
+#endif
+#if _MODBUS_SERVER_HAS(MODBUS_FC_READ_EXCEPTION_STATUS)
+#define _REPLY_0x07 reply_read_exception_status
+#else
+#define _REPLY_0x07 NULL
+#endif
+#if _MODBUS_SERVER_HAS(MODBUS_FC_WRITE_MULTIPLE_COILS)
+#define _REPLY_0x0F reply_write_bits
+#else
+#define _REPLY_0x0F NULL
+#endif
+#if _MODBUS_SERVER_HAS(MODBUS_FC_WRITE_MULTIPLE_REGISTERS)
+#define _REPLY_0x10 reply_write_registers
+#else
+#define _REPLY_0x10 NULL
+#endif
+#if _MODBUS_SERVER_HAS(MODBUS_FC_REPORT_SLAVE_ID)
+#define _REPLY_0x11 reply_report_slave_id
+#else
+#define _REPLY_0x11 NULL
+#endif
+#if _MODBUS_SERVER_HAS(MODBUS_FC_MASK_WRITE_REGISTER)
+#define _REPLY_0x16 reply_mask_write_register
+#else
+#define _REPLY_0x16 NULL
+#endif
+#if _MODBUS_SERVER_HAS(MODBUS_FC_WRITE_AND_READ_REGISTERS)
+#define _REPLY_0x17 reply_write_and_read_registers
+#else
+#define _REPLY_0x17 NULL
+#endif
+
+/* Handlers of the standard function codes, indexed by function code */
+static const _reply_handler_t _reply_handlers[MODBUS_FC_WRITE_AND_READ_REGISTERS + 1] PROGMEM = {
+    NULL,         /* 0x00 */
+    _REPLY_0x01,  /* 0x01 */
+    _REPLY_0x02,  /* 0x02 */
+    _REPLY_0x03,  /* 0x03 */
+    _REPLY_0x04,  /* 0x04 */
+    _REPLY_0x05,  /* 0x05 */
+    _REPLY_0x06,  /* 0x06 */
+    _REPLY_0x07,  /* 0x07 */
+    NULL,         /* 0x08 */
+    NULL,         /* 0x09 */
+    NULL,         /* 0x0A */
+    NULL,         /* 0x0B */
+    NULL,         /* 0x0C */
+    NULL,         /* 0x0D */
+    NULL,         /* 0x0E */
+    _REPLY_0x0F,  /* 0x0F */
+    _REPLY_0x10,  /* 0x10 */
+    _REPLY_0x11,  /* 0x11 */
+    NULL,         /* 0x12 */
+    NULL,         /* 0x13 */
+    NULL,         /* 0x14 */
+    NULL,         /* 0x15 */
+    _REPLY_0x16,  /* 0x16 */
+    _REPLY_0x17,  /* 0x17 */
+};
+
+/* Index of a user defined function code in ctx->user_functions */
+static int user_function_index(int function)
+{
+    return (function <= 0x48) ? function - 0x41 : function - 0x64 + 8;
+}
+
+/* Returns the handler registered for a user defined function code, or NULL */
+static const _modbus_user_function_t *user_function(modbus_t *ctx, int function)
+{
+    const _modbus_user_function_t *user;
+
+    if (ctx->user_functions == NULL || !MODBUS_IS_USER_FUNCTION(function)) {
+        return NULL;
+    }
+
+    user = &ctx->user_functions[user_function_index(function)];
+
+    return user->handler != NULL ? user : NULL;
+}
+
+/* User defined function codes */
+static int reply_user_function(_reply_t *r, const _modbus_user_function_t *user)
+{
+    modbus_t *ctx = r->ctx;
+    int rsp_length = ctx->backend->build_response_basis(&r->sft, r->rsp);
+    int rsp_max_length;
+    int rc;
+
+    /* Both the ADU of the backend and the PDU, less its function code, must
+       hold the data of the response */
+    rsp_max_length = ctx->backend->max_adu_length - rsp_length - ctx->backend->checksum_length;
+    if (rsp_max_length > MODBUS_MAX_PDU_LENGTH - 1) {
+        rsp_max_length = MODBUS_MAX_PDU_LENGTH - 1;
+    }
+
+    /* The handler gets the data after the function code, req_length doesn't
+       include the checksum anymore */
+    rc = user->handler(user->data, r->req + r->offset + 1, r->req_length - r->offset - 1,
+                       r->rsp + rsp_length, rsp_max_length);
+    if (rc > rsp_max_length || rc < -0xFF) {
+        return response_exception(
+            ctx, &r->sft, MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE, r->rsp, FALSE,
+            "Invalid result %d of the handler of function 0x%0X\n", rc, r->sft.function);
+    } else if (rc < 0) {
+        return response_exception(
+            ctx, &r->sft, -rc, r->rsp, FALSE,
+            "Exception 0x%0X in function 0x%0X\n", -rc, r->sft.function);
+    }
+
+    return rsp_length + rc;
+}
+
+/* Answers the request from the tables of mb_mapping, the frame sent is left
+   in rsp (MAX_MESSAGE_LENGTH bytes) */
+static int reply_mapping(modbus_t *ctx, const uint8_t *req,
+                         int req_length, modbus_mapping_t *mb_mapping,
+                         uint8_t *rsp)
+{
+    int rsp_length = 0;
+    int function;
+    _reply_t r;
+    _reply_handler_t handler = NULL;
+    const _modbus_user_function_t *user;
+    int rc;
+
+    r.ctx = ctx;
+    r.req = req;
+    r.offset = ctx->backend->header_length;
+    r.mb_mapping = mb_mapping;
+    r.rsp = rsp;
+    r.write_table = MODBUS_TABLE_REGISTERS;
+    r.write_address = 0;
+    r.write_nb = 0;
+    r.complete = FALSE;
+
+    function = req[r.offset];
+    r.address = (req[r.offset + 1] << 8) + req[r.offset + 2];
+
+    r.sft.slave = req[r.offset - 1];
+    r.sft.function = function;
+    r.sft.t_id = ctx->backend->prepare_response_tid(req, &req_length);
+    r.req_length = req_length;
+
+    if (function <= MODBUS_FC_WRITE_AND_READ_REGISTERS) {
+#if defined(__AVR__)
+        handler = (_reply_handler_t)pgm_read_word(&_reply_handlers[function]);
+#else
+        handler = _reply_handlers[function];
+#endif
+    }
+
+    /* Data are flushed on illegal number of values errors. */
+    if (handler != NULL) {
+        rsp_length = handler(&r);
+        if (rsp_length == -1) {
+            return -1;
+        }
+    } else if ((user = user_function(ctx, function)) != NULL) {
+        rsp_length = reply_user_function(&r, user);
+    } else {
+        rsp_length = response_exception(
+            ctx, &r.sft, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, rsp, TRUE,
+            "Unknown Modbus function code: 0x%0X\n", function);
+    }
+
+    /* Suppress any responses when the request was a broadcast */
+    if (_modbus_is_broadcast(ctx, r.sft.slave)) {
+        rc = 0;
+    } else if (r.complete) {
+        rc = ctx->backend->send_frame(ctx, req, rsp, rsp_length);
+    } else {
+        rc = send_response(ctx, req, rsp, rsp_length);
+    }
+
+    /* The application is told about the write once the response is on its
+       way, so its handling doesn't delay the master */
+    if (r.write_nb > 0) {
+        mb_mapping->generation = mb_mapping->generation + 1;
+        modbus_mapping_set_dirty(mb_mapping, r.write_table, r.write_address, r.write_nb);
+        if (mb_mapping->write_cb != NULL) {
+            mb_mapping->write_cb(mb_mapping->write_cb_data, r.write_table, r.write_address, r.write_nb);
+        }
+    }
+
+    return rc;
+}
+
+/* Returns the cache entry of a read request: holding its response when
+   rsp_length isn't 0, to store it otherwise. NULL if the response isn't
+   cached, because the request isn't a read or reads values computed by a
+   read handler. */
+static _modbus_cached_response_t *cached_response(modbus_t *ctx, const uint8_t *req,
+                                                  modbus_mapping_t *mb_mapping)
+{
+    const int offset = ctx->backend->header_length;
+    _modbus_cached_response_t *entry;
+    int function = req[offset];
+    int address = (req[offset + 1] << 8) + req[offset + 2];
+    int nb = (req[offset + 3] << 8) + req[offset + 4];
+    int table;
+    int i;
+
+    switch (function) {
+    case MODBUS_FC_READ_COILS:
+        table = MODBUS_TABLE_BITS;
+        break;
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+        table = MODBUS_TABLE_INPUT_BITS;
+        break;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+        table = MODBUS_TABLE_REGISTERS;
+        break;
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+        table = MODBUS_TABLE_INPUT_REGISTERS;
+        break;
+    default:
+        return NULL;
+    }
+
+    if (_modbus_is_broadcast(ctx, req[offset - 1])) {
+        return NULL;
+    }
+
+    for (i = 0; i < mb_mapping->nb_read_handlers; i++) {
+        const modbus_read_handler_t *handler = &mb_mapping->read_handlers[i];
+
+        if (handler->table == table && address < handler->start + handler->nb &&
+            handler->start < address + nb) {
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < ctx->nb_responses; i++) {
+        entry = &ctx->responses[i];
+        if (entry->rsp_length > 0 && entry->mapping == mb_mapping &&
+            entry->slave == req[offset - 1] && entry->function == function &&
+            entry->address == address && entry->nb == nb) {
+            if (entry->generation != mb_mapping->generation) {
+                entry->rsp_length = 0;
+            }
+            return entry;
+        }
+    }
+
+    /* Round robin replacement */
+    entry = &ctx->responses[ctx->next_response];
+    ctx->next_response = (ctx->next_response + 1) % ctx->nb_responses;
+    entry->mapping = mb_mapping;
+    entry->slave = req[offset - 1];
+    entry->function = function;
+    entry->address = address;
+    entry->nb = nb;
+    entry->rsp_length = 0;
+
+    return entry;
+}
+
+/* Tells whether the requests of a function code write the tables, the only
+   ones replayed to a retry: reads are executed again for fresh values */
+static int is_write_function(int function)
+{
+    switch (function) {
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* FNV-1a hash of a request, to recognise its retries */
+static uint32_t hash_request(const uint8_t *req, int req_length)
+{
+    uint32_t hash = 2166136261UL;
+    int i;
+
+    for (i = 0; i < req_length; i++) {
+        hash = (hash ^ req[i]) * 16777619UL;
+    }
+
+    return hash;
+}
+
+/* Send a response to the received request.
+   Analyses the request and constructs a response.
+
+   If an error occurs, this function construct the response
+   accordingly.
+
+   Requests to a unit added with modbus_add_unit() are answered from its
+   mapping instead of mb_mapping, broadcasts are applied to all of them.
+   With a retry window (modbus_set_retry_window()), a write request identical
+   to the previous one from the same client gets the same response frame
+   again without being executed.
+*/
+int modbus_reply(modbus_t *ctx, const uint8_t *req,
+                 int req_length, modbus_mapping_t *mb_mapping)
+{
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    const uint8_t *frame = rsp;
+    _modbus_units_t *units;
+    _modbus_retry_t *retry;
+    _modbus_cached_response_t *cached = NULL;
+    int slave;
+    int rc;
+    int i;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    slave = req[ctx->backend->header_length - 1];
+
+    retry = ctx->retry;
+    if (retry != NULL && !_modbus_is_broadcast(ctx, slave)) {
+        if (!is_write_function(req[ctx->backend->header_length])) {
+            /* Ends the retries of the previous request from the same client */
+            if (retry->s == ctx->s) {
+                retry->rsp_length = 0;
+            }
+            retry = NULL;
+        } else {
+            uint32_t hash = hash_request(req, req_length);
+
+            if (retry->rsp_length > 0 && retry->s == ctx->s &&
+                retry->req_length == req_length && retry->req_hash == hash &&
+                (uint32_t)(millis() - retry->rsp_ms) < retry->window_ms) {
+                if (ctx->debug) {
+                    printf("Retry answered with the previous response\n");
+                }
+                return ctx->backend->send_frame(ctx, req, retry->rsp, retry->rsp_length);
+            }
+
+            retry->s = ctx->s;
+            retry->req_hash = hash;
+            retry->req_length = req_length;
+            retry->rsp_length = 0;
+        }
+    }
+
+    units = ctx->units;
+    if (units != NULL && units->nb > 0) {
+        if (_modbus_is_broadcast(ctx, slave)) {
+            /* Nothing is sent back, only the writes matter */
+            for (i = 0; i < units->nb; i++) {
+                if (units->mappings[i] != mb_mapping) {
+                    reply_mapping(ctx, req, req_length, units->mappings[i], rsp);
+                }
+            }
+        } else if (units->index[slave] != 0) {
+            mb_mapping = units->mappings[units->index[slave] - 1];
+        }
+    }
+
+    if (ctx->responses != NULL) {
+        cached = cached_response(ctx, req, mb_mapping);
+    }
+
+    if (cached != NULL && cached->rsp_length > 0) {
+        if (ctx->debug) {
+            printf("Answered from the response cache\n");
+        }
+        rc = ctx->backend->send_frame(ctx, req, cached->rsp, cached->rsp_length);
+        frame = cached->rsp;
+    } else {
+        if (cached != NULL) {
+            /* Values written while the response is built change it */
+            cached->generation = mb_mapping->generation;
+        }
+        rc = reply_mapping(ctx, req, req_length, mb_mapping, rsp);
+        if (cached != NULL && rc > 0 &&
+            rsp[ctx->backend->header_length] == cached->function) {
+            memcpy(cached->rsp, rsp, rc);
+            cached->rsp_length = rc;
+        }
+    }
+
+    if (retry != NULL && rc > 0) {
+        /* The frame sent, checksum included, for a retry of the request */
+        memcpy(retry->rsp, frame, rc);
+        retry->rsp_length = rc;
+        retry->rsp_ms = millis();
+    }
+
+    return rc;
+}
+
+/* Answers the requests to slave from the tables of mb_mapping, in addition to
+   those to the slave address of the context, NULL to stop answering them.
+   The mapping stays owned by the caller. One modbus_receive() and
+   modbus_reply() then serve all the units, in RTU the frames to other
+   addresses are skipped before their CRC is computed. */
+int modbus_add_unit(modbus_t *ctx, int slave, modbus_mapping_t *mb_mapping)
+{
+    _modbus_units_t *units;
+    int i;
+    int j;
+
+    if (ctx == NULL || slave < 1 || slave > 247) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    units = ctx->units;
+    if (units == NULL) {
+        if (mb_mapping == NULL) {
+            return 0;
+        }
+
+        units = (_modbus_units_t *)calloc(1, sizeof(_modbus_units_t));
+        if (units == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ctx->units = units;
+    }
+
+    i = units->index[slave];
+    if (mb_mapping != NULL) {
+        if (i == 0) {
+            if (units->nb == MODBUS_MAX_UNITS) {
+                errno = ENOMEM;
+                return -1;
+            }
+            i = ++units->nb;
+            units->index[slave] = i;
+        }
+        units->mappings[i - 1] = mb_mapping;
+    } else if (i != 0) {
+        units->index[slave] = 0;
+        units->nb--;
+        if (i - 1 != units->nb) {
+            /* Move the last unit into the free position */
+            units->mappings[i - 1] = units->mappings[units->nb];
+            for (j = 0; j < 256; j++) {
+                if (units->index[j] == units->nb + 1) {
+                    units->index[j] = i;
+                    break;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Returns the mapping of a unit added with modbus_add_unit(), or NULL */
+modbus_mapping_t* modbus_get_unit(modbus_t *ctx, int slave)
+{
+    if (ctx == NULL || ctx->units == NULL || slave < 0 || slave > 255 ||
+        ctx->units->index[slave] == 0) {
+        return NULL;
+    }
+
+    return ctx->units->mappings[ctx->units->index[slave] - 1];
+}
+
+/* Registers the handler of a user defined function code (0x41 to 0x48 or 0x64
+   to 0x6E), NULL to unregister it.
+   meta_length is the number of request bytes following the function code
+   when byte_count is FALSE. Otherwise the last of these bytes counts the data
+   bytes that follow it, as in the write multiple registers request. */
+int modbus_register_function(modbus_t *ctx, int function,
+                             modbus_function_handler_t handler, void *data,
+                             int meta_length, int byte_count)
+{
+    _modbus_user_function_t *user;
+
+    if (ctx == NULL || !MODBUS_IS_USER_FUNCTION(function) ||
+        meta_length < 0 || meta_length > MODBUS_MAX_PDU_LENGTH - 1 ||
+        (byte_count && meta_length < 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->user_functions == NULL) {
+        if (handler == NULL) {
+            return 0;
+        }
+
+        ctx->user_functions = (_modbus_user_function_t *)calloc(
+            _MODBUS_USER_FUNCTIONS, sizeof(_modbus_user_function_t));
+        if (ctx->user_functions == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    user = &ctx->user_functions[user_function_index(function)];
+    user->handler = handler;
+    user->data = data;
+    user->meta_length = meta_length;
+    user->byte_count = byte_count ? 1 : 0;
+
+    return 0;
+}
+
+int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
+                           unsigned int exception_code)
+{
+    int offset;
+    int slave;
+    int function;
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    int rsp_length;
+    int dummy_length = 99;
+    sft_t sft;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    offset = ctx->backend->header_length;
+    slave = req[offset - 1];
+    function = req[offset];
+
+    sft.slave = slave;
+    sft.function = function + 0x80;;
+    sft.t_id = ctx->backend->prepare_response_tid(req, &dummy_length);
+    rsp_length = ctx->backend->build_response_basis(&sft, rsp);
+
+    /* Positive exception code */
+    if (exception_code < MODBUS_EXCEPTION_MAX) {
+        rsp[rsp_length++] = exception_code;
+        return send_response(ctx, req, rsp, rsp_length);
+    } else {
+        errno = EINVAL;
+        return -1;
     }
 }
 
@@ -1589,23 +2511,88 @@ void _modbus_init_common(modbus_t *ctx)
 
     ctx->debug = FALSE;
     ctx->error_recovery = MODBUS_ERROR_RECOVERY_NONE;
+    ctx->flush_mode = MODBUS_FLUSH_T35;
 
     ctx->response_timeout.tv_sec = 0;
     ctx->response_timeout.tv_usec = _RESPONSE_TIMEOUT;
 
     ctx->byte_timeout.tv_sec = 0;
     ctx->byte_timeout.tv_usec = _BYTE_TIMEOUT;
+
+    ctx->user_functions = NULL;
+    ctx->units = NULL;
+    ctx->retry = NULL;
+    ctx->responses = NULL;
+    ctx->nb_responses = 0;
+    ctx->next_response = 0;
+#if MODBUS_FIXED_RESPONSES
+    ctx->fixed.slave = -1;
+#endif
 }
 
-/* Define the slave number */
+#if MODBUS_FIXED_RESPONSES
+/* Builds the responses that only depend on the slave address of the context,
+   so they are sent without computing their checksum again */
+static void prepare_fixed_responses(modbus_t *ctx)
+{
+    _modbus_fixed_t *fixed = &ctx->fixed;
+    uint8_t rsp[_MIN_REQ_LENGTH];
+    int rsp_length;
+    int function;
+    int code;
+    sft_t sft;
+
+    fixed->slave = -1;
+    /* The frames are sized for the RTU header and CRC */
+    if (ctx->backend->complete_frame == NULL ||
+        ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        return;
+    }
+
+    sft.slave = ctx->slave;
+    sft.t_id = 0;
+    for (function = 0; function < _MODBUS_FIXED_FUNCTIONS; function++) {
+        sft.function = function + 0x80;
+        for (code = 1; code <= _MODBUS_FIXED_EXCEPTIONS; code++) {
+            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
+            rsp[rsp_length++] = code;
+            ctx->backend->complete_frame(rsp, rsp_length);
+            memcpy(fixed->exception_checksums[function][code - 1], rsp + rsp_length,
+                   _MODBUS_FIXED_CHECKSUM_LENGTH);
+        }
+    }
+
+    fixed->report_slave_id_length = 0;
+#if _MODBUS_SERVER_HAS(MODBUS_FC_REPORT_SLAVE_ID)
+    sft.function = MODBUS_FC_REPORT_SLAVE_ID;
+    rsp_length = build_report_slave_id(ctx, &sft, fixed->report_slave_id);
+    fixed->report_slave_id_length = ctx->backend->complete_frame(fixed->report_slave_id,
+                                                                 rsp_length);
+#endif
+
+    fixed->slave = ctx->slave;
+}
+#endif
+
+/* Define the slave number. The exception and report slave ID responses of
+   the address are built here, see MODBUS_FIXED_RESPONSES. */
 int modbus_set_slave(modbus_t *ctx, int slave)
 {
+    int rc;
+
     if (ctx == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    return ctx->backend->set_slave(ctx, slave);
+    rc = ctx->backend->set_slave(ctx, slave);
+#if MODBUS_FIXED_RESPONSES
+    if (rc == 0) {
+        prepare_fixed_responses(ctx);
+    }
+#endif
+
+    return rc;
 }
 
 int modbus_set_error_recovery(modbus_t *ctx,
@@ -1616,8 +2603,95 @@ int modbus_set_error_recovery(modbus_t *ctx,
         return -1;
     }
 
-    /* The type of modbus_error_recovery_mode is unsigned enum */
-    ctx->error_recovery = (uint8_t) error_recovery;
+    /* The type of modbus_error_recovery_mode is unsigned enum */
+    ctx->error_recovery = (uint8_t) error_recovery;
+    return 0;
+}
+
+/* Selects how the input is discarded after a malformed message (illegal
+   quantity or unknown function code in a request, unexpected response with
+   MODBUS_ERROR_RECOVERY_PROTOCOL). MODBUS_FLUSH_T35, the default, lets the
+   answer go out as soon as the frame is over, MODBUS_FLUSH_TIMEOUT keeps the
+   line quiet for the whole response timeout. */
+int modbus_set_flush_mode(modbus_t *ctx, modbus_flush_mode flush_mode)
+{
+    if (ctx == NULL ||
+        (flush_mode != MODBUS_FLUSH_T35 && flush_mode != MODBUS_FLUSH_TIMEOUT)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->flush_mode = flush_mode;
+    return 0;
+}
+
+/* Answers a write request (function codes 5, 6, 15, 16, 22 and 23)
+   identical to the previous one from the same client, received less than
+   window_ms milliseconds after its response, by sending that response frame
+   again instead of executing the request twice, as masters retrying after a
+   lost response expect. Reads are always executed. 0 (the default) executes
+   every request. The window must be shorter than the interval between
+   identical writes the master wants executed. */
+int modbus_set_retry_window(modbus_t *ctx, uint32_t window_ms)
+{
+    if (ctx == NULL || (window_ms > 0 && ctx->backend->send_frame == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (window_ms == 0) {
+        free(ctx->retry);
+        ctx->retry = NULL;
+        return 0;
+    }
+
+    if (ctx->retry == NULL) {
+        ctx->retry = (_modbus_retry_t *)malloc(sizeof(_modbus_retry_t));
+        if (ctx->retry == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ctx->retry->s = -1;
+        ctx->retry->req_length = 0;
+        ctx->retry->rsp_length = 0;
+    }
+    ctx->retry->window_ms = window_ms;
+
+    return 0;
+}
+
+/* Keeps the response frames to the last nb_entries different read requests
+   (function codes 1 to 4, same slave, address and quantity), sent again as
+   long as the tables they were read from don't change. Every write done by
+   modbus_reply() or the server accessors counts as a change, values written
+   to the tables directly must be followed by modbus_mapping_touch(). Ranges
+   with a read handler are never cached. 0 (the default) disables the cache.
+
+   The function shall return 0 if successful. Otherwise it shall return -1
+   and set errno to EINVAL or ENOMEM. */
+int modbus_set_response_cache(modbus_t *ctx, int nb_entries)
+{
+    if (ctx == NULL || nb_entries < 0 || nb_entries > MODBUS_MAX_CACHED_RESPONSES ||
+        (nb_entries > 0 && ctx->backend->send_frame == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    free(ctx->responses);
+    ctx->responses = NULL;
+    ctx->nb_responses = 0;
+    ctx->next_response = 0;
+
+    if (nb_entries > 0) {
+        ctx->responses = (_modbus_cached_response_t *)calloc(
+            nb_entries, sizeof(_modbus_cached_response_t));
+        if (ctx->responses == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ctx->nb_responses = nb_entries;
+    }
+
     return 0;
 }
 
@@ -1727,6 +2801,14 @@ void modbus_free(modbus_t *ctx)
     if (ctx == NULL)
         return;
 
+    free(ctx->user_functions);
+    ctx->user_functions = NULL;
+    free(ctx->units);
+    ctx->units = NULL;
+    free(ctx->retry);
+    ctx->retry = NULL;
+    free(ctx->responses);
+    ctx->responses = NULL;
     ctx->backend->free(ctx);
 }
 
@@ -1760,6 +2842,17 @@ modbus_mapping_t* modbus_mapping_new_start_address(
         return NULL;
     }
 
+    mb_mapping->flags = 0;
+    mb_mapping->write_cb = NULL;
+    mb_mapping->write_cb_data = NULL;
+    mb_mapping->read_handlers = NULL;
+    mb_mapping->nb_read_handlers = 0;
+    mb_mapping->seq = 0;
+    mb_mapping->generation = 0;
+    memset(mb_mapping->dirty, 0, sizeof(mb_mapping->dirty));
+    memset(mb_mapping->segments, 0, sizeof(mb_mapping->segments));
+    memset(mb_mapping->nb_segments, 0, sizeof(mb_mapping->nb_segments));
+
     /* 0X */
     mb_mapping->nb_bits = nb_bits;
     mb_mapping->start_bits = start_bits;
@@ -1838,6 +2931,72 @@ modbus_mapping_t* modbus_mapping_new(int nb_bits, int nb_input_bits,
         0, nb_bits, 0, nb_input_bits, 0, nb_registers, 0, nb_input_registers);
 }
 
+static void dirty_resize(modbus_mapping_t *mb_mapping, int table);
+
+/* Carves the 4 tables of an existing mapping out of a single block.
+
+   The registers come first so the tables hit by most requests are adjacent,
+   each table starting on a MODBUS_ARENA_ALIGNMENT boundary. The tables are
+   laid out according to mb_mapping->flags and set to zero. The arena stays
+   owned by the caller: modbus_mapping_free() must not be used on a mapping
+   initialized this way. An arena which isn't aligned needs up to
+   MODBUS_ARENA_ALIGNMENT - 1 bytes more than MODBUS_MAPPING_ARENA_SIZE().
+
+   The function shall return 0 if successful. Otherwise it shall return -1 and
+   set errno to EINVAL. */
+int modbus_mapping_init_arena(
+    modbus_mapping_t *mb_mapping, void *arena, size_t size,
+    unsigned int start_bits, unsigned int nb_bits,
+    unsigned int start_input_bits, unsigned int nb_input_bits,
+    unsigned int start_registers, unsigned int nb_registers,
+    unsigned int start_input_registers, unsigned int nb_input_registers)
+{
+    uint8_t *p;
+    size_t pad;
+    size_t needed;
+
+    if (mb_mapping == NULL || arena == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pad = MODBUS_ARENA_ALIGN((uintptr_t)arena) - (uintptr_t)arena;
+    needed = MODBUS_MAPPING_ARENA_SIZE(mb_mapping->flags, nb_bits, nb_input_bits,
+                                       nb_registers, nb_input_registers);
+    if (size < pad + needed) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    p = (uint8_t *)arena + pad;
+    memset(p, 0, needed);
+
+    mb_mapping->start_registers = start_registers;
+    mb_mapping->nb_registers = nb_registers;
+    mb_mapping->tab_registers = nb_registers == 0 ? NULL : (uint16_t *)p;
+    p += MODBUS_ARENA_ALIGN((size_t)nb_registers * 2);
+
+    mb_mapping->start_input_registers = start_input_registers;
+    mb_mapping->nb_input_registers = nb_input_registers;
+    mb_mapping->tab_input_registers = nb_input_registers == 0 ? NULL : (uint16_t *)p;
+    p += MODBUS_ARENA_ALIGN((size_t)nb_input_registers * 2);
+
+    mb_mapping->start_bits = start_bits;
+    mb_mapping->nb_bits = nb_bits;
+    mb_mapping->tab_bits = nb_bits == 0 ? NULL : p;
+    p += MODBUS_ARENA_ALIGN((size_t)((mb_mapping->flags & MODBUS_MAPPING_PACKED_BITS) ?
+                                     MODBUS_PACKED_BITS_SIZE(nb_bits) : nb_bits));
+
+    mb_mapping->start_input_bits = start_input_bits;
+    mb_mapping->nb_input_bits = nb_input_bits;
+    mb_mapping->tab_input_bits = nb_input_bits == 0 ? NULL : p;
+    mb_mapping->generation = mb_mapping->generation + 1;
+    dirty_resize(mb_mapping, MODBUS_TABLE_BITS);
+    dirty_resize(mb_mapping, MODBUS_TABLE_REGISTERS);
+
+    return 0;
+}
+
 /* Frees the 4 arrays */
 void modbus_mapping_free(modbus_mapping_t *mb_mapping)
 {
@@ -1845,6 +3004,10 @@ void modbus_mapping_free(modbus_mapping_t *mb_mapping)
         return;
     }
 
+    modbus_mapping_set_dirty_tracking(mb_mapping, MODBUS_TABLE_BITS, -1);
+    modbus_mapping_set_dirty_tracking(mb_mapping, MODBUS_TABLE_REGISTERS, -1);
+    modbus_mapping_free_segments(mb_mapping);
+    modbus_mapping_free_read_handlers(mb_mapping);
     free(mb_mapping->tab_input_registers);
     free(mb_mapping->tab_registers);
     free(mb_mapping->tab_input_bits);
@@ -1852,6 +3015,619 @@ void modbus_mapping_free(modbus_mapping_t *mb_mapping)
     free(mb_mapping);
 }
 
+/* Returns the contiguous window of a table */
+static void *mapping_window(const modbus_mapping_t *mb_mapping, int table,
+                            int *start, int *nb)
+{
+    switch (table) {
+    case MODBUS_TABLE_BITS:
+        *start = mb_mapping->start_bits;
+        *nb = mb_mapping->nb_bits;
+        return mb_mapping->tab_bits;
+    case MODBUS_TABLE_INPUT_BITS:
+        *start = mb_mapping->start_input_bits;
+        *nb = mb_mapping->nb_input_bits;
+        return mb_mapping->tab_input_bits;
+    case MODBUS_TABLE_REGISTERS:
+        *start = mb_mapping->start_registers;
+        *nb = mb_mapping->nb_registers;
+        return mb_mapping->tab_registers;
+    default:
+        *start = mb_mapping->start_input_registers;
+        *nb = mb_mapping->nb_input_registers;
+        return mb_mapping->tab_input_registers;
+    }
+}
+
+/* Finds the storage of the nb values of a table starting at address.
+
+   The contiguous window is tried first, then the segments of the table with
+   a binary search. The range must be entirely inside the window or a single
+   segment. The function shall return the table holding the values and set
+   *index to the position of address in it, or return NULL if any value of
+   the range isn't mapped. */
+void *modbus_mapping_lookup(const modbus_mapping_t *mb_mapping, int table,
+                            int address, int nb, int *index)
+{
+    const modbus_segment_t *segments;
+    int start;
+    int count;
+    int lo;
+    int hi;
+    void *tab;
+
+    tab = mapping_window(mb_mapping, table, &start, &count);
+    if (address >= start && address + nb <= start + count) {
+        *index = address - start;
+        return tab;
+    }
+
+    /* Find the last segment starting at or before address */
+    segments = mb_mapping->segments[table];
+    lo = 0;
+    hi = mb_mapping->nb_segments[table];
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+
+        if (segments[mid].start <= address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo > 0 && address + nb <= segments[lo - 1].start + segments[lo - 1].nb) {
+        *index = address - segments[lo - 1].start;
+        return segments[lo - 1].tab;
+    }
+
+    return NULL;
+}
+
+/* Returns the position of a range of a table among its segments, sorted by
+   start address, or -1 if it overlaps or adjoins one of them */
+static int segment_position(const modbus_mapping_t *mb_mapping, int table,
+                            int start, int nb)
+{
+    const modbus_segment_t *segments = mb_mapping->segments[table];
+    int count = mb_mapping->nb_segments[table];
+    int i;
+
+    for (i = 0; i < count && segments[i].start < start; i++)
+        ;
+    if ((i > 0 && segments[i - 1].start + segments[i - 1].nb >= start) ||
+        (i < count && start + nb >= segments[i].start)) {
+        return -1;
+    }
+
+    return i;
+}
+
+/* Checks that a new contiguous window of nb values starting at address start
+   neither overlaps nor adjoins a segment of the table, which the window
+   would hide from requests. The function shall return 0 if so. Otherwise it
+   shall return -1 and set errno to EINVAL. */
+int modbus_mapping_check_window(const modbus_mapping_t *mb_mapping, int table,
+                                int start, int nb)
+{
+    if (mb_mapping == NULL || table < 0 || table >= MODBUS_TABLE_MAX ||
+        start < 0 || nb < 0 || start + nb > 0x10000 ||
+        (nb > 0 && segment_position(mb_mapping, table, start, nb) == -1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Adds a segment of nb values starting at address start to a table.
+
+   The values are allocated according to the storage flags of the mapping
+   and set to zero. The segment must neither overlap nor adjoin the
+   contiguous window or another segment of the table: a request is served
+   from a single block, so the values of two adjoining ranges couldn't be
+   accessed together and must be added as one segment. The function shall
+   return 0 if successful.
+   Otherwise it shall return -1 and set errno to EINVAL or ENOMEM. */
+int modbus_mapping_add_segment(modbus_mapping_t *mb_mapping, int table,
+                               int start, int nb)
+{
+    modbus_segment_t *segments;
+    int window_start;
+    int window_nb;
+    int count;
+    int i;
+    size_t size;
+    void *tab;
+
+    if (mb_mapping == NULL || table < 0 || table >= MODBUS_TABLE_MAX ||
+        start < 0 || nb < 1 || start + nb > 0x10000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mapping_window(mb_mapping, table, &window_start, &window_nb);
+    if (window_nb > 0 && start <= window_start + window_nb &&
+        window_start <= start + nb) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    i = segment_position(mb_mapping, table, start, nb);
+    if (i == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    segments = mb_mapping->segments[table];
+    count = mb_mapping->nb_segments[table];
+
+    if (table == MODBUS_TABLE_BITS || table == MODBUS_TABLE_INPUT_BITS) {
+        int packed = mb_mapping->flags & (table == MODBUS_TABLE_BITS ?
+                                          MODBUS_MAPPING_PACKED_BITS :
+                                          MODBUS_MAPPING_PACKED_INPUT_BITS);
+        size = packed ? (size_t)MODBUS_PACKED_BITS_SIZE(nb) : nb * sizeof(uint8_t);
+    } else {
+        size = nb * sizeof(uint16_t);
+    }
+
+    tab = malloc(size);
+    if (tab == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(tab, 0, size);
+
+    segments = (modbus_segment_t *)realloc(segments, (count + 1) * sizeof(modbus_segment_t));
+    if (segments == NULL) {
+        free(tab);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memmove(segments + i + 1, segments + i, (count - i) * sizeof(modbus_segment_t));
+    segments[i].start = start;
+    segments[i].nb = nb;
+    segments[i].tab = tab;
+
+    mb_mapping->segments[table] = segments;
+    mb_mapping->nb_segments[table] = count + 1;
+
+    /* Without a dirty bitmap covering it, writes to the segment would go
+       unnoticed */
+    if (mb_mapping->dirty[table] != NULL &&
+        modbus_mapping_set_dirty_tracking(mb_mapping, table,
+                                          mb_mapping->dirty[table]->shift) == -1) {
+        memmove(segments + i, segments + i + 1, (count - i) * sizeof(modbus_segment_t));
+        mb_mapping->nb_segments[table] = count;
+        free(tab);
+        return -1;
+    }
+    mb_mapping->generation = mb_mapping->generation + 1;
+
+    return 0;
+}
+
+/* Sets the function called after a request wrote to the tables of the
+   mapping, with data, the table (MODBUS_TABLE_BITS or MODBUS_TABLE_REGISTERS),
+   the first address written and the number of values. It is called once per
+   request, after the response has been sent. NULL disables it. */
+void modbus_mapping_set_write_callback(modbus_mapping_t *mb_mapping,
+                                       modbus_write_callback_t cb, void *data)
+{
+    if (mb_mapping == NULL) {
+        return;
+    }
+
+    mb_mapping->write_cb = cb;
+    mb_mapping->write_cb_data = data;
+}
+
+/* Adds a handler computing nb values of table from start on when a request
+   reads them.
+
+   Before a read request (or the read part of a write and read registers
+   request) is answered, cb(data, table, address, nb) is called for the part
+   of the requested range it covers and must store the values in the tables,
+   where they are then read as usual; a non-zero return answers the request
+   with a server failure exception. With a ttl_ms other than 0 the whole range
+   of the handler is computed at once and not again for ttl_ms milliseconds.
+   The range must be mapped, in the window or a single segment of the table,
+   and must not overlap another handler of the table.
+
+   The function shall return 0 if successful. Otherwise it shall return -1 and
+   set errno to EINVAL or ENOMEM. */
+int modbus_mapping_add_read_handler(modbus_mapping_t *mb_mapping, int table,
+                                    int start, int nb, modbus_read_callback_t cb,
+                                    void *data, uint32_t ttl_ms)
+{
+    modbus_read_handler_t *handlers;
+    int index;
+    int i;
+
+    if (mb_mapping == NULL || table < 0 || table >= MODBUS_TABLE_MAX ||
+        nb < 1 || cb == NULL ||
+        modbus_mapping_lookup(mb_mapping, table, start, nb, &index) == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < mb_mapping->nb_read_handlers; i++) {
+        const modbus_read_handler_t *other = &mb_mapping->read_handlers[i];
+
+        if (other->table == table && start < other->start + other->nb &&
+            other->start < start + nb) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    handlers = (modbus_read_handler_t *)realloc(
+        mb_mapping->read_handlers,
+        (mb_mapping->nb_read_handlers + 1) * sizeof(modbus_read_handler_t));
+    if (handlers == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    handlers[mb_mapping->nb_read_handlers].table = table;
+    handlers[mb_mapping->nb_read_handlers].start = start;
+    handlers[mb_mapping->nb_read_handlers].nb = nb;
+    handlers[mb_mapping->nb_read_handlers].cb = cb;
+    handlers[mb_mapping->nb_read_handlers].data = data;
+    handlers[mb_mapping->nb_read_handlers].ttl_ms = ttl_ms;
+    handlers[mb_mapping->nb_read_handlers].last_ms = 0;
+    handlers[mb_mapping->nb_read_handlers].valid = FALSE;
+
+    mb_mapping->read_handlers = handlers;
+    mb_mapping->nb_read_handlers++;
+
+    return 0;
+}
+
+/* Removes all read handlers */
+void modbus_mapping_free_read_handlers(modbus_mapping_t *mb_mapping)
+{
+    if (mb_mapping == NULL) {
+        return;
+    }
+
+    free(mb_mapping->read_handlers);
+    mb_mapping->read_handlers = NULL;
+    mb_mapping->nb_read_handlers = 0;
+}
+
+/* Starts an update of the tables that requests must see whole or not at all.
+
+   Between modbus_mapping_begin_update() and modbus_mapping_end_update(), the
+   producer (the main loop, an ISR or another thread, but only one at a time)
+   writes the tables directly. A reply copying values concurrently notices it
+   from the sequence count and copies them again, and answers with a server
+   busy exception after MODBUS_SEQLOCK_MAX_RETRIES attempts. Interrupts are
+   never disabled. Keep updates short: a reply interrupted by more updates
+   than the count can tell apart (128 on AVR) may not notice them. */
+void modbus_mapping_begin_update(modbus_mapping_t *mb_mapping)
+{
+    mb_mapping->seq = mb_mapping->seq + 1;
+    _MODBUS_SEQ_BARRIER();
+}
+
+/* Publishes the update started by modbus_mapping_begin_update() */
+void modbus_mapping_end_update(modbus_mapping_t *mb_mapping)
+{
+    _MODBUS_SEQ_BARRIER();
+    mb_mapping->generation = mb_mapping->generation + 1;
+    mb_mapping->seq = mb_mapping->seq + 1;
+}
+
+/* Tells the response caches (see modbus_set_response_cache()) that values
+   were written to the tables directly */
+void modbus_mapping_touch(modbus_mapping_t *mb_mapping)
+{
+    mb_mapping->generation = mb_mapping->generation + 1;
+}
+
+/* Number of blocks of 2^shift addresses holding the addresses start to
+   end - 1 */
+#define DIRTY_NB_BLOCKS(start, end, shift) ((((end) - 1) >> (shift)) - ((start) >> (shift)) + 1)
+
+static int dirty_ctz(uint32_t word)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzl(word);
+#else
+    int n = 0;
+
+    while (!(word & 1)) {
+        word >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/* Allocates a clean bitmap covering the ranges of table mapped now, the
+   window taking its place among the segments sorted by start address */
+static modbus_dirty_t *dirty_new(const modbus_mapping_t *mb_mapping, int table,
+                                 int shift)
+{
+    const modbus_segment_t *segments = mb_mapping->segments[table];
+    int nb_segments = mb_mapping->nb_segments[table];
+    modbus_dirty_t *dirty;
+    int window_start;
+    int window_nb;
+    int nb_ranges;
+    long nb_bits;
+    long nb_words;
+    int i;
+    int j;
+
+    mapping_window(mb_mapping, table, &window_start, &window_nb);
+    nb_ranges = nb_segments + (window_nb > 0);
+    nb_bits = window_nb > 0 ?
+        DIRTY_NB_BLOCKS((long)window_start, (long)window_start + window_nb, shift) : 0;
+    for (j = 0; j < nb_segments; j++) {
+        nb_bits += DIRTY_NB_BLOCKS((long)segments[j].start,
+                                   (long)segments[j].start + segments[j].nb, shift);
+    }
+    nb_words = (nb_bits + 31) >> 5;
+
+    dirty = (modbus_dirty_t *)malloc(sizeof(modbus_dirty_t) +
+                                     nb_ranges * sizeof(modbus_dirty_range_t) +
+                                     nb_words * sizeof(uint32_t));
+    if (dirty == NULL) {
+        return NULL;
+    }
+
+    dirty->shift = shift;
+    dirty->nb_ranges = nb_ranges;
+    dirty->ranges = (modbus_dirty_range_t *)(dirty + 1);
+    dirty->nb_words = nb_words;
+    dirty->words = (uint32_t *)(dirty->ranges + nb_ranges);
+    memset(dirty->words, 0, nb_words * sizeof(uint32_t));
+
+    nb_bits = 0;
+    for (i = 0, j = 0; i < nb_ranges; i++) {
+        modbus_dirty_range_t *range = &dirty->ranges[i];
+
+        if (window_nb > 0 && (j == nb_segments || window_start < segments[j].start)) {
+            range->start = window_start;
+            range->end = (long)window_start + window_nb;
+            window_nb = 0;
+        } else {
+            range->start = segments[j].start;
+            range->end = (long)segments[j].start + segments[j].nb;
+            j++;
+        }
+        range->bit = nb_bits;
+        nb_bits += DIRTY_NB_BLOCKS(range->start, range->end, shift);
+    }
+
+    return dirty;
+}
+
+/* Marks the blocks holding the values address to address + nb - 1 as dirty,
+   in the ranges of the bitmap only */
+static void dirty_mark(modbus_dirty_t *dirty, long address, long nb)
+{
+    int i;
+
+    for (i = 0; i < dirty->nb_ranges && dirty->ranges[i].start < address + nb; i++) {
+        const modbus_dirty_range_t *range = &dirty->ranges[i];
+        long base = range->bit - (range->start >> dirty->shift);
+        long first;
+        long last;
+
+        if (range->end <= address) {
+            continue;
+        }
+        first = base + ((address > range->start ? address : range->start) >> dirty->shift);
+        last = base + ((address + nb < range->end ? address + nb - 1 : range->end - 1) >>
+                       dirty->shift);
+
+        /* A word at a time */
+        while (first <= last) {
+            int bit = first & 31;
+            int n = 32 - bit;
+
+            if (n > last - first + 1) {
+                n = last - first + 1;
+            }
+            dirty->words[first >> 5] |= (n == 32) ? 0xFFFFFFFFUL :
+                (((uint32_t)1 << n) - 1) << bit;
+            first += n;
+        }
+    }
+}
+
+/* Keeps the runs of another bitmap dirty, see dirty_runs() */
+static void dirty_keep(void *data, int table, int address, int nb)
+{
+    dirty_mark((modbus_dirty_t *)data, address, nb);
+}
+
+/* Calls cb(data, table, address, nb) for each run of dirty blocks of the
+   bitmap, limited to its ranges, and returns the number of runs */
+static int dirty_runs(const modbus_dirty_t *dirty, int table,
+                      modbus_write_callback_t cb, void *data)
+{
+    int nb_runs = 0;
+    int i;
+
+    for (i = 0; i < dirty->nb_ranges; i++) {
+        const modbus_dirty_range_t *range = &dirty->ranges[i];
+        long base = (range->start >> dirty->shift) - range->bit;
+        long end_bit = range->bit + DIRTY_NB_BLOCKS(range->start, range->end, dirty->shift);
+        long b = range->bit;
+        long run = -1;
+
+        for (;;) {
+            long next = end_bit;
+
+            if (b < end_bit) {
+                uint32_t word = dirty->words[b >> 5];
+                uint32_t rest = (run < 0 ? word : ~word) >> (b & 31);
+
+                /* Nothing starts or ends in the rest of this word */
+                if (rest == 0) {
+                    b = (b | 31) + 1;
+                    continue;
+                }
+                next = b + dirty_ctz(rest);
+                if (next > end_bit) {
+                    next = end_bit;
+                }
+            }
+
+            if (run >= 0) {
+                long start = (base + run) << dirty->shift;
+                long end = (base + next) << dirty->shift;
+
+                if (start < range->start) {
+                    start = range->start;
+                }
+                if (end > range->end) {
+                    end = range->end;
+                }
+                cb(data, table, (int)start, (int)(end - start));
+                nb_runs++;
+                run = -1;
+            } else if (next < end_bit) {
+                run = next;
+            }
+
+            if (next == end_bit) {
+                break;
+            }
+            b = next;
+        }
+    }
+
+    return nb_runs;
+}
+
+/* Sizes the dirty bitmap of a table again after its ranges changed, the old
+   one covering its own ranges is kept if there's no memory */
+static void dirty_resize(modbus_mapping_t *mb_mapping, int table)
+{
+    if (mb_mapping->dirty[table] != NULL) {
+        modbus_mapping_set_dirty_tracking(mb_mapping, table, mb_mapping->dirty[table]->shift);
+    }
+}
+
+/* Enables the dirty bitmap of table (MODBUS_TABLE_BITS or
+   MODBUS_TABLE_REGISTERS), one bit per block of 2^block_shift addresses of
+   each range of the table, the window and every segment, so its size follows
+   the values mapped rather than the address space. A block_shift of -1
+   disables it and frees the bitmap.
+
+   The bitmap covers the ranges mapped when it is sized:
+   modbus_mapping_add_segment(), modbus_mapping_init_arena() and
+   modbus_mapping_free_segments() size it again, and so does calling this
+   function again after changing the window of the table directly. The
+   blocks still mapped then stay dirty.
+
+   The function shall return 0 if successful. Otherwise it shall return -1 and
+   set errno to EINVAL or ENOMEM, the bitmap being left as it was. */
+int modbus_mapping_set_dirty_tracking(modbus_mapping_t *mb_mapping, int table,
+                                      int block_shift)
+{
+    modbus_dirty_t *dirty;
+
+    if (mb_mapping == NULL ||
+        (table != MODBUS_TABLE_BITS && table != MODBUS_TABLE_REGISTERS) ||
+        block_shift < -1 || block_shift > 16) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (block_shift == -1) {
+        free(mb_mapping->dirty[table]);
+        mb_mapping->dirty[table] = NULL;
+        return 0;
+    }
+
+    dirty = dirty_new(mb_mapping, table, block_shift);
+    if (dirty == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (mb_mapping->dirty[table] != NULL) {
+        dirty_runs(mb_mapping->dirty[table], table, dirty_keep, dirty);
+        free(mb_mapping->dirty[table]);
+    }
+    mb_mapping->dirty[table] = dirty;
+
+    return 0;
+}
+
+/* Marks the blocks holding nb values of table from address on as dirty */
+void modbus_mapping_set_dirty(modbus_mapping_t *mb_mapping, int table,
+                              int address, int nb)
+{
+    if (mb_mapping == NULL || table < 0 || table >= MODBUS_TABLE_MAX ||
+        mb_mapping->dirty[table] == NULL || nb < 1) {
+        return;
+    }
+
+    dirty_mark(mb_mapping->dirty[table], address, nb);
+}
+
+/* Calls cb(data, table, address, nb) for each run of consecutive dirty
+   blocks of table, in ascending order. Only the words of the mapped ranges
+   are walked, clean ones are skipped whole and the bounds of a run are found
+   with count trailing zeros, so the cost depends on the number of words and
+   runs, not of values. The runs cover whole blocks but never go past the
+   range holding them, so they fit the address and nb of the callback.
+
+   The function shall return the number of runs, or -1 and set errno to
+   EINVAL if dirty tracking isn't enabled for the table. */
+int modbus_mapping_for_each_dirty(const modbus_mapping_t *mb_mapping, int table,
+                                  modbus_write_callback_t cb, void *data)
+{
+    if (mb_mapping == NULL || table < 0 || table >= MODBUS_TABLE_MAX ||
+        mb_mapping->dirty[table] == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return dirty_runs(mb_mapping->dirty[table], table, cb, data);
+}
+
+/* Marks all the blocks of table as clean */
+void modbus_mapping_clear_dirty(modbus_mapping_t *mb_mapping, int table)
+{
+    if (mb_mapping == NULL || table < 0 || table >= MODBUS_TABLE_MAX ||
+        mb_mapping->dirty[table] == NULL) {
+        return;
+    }
+
+    memset(mb_mapping->dirty[table]->words, 0,
+           mb_mapping->dirty[table]->nb_words * sizeof(uint32_t));
+}
+
+/* Frees the segments of all tables */
+void modbus_mapping_free_segments(modbus_mapping_t *mb_mapping)
+{
+    int table;
+    int i;
+
+    if (mb_mapping == NULL) {
+        return;
+    }
+
+    for (table = 0; table < MODBUS_TABLE_MAX; table++) {
+        for (i = 0; i < mb_mapping->nb_segments[table]; i++) {
+            free(mb_mapping->segments[table][i].tab);
+        }
+        free(mb_mapping->segments[table]);
+        mb_mapping->segments[table] = NULL;
+        mb_mapping->nb_segments[table] = 0;
+        dirty_resize(mb_mapping, table);
+    }
+    mb_mapping->generation = mb_mapping->generation + 1;
+}
+
 #ifndef HAVE_STRLCPY
 /*
  * Function strlcpy was originally developed by
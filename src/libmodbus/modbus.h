@@ -6,6 +6,7 @@
 #else
 #include "stdint.h"
 #endif
+#include <stddef.h>
 
 #include "modbus-version.h"
 
@@ -60,8 +61,49 @@ MODBUS_BEGIN_DECLS
 #define MODBUS_FC_MASK_WRITE_REGISTER       0x16
 #define MODBUS_FC_WRITE_AND_READ_REGISTERS  0x17
 
+/* Standard function codes answered by modbus_reply(), one bit per function
+ * code. Define it to a subset before building the library to leave out the
+ * code of the unused functions, they are then answered with an illegal
+ * function exception. */
+#ifndef MODBUS_SERVER_FUNCTIONS
+#define MODBUS_SERVER_FUNCTIONS \
+    ((1UL << MODBUS_FC_READ_COILS) | \
+     (1UL << MODBUS_FC_READ_DISCRETE_INPUTS) | \
+     (1UL << MODBUS_FC_READ_HOLDING_REGISTERS) | \
+     (1UL << MODBUS_FC_READ_INPUT_REGISTERS) | \
+     (1UL << MODBUS_FC_WRITE_SINGLE_COIL) | \
+     (1UL << MODBUS_FC_WRITE_SINGLE_REGISTER) | \
+     (1UL << MODBUS_FC_READ_EXCEPTION_STATUS) | \
+     (1UL << MODBUS_FC_WRITE_MULTIPLE_COILS) | \
+     (1UL << MODBUS_FC_WRITE_MULTIPLE_REGISTERS) | \
+     (1UL << MODBUS_FC_REPORT_SLAVE_ID) | \
+     (1UL << MODBUS_FC_MASK_WRITE_REGISTER) | \
+     (1UL << MODBUS_FC_WRITE_AND_READ_REGISTERS))
+#endif
+
+/* User defined function codes (0x41 to 0x48 and 0x64 to 0x6E) */
+#define MODBUS_IS_USER_FUNCTION(function) \
+    (((function) >= 0x41 && (function) <= 0x48) || ((function) >= 0x64 && (function) <= 0x6E))
+
 #define MODBUS_BROADCAST_ADDRESS    0
 
+/* Largest number of read responses a context can cache, see
+ * modbus_set_response_cache() */
+#define MODBUS_MAX_CACHED_RESPONSES 16
+
+/* Set to 0 to leave out the exception and report slave ID responses built
+ * with their checksum when the slave address is set (about 210 bytes per
+ * context), they are then built for each request like other responses */
+#ifndef MODBUS_FIXED_RESPONSES
+#define MODBUS_FIXED_RESPONSES      1
+#endif
+
+/* Number of units a server context can answer for besides its own slave
+ * address, see modbus_add_unit() */
+#ifndef MODBUS_MAX_UNITS
+#define MODBUS_MAX_UNITS            32
+#endif
+
 /* Modbus_Application_Protocol_V1_1b.pdf (chapter 6 section 1 page 12)
  * Quantity of Coils to read (2 bytes): 1 to 2000 (0x7D0)
  * (chapter 6 section 11 page 29)
@@ -147,6 +189,75 @@ extern const unsigned int libmodbus_version_micro;
 
 typedef struct _modbus modbus_t;
 
+/* Tables of a mapping */
+enum {
+    MODBUS_TABLE_BITS = 0,
+    MODBUS_TABLE_INPUT_BITS,
+    MODBUS_TABLE_REGISTERS,
+    MODBUS_TABLE_INPUT_REGISTERS,
+    MODBUS_TABLE_MAX
+};
+
+/* A range of addresses of a table with its own storage */
+typedef struct {
+    int start;
+    int nb;
+    void *tab;
+} modbus_segment_t;
+
+/* Called after a request wrote nb values of table from address on */
+typedef void (*modbus_write_callback_t)(void *data, int table, int address, int nb);
+
+/* Computes nb values of table from address on, see
+ * modbus_mapping_add_read_handler(). Returns 0 on success. */
+typedef int (*modbus_read_callback_t)(void *data, int table, int address, int nb);
+
+typedef struct {
+    int table;
+    int start;
+    int nb;
+    modbus_read_callback_t cb;
+    void *data;
+    /* Cache lifetime, 0 to compute on every read */
+    uint32_t ttl_ms;
+    uint32_t last_ms;
+    int valid;
+} modbus_read_handler_t;
+
+/* Answers a user defined function code. req points to the request data
+ * following the function code (req_length bytes), the response data following
+ * the function code are written to rsp (at most rsp_max_length bytes).
+ * Returns the length of the response data, or the opposite of an exception
+ * code (e.g. -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE) to answer with. */
+typedef int (*modbus_function_handler_t)(void *data, const uint8_t *req, int req_length,
+                                         uint8_t *rsp, int rsp_max_length);
+
+/* Mapped range of a table covered by a dirty bitmap: addresses start to
+ * end - 1, whose first block is bit number bit of the bitmap */
+typedef struct {
+    long start;
+    long end;
+    long bit;
+} modbus_dirty_range_t;
+
+/* Dirty bitmap of a table, one bit per block of 2^shift addresses of each
+ * range mapped when it was sized, see modbus_mapping_set_dirty_tracking() */
+typedef struct {
+    int shift;
+    int nb_ranges;
+    modbus_dirty_range_t *ranges;
+    long nb_words;
+    uint32_t *words;
+} modbus_dirty_t;
+
+/* Sequence count of the mapping updates, a type the target reads and
+ * writes atomically */
+#if defined(__AVR__)
+typedef uint8_t modbus_seq_t;
+#else
+typedef uint32_t modbus_seq_t;
+#endif
+
 typedef struct {
     int nb_bits;
     int start_bits;
@@ -160,8 +271,62 @@ typedef struct {
     uint8_t *tab_input_bits;
     uint16_t *tab_input_registers;
     uint16_t *tab_registers;
+    /* Storage layout of the tables (MODBUS_MAPPING_* flags) */
+    int flags;
+    /* Disjoint ranges served in addition to the start_ and nb_ windows, sorted
+     * by start address and indexed by MODBUS_TABLE_* */
+    modbus_segment_t *segments[MODBUS_TABLE_MAX];
+    int nb_segments[MODBUS_TABLE_MAX];
+    /* See modbus_mapping_set_write_callback() */
+    modbus_write_callback_t write_cb;
+    void *write_cb_data;
+    /* Blocks written by requests, see modbus_mapping_set_dirty_tracking() */
+    modbus_dirty_t *dirty[MODBUS_TABLE_MAX];
+    modbus_read_handler_t *read_handlers;
+    int nb_read_handlers;
+    /* Odd while an update is in progress, see modbus_mapping_begin_update() */
+    volatile modbus_seq_t seq;
+    /* Changed by every write to the tables and change of their layout, see
+     * modbus_mapping_touch() */
+    volatile uint32_t generation;
 } modbus_mapping_t;
 
+/* Storage flags of modbus_mapping_t.
+ * A packed bit table stores 8 bits per byte, LSB first, which is the layout
+ * used on the wire by the read/write bits functions. */
+#define MODBUS_MAPPING_PACKED_BITS          (1 << 0)
+#define MODBUS_MAPPING_PACKED_INPUT_BITS    (1 << 1)
+/* A wire order register table stores each register big-endian, as on the
+ * wire, so read and write registers requests are served with memcpy. Use
+ * MODBUS_GET_WIRE_REGISTER/MODBUS_SET_WIRE_REGISTER to access it. */
+#define MODBUS_MAPPING_WIRE_REGISTERS       (1 << 2)
+#define MODBUS_MAPPING_WIRE_INPUT_REGISTERS (1 << 3)
+
+/* Number of bytes needed to store nb bits in a packed bit table */
+#define MODBUS_PACKED_BITS_SIZE(nb) (((nb) + 7) / 8)
+
+/* Alignment of the tables carved out of an arena, see
+ * modbus_mapping_init_arena(). A power of two. */
+#ifndef MODBUS_ARENA_ALIGNMENT
+#  if defined(__AVR__)
+#    define MODBUS_ARENA_ALIGNMENT 2
+#  else
+#    define MODBUS_ARENA_ALIGNMENT 32
+#  endif
+#endif
+#define MODBUS_ARENA_ALIGN(size) \
+    (((size) + MODBUS_ARENA_ALIGNMENT - 1) & ~((size_t)MODBUS_ARENA_ALIGNMENT - 1))
+
+/* Bytes of arena needed by the four tables with the given storage flags, a
+ * constant expression when its arguments are */
+#define MODBUS_MAPPING_ARENA_SIZE(flags, nb_bits, nb_input_bits, nb_registers, nb_input_registers) \
+    (MODBUS_ARENA_ALIGN((size_t)(nb_registers) * 2) + \
+     MODBUS_ARENA_ALIGN((size_t)(nb_input_registers) * 2) + \
+     MODBUS_ARENA_ALIGN((size_t)(((flags) & MODBUS_MAPPING_PACKED_BITS) ? \
+                                 MODBUS_PACKED_BITS_SIZE(nb_bits) : (nb_bits))) + \
+     MODBUS_ARENA_ALIGN((size_t)(((flags) & MODBUS_MAPPING_PACKED_INPUT_BITS) ? \
+                                 MODBUS_PACKED_BITS_SIZE(nb_input_bits) : (nb_input_bits))))
+
 typedef enum
 {
     MODBUS_ERROR_RECOVERY_NONE          = 0,
@@ -169,8 +334,21 @@ typedef enum
     MODBUS_ERROR_RECOVERY_PROTOCOL      = (1<<2)
 } modbus_error_recovery_mode;
 
+/* How the input is discarded after a malformed request or response */
+typedef enum
+{
+    /* Read until the line has been silent for 3.5 characters (T3.5), the end
+     * of the frame, bounded by the response timeout */
+    MODBUS_FLUSH_T35                    = 0,
+    /* Wait for the whole response timeout, then drop what was received */
+    MODBUS_FLUSH_TIMEOUT
+} modbus_flush_mode;
+
 MODBUS_API int modbus_set_slave(modbus_t* ctx, int slave);
 MODBUS_API int modbus_set_error_recovery(modbus_t *ctx, modbus_error_recovery_mode error_recovery);
+MODBUS_API int modbus_set_flush_mode(modbus_t *ctx, modbus_flush_mode flush_mode);
+MODBUS_API int modbus_set_retry_window(modbus_t *ctx, uint32_t window_ms);
+MODBUS_API int modbus_set_response_cache(modbus_t *ctx, int nb_entries);
 MODBUS_API int modbus_set_socket(modbus_t *ctx, int s);
 MODBUS_API int modbus_get_socket(modbus_t *ctx);
 
@@ -214,7 +392,36 @@ MODBUS_API modbus_mapping_t* modbus_mapping_new_start_address(
 
 MODBUS_API modbus_mapping_t* modbus_mapping_new(int nb_bits, int nb_input_bits,
                                                 int nb_registers, int nb_input_registers);
+MODBUS_API int modbus_mapping_init_arena(
+    modbus_mapping_t *mb_mapping, void *arena, size_t size,
+    unsigned int start_bits, unsigned int nb_bits,
+    unsigned int start_input_bits, unsigned int nb_input_bits,
+    unsigned int start_registers, unsigned int nb_registers,
+    unsigned int start_input_registers, unsigned int nb_input_registers);
 MODBUS_API void modbus_mapping_free(modbus_mapping_t *mb_mapping);
+MODBUS_API void* modbus_mapping_lookup(const modbus_mapping_t *mb_mapping, int table,
+                                       int address, int nb, int *index);
+MODBUS_API int modbus_mapping_add_segment(modbus_mapping_t *mb_mapping, int table,
+                                          int start, int nb);
+MODBUS_API int modbus_mapping_check_window(const modbus_mapping_t *mb_mapping, int table,
+                                           int start, int nb);
+MODBUS_API void modbus_mapping_free_segments(modbus_mapping_t *mb_mapping);
+MODBUS_API void modbus_mapping_set_write_callback(modbus_mapping_t *mb_mapping,
+                                                  modbus_write_callback_t cb, void *data);
+MODBUS_API int modbus_mapping_add_read_handler(modbus_mapping_t *mb_mapping, int table,
+                                               int start, int nb, modbus_read_callback_t cb,
+                                               void *data, uint32_t ttl_ms);
+MODBUS_API void modbus_mapping_free_read_handlers(modbus_mapping_t *mb_mapping);
+MODBUS_API void modbus_mapping_begin_update(modbus_mapping_t *mb_mapping);
+MODBUS_API void modbus_mapping_end_update(modbus_mapping_t *mb_mapping);
+MODBUS_API void modbus_mapping_touch(modbus_mapping_t *mb_mapping);
+MODBUS_API int modbus_mapping_set_dirty_tracking(modbus_mapping_t *mb_mapping, int table,
+                                                 int block_shift);
+MODBUS_API void modbus_mapping_set_dirty(modbus_mapping_t *mb_mapping, int table,
+                                         int address, int nb);
+MODBUS_API int modbus_mapping_for_each_dirty(const modbus_mapping_t *mb_mapping, int table,
+                                             modbus_write_callback_t cb, void *data);
+MODBUS_API void modbus_mapping_clear_dirty(modbus_mapping_t *mb_mapping, int table);
 
 MODBUS_API int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length);
 
@@ -224,8 +431,13 @@ MODBUS_API int modbus_receive_confirmation(modbus_t *ctx, uint8_t *rsp);
 
 MODBUS_API int modbus_reply(modbus_t *ctx, const uint8_t *req,
                             int req_length, modbus_mapping_t *mb_mapping);
+MODBUS_API int modbus_register_function(modbus_t *ctx, int function,
+                                        modbus_function_handler_t handler, void *data,
+                                        int meta_length, int byte_count);
 MODBUS_API int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
                                       unsigned int exception_code);
+MODBUS_API int modbus_add_unit(modbus_t *ctx, int slave, modbus_mapping_t *mb_mapping);
+MODBUS_API modbus_mapping_t* modbus_get_unit(modbus_t *ctx, int slave);
 
 /**
  * UTILS FUNCTIONS
@@ -250,6 +462,14 @@ MODBUS_API int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
         tab_int16[(index)    ] = (value) >> 16; \
         tab_int16[(index) + 1] = (value); \
     } while (0)
+#define MODBUS_GET_WIRE_REGISTER(tab_int16, index) \
+    ((uint16_t)((((const uint8_t *)(tab_int16))[2 * (index)] << 8) + \
+                ((const uint8_t *)(tab_int16))[2 * (index) + 1]))
+#define MODBUS_SET_WIRE_REGISTER(tab_int16, index, value) \
+    do { \
+        ((uint8_t *)(tab_int16))[2 * (index)] = (uint16_t)(value) >> 8; \
+        ((uint8_t *)(tab_int16))[2 * (index) + 1] = (value) & 0xFF; \
+    } while (0)
 #define MODBUS_SET_INT64_TO_INT16(tab_int16, index, value) \
     do { \
         tab_int16[(index)    ] = (value) >> 48; \
@@ -262,6 +482,22 @@ MODBUS_API void modbus_set_bits_from_byte(uint8_t *dest, int idx, const uint8_t
 MODBUS_API void modbus_set_bits_from_bytes(uint8_t *dest, int idx, unsigned int nb_bits,
                                        const uint8_t *tab_byte);
 MODBUS_API uint8_t modbus_get_byte_from_bits(const uint8_t *src, int idx, unsigned int nb_bits);
+MODBUS_API void modbus_set_packed_bits_from_bytes(uint8_t *dest, int idx, unsigned int nb_bits,
+                                                  const uint8_t *tab_byte);
+MODBUS_API int modbus_get_bytes_from_packed_bits(uint8_t *dest, const uint8_t *src, int idx,
+                                                 unsigned int nb_bits);
+/* Order of the bytes of a 32 bit value ABCD (A most significant) in two
+ * registers, first register first */
+typedef enum {
+    MODBUS_ORDER_ABCD = 0,
+    MODBUS_ORDER_DCBA,
+    MODBUS_ORDER_BADC,
+    MODBUS_ORDER_CDAB
+} modbus_byte_order_t;
+
+MODBUS_API uint32_t modbus_get_uint32(const uint16_t *src, int order);
+MODBUS_API void modbus_set_uint32(uint32_t value, uint16_t *dest, int order);
+
 MODBUS_API float modbus_get_float(const uint16_t *src);
 MODBUS_API float modbus_get_float_abcd(const uint16_t *src);
 MODBUS_API float modbus_get_float_dcba(const uint16_t *src);